@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""Packs a raw float32 weight file written by TrainNN.ipynb into binary or ternary bits.
+
+Every row of weights becomes one bit per weight plus a float32 scale, the same
+quantization quantizeToBits does in nn_layers.cpp: binary keeps the sign and
+scales by the mean |w| of the row, ternary zeroes the weights below 0.7 of that
+mean and scales by the mean |w| of the ones it keeps. The host picks the format
+from the extension, .b1 or .t2, and runs the layer with the XNOR/popcount kernel.
+Bias files stay float32.
+
+    python3 bitpack_weights.py fc1_weight.bin --format ternary -o fc1_weight.t2
+    ./host -fc1_weights=fc1_weight.t2
+
+The row count is read from the matching bias file (fc1_weight.bin -> fc1_bias.bin)
+unless --rows is given. With the MNIST test set the accuracy of the quantized
+networks is reported instead, fc1_bias.bin and the fc2 files are read from
+--model-dir. The activations are packed per image like bitLayer_CPU does:
+
+    python3 bitpack_weights.py fc1_weight.bin --report \\
+        --images t10k-images-idx3-ubyte --labels t10k-labels-idx1-ubyte
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+from weight_tools import load_test_set, read_floats, to_rows
+
+BIT_FILE_MAGIC = 0x54424E4D  # "MNBT", bitFileMagic in nn_layers.cpp
+
+
+def to_float32(value):
+    return struct.unpack("<f", struct.pack("<f", value))[0]
+
+
+def quantize_row(values, ternary):
+    """The scale and the codes in {-1, 0, +1} packBitRow gives a row"""
+    mean_abs = to_float32(sum(abs(x) for x in values) / len(values))
+    if not ternary:
+        return mean_abs, [-1 if x < 0.0 else 1 for x in values]
+    threshold = to_float32(0.7 * mean_abs)
+    codes = [0 if abs(x) < threshold else (-1 if x < 0.0 else 1) for x in values]
+    kept = [abs(x) for x, c in zip(values, codes) if c != 0]
+    return (to_float32(sum(kept) / len(kept)) if kept else 0.0), codes
+
+
+def pack_words(codes, select):
+    # Column c is bit c % 64 of word c // 64, the layout packBitRow writes
+    words = []
+    for start in range(0, len(codes), 64):
+        word = 0
+        for bit, code in enumerate(codes[start:start + 64]):
+            if select(code):
+                word |= 1 << bit
+        words.append(word)
+    return words
+
+
+def pack_matrix(rows, ternary):
+    scales, signs, non_zero = [], [], []
+    for row in rows:
+        scale, codes = quantize_row(row, ternary)
+        scales.append(scale)
+        signs += pack_words(codes, lambda code: code < 0)
+        if ternary:
+            non_zero += pack_words(codes, lambda code: code != 0)
+    header = struct.pack("<Iiii", BIT_FILE_MAGIC, int(ternary), len(rows), len(rows[0]))
+    body = struct.pack(f"<{len(scales)}f", *scales) + struct.pack(f"<{len(signs) + len(non_zero)}Q", *(signs + non_zero))
+    return header + body
+
+
+class Layer:
+    def __init__(self, weights, biases, quantization):
+        self.biases = biases
+        self.ternary = quantization == "ternary"
+        self.rows = weights
+        if quantization is not None:
+            self.rows = [quantize_row(row, self.ternary) for row in weights]
+
+    def forward(self, x):
+        if not isinstance(self.rows[0], tuple):
+            return [sum(a * w for a, w in zip(x, row)) + b for row, b in zip(self.rows, self.biases)]
+        input_scale, input_codes = quantize_row(x, self.ternary)
+        return [scale * input_scale * sum(a * w for a, w in zip(input_codes, codes)) + b
+                for (scale, codes), b in zip(self.rows, self.biases)]
+
+
+def accuracy(fc1, fc2, samples):
+    correct = 0
+    for x, label in samples:
+        hidden = [max(0.0, h) for h in fc1.forward(x)]
+        logits = fc2.forward(hidden)
+        correct += logits.index(max(logits)) == label
+    return correct / len(samples)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("weights", help="raw float32 weights, one row of inputs per output neuron")
+    parser.add_argument("--format", choices=("binary", "ternary"), default="ternary")
+    parser.add_argument("--rows", type=int, help="output neurons, defaults to the length of the bias file")
+    parser.add_argument("-o", "--output", help="defaults to the input name with .b1 or .t2")
+    parser.add_argument("--report", action="store_true", help="report the accuracy of the quantized networks")
+    parser.add_argument("--images", help="MNIST test images (t10k-images-idx3-ubyte)")
+    parser.add_argument("--labels", help="MNIST test labels (t10k-labels-idx1-ubyte)")
+    parser.add_argument("--limit", type=int, default=0, help="only use the first LIMIT test images")
+    parser.add_argument("--model-dir", default=".", help="directory of fc1_bias.bin and the fc2 files")
+    args = parser.parse_args()
+
+    weights = read_floats(args.weights)
+
+    if not args.report:
+        extension = ".b1" if args.format == "binary" else ".t2"
+        output = args.output or os.path.splitext(args.weights)[0] + extension
+        if not output.endswith(extension):
+            sys.exit(f"{output}: the host reads {args.format} weights only from {extension} files")
+        rows = args.rows
+        if rows is None:
+            bias_path = os.path.join(os.path.dirname(args.weights),
+                                     os.path.basename(args.weights).replace("weight", "bias"))
+            if bias_path == args.weights or not os.path.exists(bias_path):
+                sys.exit(f"{args.weights}: no bias file next to it, give --rows")
+            rows = len(read_floats(bias_path))
+        if rows <= 0 or len(weights) % rows != 0:
+            sys.exit(f"{args.weights}: {len(weights)} weights do not split into {rows} rows")
+
+        data = pack_matrix(to_rows(weights, rows), args.format == "ternary")
+        tmp_path = output + ".tmp"
+        with open(tmp_path, "wb") as f:
+            f.write(data)
+        os.replace(tmp_path, output)
+        print(f"{output}: {rows}x{len(weights) // rows} {args.format} weights, {len(data)} bytes"
+              f" instead of {4 * len(weights)}")
+        return
+
+    if not args.images or not args.labels:
+        sys.exit("--report needs --images and --labels")
+    fc1_bias = read_floats(os.path.join(args.model_dir, "fc1_bias.bin"))
+    fc2_weight = read_floats(os.path.join(args.model_dir, "fc2_weight.bin"))
+    fc2_bias = read_floats(os.path.join(args.model_dir, "fc2_bias.bin"))
+    if len(weights) % len(fc1_bias) != 0 or len(fc2_weight) != len(fc2_bias) * len(fc1_bias):
+        sys.exit("the weight files do not describe a 784 -> N -> 10 network")
+    fc1_rows = to_rows(weights, len(fc1_bias))
+    fc2_rows = to_rows(fc2_weight, len(fc2_bias))
+    samples = load_test_set(args.images, args.labels, args.limit)
+
+    # The configurations of -precision_report that quantize to bits. fc2 stays float32,
+    # its inputs come out of a ReLU and would all pack to +1.
+    configs = (("fp32", None, None), ("ternary_fc1", "ternary", None), ("binary_fc1", "binary", None))
+    print("format,accuracy")
+    for name, fc1_format, fc2_format in configs:
+        fc1 = Layer(fc1_rows, fc1_bias, fc1_format)
+        fc2 = Layer(fc2_rows, fc2_bias, fc2_format)
+        print(f"{name},{accuracy(fc1, fc2, samples):.4f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -224,13 +224,10 @@ struct BMPHeader {
 
 
 void flipImageVertically(unsigned char* data, int width, int height) {
-    unsigned char* tempRow = new unsigned char[width];
     for (int y = 0; y < height / 2; y++) {
-        memcpy(tempRow, data + y * width, width); // Copy top row to tempRow
-        memcpy(data + y * width, data + (height - y - 1) * width, width); // Copy bottom row to top
-        memcpy(data + (height - y - 1) * width, tempRow, width); // Copy tempRow to bottom
+        // Swap the top and bottom rows in place, no temporary row
+        std::swap_ranges(data + y * width, data + (y + 1) * width, data + (height - y - 1) * width);
     }
-    delete[] tempRow;
 }
 
 
@@ -250,7 +247,6 @@ unsigned char* loadBMPGrayscale(const char* filename, int* width, int* height) {
     file.read(reinterpret_cast<char*>(&bmpInfoHeader), sizeof(BMPInfoHeader));
 
     // Check for grayscale by expecting 8 bits per pixel
-    std::cout << bmpInfoHeader.bit_count << std::endl;
     if(bmpInfoHeader.bit_count != 8) {
         std::cerr << "Unsupported bit depth for grayscale (expected 8-bit)." << std::endl;
         return NULL;
@@ -270,6 +266,53 @@ unsigned char* loadBMPGrayscale(const char* filename, int* width, int* height) {
     return data;
 }
 
+
+// Reads an 8-bit BMP or a 24-bit gray one as saveImageGrayscale writes it (the blue
+// byte is taken), rows top to bottom whichever way the file stores them (a negative
+// height marks a top-down file), row padding dropped
+unsigned char* loadBMPGrayFrame(const char* filename, int* width, int* height) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Unable to open file " << filename << std::endl;
+        return NULL;
+    }
+
+    BMPFileHeader fileHeader;
+    file.read(reinterpret_cast<char*>(&fileHeader), sizeof(BMPFileHeader));
+    BMPInfoHeader bmpInfoHeader;
+    file.read(reinterpret_cast<char*>(&bmpInfoHeader), sizeof(BMPInfoHeader));
+
+    int bytesPerPixel = bmpInfoHeader.bit_count / 8;
+    if (!file || (bmpInfoHeader.bit_count != 8 && bmpInfoHeader.bit_count != 24) || bmpInfoHeader.width <= 0) {
+        std::cerr << filename << ": expected an 8-bit or 24-bit uncompressed BMP" << std::endl;
+        return NULL;
+    }
+
+    *width = bmpInfoHeader.width;
+    *height = abs(bmpInfoHeader.height);
+    bool bottomUp = bmpInfoHeader.height > 0;
+    int rowBytes = (*width * bytesPerPixel + 3) / 4 * 4;
+
+    std::vector<unsigned char> row(rowBytes);
+    unsigned char* data = new unsigned char[*width * *height];
+    file.seekg(fileHeader.offset_data, std::ios::beg);
+    for (int y = 0; y < *height; y++) {
+        file.read(reinterpret_cast<char*>(row.data()), rowBytes);
+        unsigned char* out = data + (bottomUp ? *height - 1 - y : y) * *width;
+        for (int x = 0; x < *width; x++) {
+            out[x] = row[x * bytesPerPixel];
+        }
+    }
+    if (!file) {
+        std::cerr << filename << ": truncated pixel data" << std::endl;
+        delete[] data;
+        return NULL;
+    }
+
+    file.close();
+    return data;
+}
+
 /*
 unsigned char* loadBMPGrayscale24bit(const char* filename, int* width, int* height) {
     std::ifstream file(filename, std::ios::binary);
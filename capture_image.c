@@ -4,6 +4,8 @@
 #include <sys/mman.h>
 #include <stdint.h>
 #include "bmp_utility.h"
+#include "trace.h"
+#include "frame_ring.h"
 
 #define HW_REGS_BASE (0xff200000)
 #define HW_REGS_SPAN (0x00200000)
@@ -23,7 +25,113 @@
 #define SCALED_WIDTH 28
 #define SCALED_HEIGHT 28
 
+// Reads the video buffer and converts it to grayscale
+static void captureFrame(volatile unsigned short *video_mem,
+                         unsigned short pixels[IMAGE_HEIGHT][IMAGE_WIDTH],
+                         unsigned char pixels_bw[IMAGE_HEIGHT][IMAGE_WIDTH]) {
+    int x, y;
+    for (y = 0; y < IMAGE_HEIGHT; y++) {
+        for (x = 0; x < IMAGE_WIDTH; x++) {
+            pixels[y][x] = *(video_mem + (y << 9) + x);
+            int red = (pixels[y][x] >> 11) & 0x1f;
+            int green = (pixels[y][x] >> 5) & 0x3f;
+            int blue = pixels[y][x] & 0x1f;
+            int red8 = (red << 3) | (red >> 2);
+            int green8 = (green << 2) | (green >> 4);
+            int blue8 = (blue << 3) | (blue >> 2);
+            int gray8 = (red8 + green8 + blue8) / 3;
+            int red5 = gray8 >> 3;
+            int green6 = gray8 >> 2;
+            int blue5 = gray8 >> 3;
+            pixels_bw[y][x] = (red5 << 11) | (green6 << 5) | blue5;
+        }
+    }
+}
+
+
+// 8-bit gray level of a pixels_bw entry. pixels_bw keeps the low byte of the RGB565
+// gray pixel, so use the blue channel (same as red and green due to grayscale conversion)
+static inline int grayLevel(unsigned char pixel) {
+    int gray = pixel & 0x1f;
+    return (gray << 3) | (gray >> 2); // Convert back to 8-bit
+}
+
+// Downscales the grayscale frame to SCALED_WIDTH x SCALED_HEIGHT, rows top to bottom
+static void downscaleFrame(unsigned char pixels_bw[IMAGE_HEIGHT][IMAGE_WIDTH], unsigned char *scaled) {
+    // Calculate the scaling factor
+    float scale_x = (float)IMAGE_WIDTH / SCALED_WIDTH;  // 240 / 28 ≈ 8.57
+    float scale_y = (float)IMAGE_HEIGHT / SCALED_HEIGHT; // 240 / 28 ≈ 8.57
+
+    // Downscale the image by averaging blocks of pixels
+    for (int sy = 0; sy < SCALED_HEIGHT; sy++) {
+        for (int sx = 0; sx < SCALED_WIDTH; sx++) {
+            // Calculate the corresponding block in the original image
+            int start_x = (int)(sx * scale_x);
+            int start_y = (int)(sy * scale_y);
+            int end_x = (int)((sx + 1) * scale_x);
+            int end_y = (int)((sy + 1) * scale_y);
+
+            // Ensure we don't go out of bounds
+            if (end_x > IMAGE_WIDTH) end_x = IMAGE_WIDTH;
+            if (end_y > IMAGE_HEIGHT) end_y = IMAGE_HEIGHT;
+
+            // Sum the grayscale values in the block
+            int sum = 0;
+            int count = 0;
+            for (int y = start_y; y < end_y; y++) {
+                for (int x = start_x; x < end_x; x++) {
+                    sum += grayLevel(pixels_bw[y][x]);
+                    count++;
+                }
+            }
+
+            // Compute the average and store in the scaled image
+            scaled[sy * SCALED_WIDTH + sx] = (unsigned char)(sum / count);
+        }
+    }
+}
+
+
+// Captures continuously into the shared-memory ring until the button is pressed,
+// every frame is downscaled straight into its ring slot. A frame captured while
+// the ring is full is dropped as an overrun, the next capture paces the retry.
+static int streamFrames(const char *ringName, volatile unsigned short *video_mem, volatile unsigned int *key_ptr) {
+    FrameRing ring;
+    if (!ring.open(ringName)) {
+        return 1;
+    }
+    printf("streaming frames to %s, press a button to stop\n", ringName);
+
+    static unsigned short pixels[IMAGE_HEIGHT][IMAGE_WIDTH];
+    static unsigned char pixels_bw[IMAGE_HEIGHT][IMAGE_WIDTH];
+
+    while (*key_ptr == 7) {
+        long frame = (long)ring.captured(); // the seq publish() gives this frame
+        {
+            TraceSpan span("frame_capture", "capture", frame);
+            captureFrame(video_mem, pixels, pixels_bw);
+        }
+        FrameSlot *slot = ring.reserve();
+        if (!slot) {
+            continue; // the consumer is behind, this frame is counted as an overrun
+        }
+        {
+            TraceSpan span("downscale", "capture", frame);
+            downscaleFrame(pixels_bw, slot->pixels);
+        }
+        ring.publish();
+    }
+
+    printf("captured:%llu overruns:%llu\n", (unsigned long long)ring.captured(), (unsigned long long)ring.overruns());
+    return 0;
+}
+
+
 int main(void) {
+    // Set MNIST_TRACE=<file> to record a Chrome trace of this capture
+    traceStartFromEnv();
+    const long frame = 0; // one frame is captured per run
+
     volatile unsigned int *video_in_dma = NULL;
     volatile unsigned int *key_ptr = NULL;
     volatile unsigned short *video_mem = NULL;
@@ -69,6 +177,18 @@ int main(void) {
 
     printf("enabled video:0x%x\n", value);
 
+    // Set MNIST_FRAME_RING=<name> to stream frames to the inference host instead of writing BMP files
+    const char* ringName = getenv("MNIST_FRAME_RING");
+    if (ringName && ringName[0] != '\0') {
+        int result = streamFrames(ringName, video_mem, key_ptr);
+        *(video_in_dma + 3) = 0x0;
+        munmap(virtual_base, HW_REGS_SPAN);
+        munmap(video_base, IMAGE_SPAN);
+        close(fd);
+        traceFinish();
+        return result;
+    }
+
     while (1) {
         value = *key_ptr;
         if (*key_ptr != 7) {
@@ -88,73 +208,49 @@ int main(void) {
     unsigned char pixels_bw[IMAGE_HEIGHT][IMAGE_WIDTH];
 
     // Capture the image and convert to grayscale
-    int x, y;
-    for (y = 0; y < IMAGE_HEIGHT; y++) {
-        for (x = 0; x < IMAGE_WIDTH; x++) {
-            pixels[y][x] = *(video_mem + (y << 9) + x);
-            int red = (pixels[y][x] >> 11) & 0x1f;
-            int green = (pixels[y][x] >> 5) & 0x3f;
-            int blue = pixels[y][x] & 0x1f;
-            int red8 = (red << 3) | (red >> 2);
-            int green8 = (green << 2) | (green >> 4);
-            int blue8 = (blue << 3) | (blue >> 2);
-            int gray8 = (red8 + green8 + blue8) / 3;
-            int red5 = gray8 >> 3;
-            int green6 = gray8 >> 2;
-            int blue5 = gray8 >> 3;
-            pixels_bw[y][x] = (red5 << 11) | (green6 << 5) | blue5;
-        }
+    {
+        TraceSpan span("frame_capture", "capture", frame);
+        captureFrame(video_mem, pixels, pixels_bw);
     }
 
     // Save the original 240x240 images
-    const char* filename = "final_image_color.bmp";
-    saveImageShort(filename, &pixels[0][0], 240, 240);
+    {
+        TraceSpan span("bmp_write", "io", frame);
+        const char* filename = "final_image_color.bmp";
+        saveImageShort(filename, &pixels[0][0], 240, 240);
 
-    const char* filename1 = "final_image_bw.bmp";
-    saveImageGrayscale(filename1, &pixels_bw[0][0], 240, 240);
+        const char* filename1 = "final_image_bw.bmp";
+        saveImageGrayscale(filename1, &pixels_bw[0][0], 240, 240);
+    }
+
+    // Save the full frame as 8-bit gray levels for ./host -detect=final_image_gray.bmp
+    {
+        TraceSpan span("bmp_write", "io", frame);
+        static unsigned char pixels_gray[IMAGE_HEIGHT][IMAGE_WIDTH];
+        for (int y = 0; y < IMAGE_HEIGHT; y++) {
+            for (int x = 0; x < IMAGE_WIDTH; x++) {
+                pixels_gray[y][x] = (unsigned char)grayLevel(pixels_bw[y][x]);
+            }
+        }
+        const char* filename_gray = "final_image_gray.bmp";
+        saveImageGrayscale(filename_gray, &pixels_gray[0][0], IMAGE_WIDTH, IMAGE_HEIGHT);
+    }
 
     // Step 1: Create an array to store the scaled 28x28 grayscale image
     unsigned char scaled_pixels_bw[SCALED_HEIGHT][SCALED_WIDTH];
 
-    // Step 2: Calculate the scaling factor
-    float scale_x = (float)IMAGE_WIDTH / SCALED_WIDTH;  // 240 / 28 ≈ 8.57
-    float scale_y = (float)IMAGE_HEIGHT / SCALED_HEIGHT; // 240 / 28 ≈ 8.57
-
-    // Step 3: Downscale the image by averaging blocks of pixels
-    for (int sy = 0; sy < SCALED_HEIGHT; sy++) {
-        for (int sx = 0; sx < SCALED_WIDTH; sx++) {
-            // Calculate the corresponding block in the original image
-            int start_x = (int)(sx * scale_x);
-            int start_y = (int)(sy * scale_y);
-            int end_x = (int)((sx + 1) * scale_x);
-            int end_y = (int)((sy + 1) * scale_y);
-
-            // Ensure we don't go out of bounds
-            if (end_x > IMAGE_WIDTH) end_x = IMAGE_WIDTH;
-            if (end_y > IMAGE_HEIGHT) end_y = IMAGE_HEIGHT;
-
-            // Sum the grayscale values in the block
-            int sum = 0;
-            int count = 0;
-            for (int y = start_y; y < end_y; y++) {
-                for (int x = start_x; x < end_x; x++) {
-                    // Extract the grayscale value from pixels_bw
-                    // Since pixels_bw is in RGB565 format, extract the gray value
-                    int gray = pixels_bw[y][x] & 0x1f; // Use blue channel (same as red and green due to grayscale conversion)
-                    int gray8 = (gray << 3) | (gray >> 2); // Convert back to 8-bit
-                    sum += gray8;
-                    count++;
-                }
-            }
-
-            // Compute the average and store in the scaled image
-            scaled_pixels_bw[sy][sx] = (unsigned char)(sum / count);
-        }
+    // Steps 2 and 3: average the blocks of pixels
+    {
+        TraceSpan span("downscale", "capture", frame);
+        downscaleFrame(pixels_bw, &scaled_pixels_bw[0][0]);
     }
 
     // Step 4: Save the scaled 28x28 grayscale image
-    const char* filename_scaled = "final_image_scaled.bmp";
-    saveImageGrayscale(filename_scaled, &scaled_pixels_bw[0][0], SCALED_WIDTH, SCALED_HEIGHT);
+    {
+        TraceSpan span("bmp_write", "io", frame);
+        const char* filename_scaled = "final_image_scaled.bmp";
+        saveImageGrayscale(filename_scaled, &scaled_pixels_bw[0][0], SCALED_WIDTH, SCALED_HEIGHT);
+    }
 
     // Clean up
     if (munmap(virtual_base, HW_REGS_SPAN) != 0) {
@@ -170,5 +266,6 @@ int main(void) {
     }
 
     close(fd);
+    traceFinish();
     return 0;
 }
\ No newline at end of file
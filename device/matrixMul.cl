@@ -0,0 +1,29 @@
+// Weight stationary tile kernel, batched over images.
+// NDRange dimension 0 is the output neuron, dimension 1 is the image in the batch.
+// The host writes one weight tile per launch, every image of the batch reuses it.
+__kernel void matrixMul(
+    __global const float* restrict inputs,       // Input batch (batch x input_stride)
+    __global const float* restrict weights_tile, // Tile of the Weights matrix (output_neurons x input_tile_size)
+    int input_tile_size,                         // Size of the input tile
+    int input_offset,                            // Offset of the tile inside one input vector
+    int input_stride,                            // Size of one input vector
+    int output_neurons,                          // Number of neurons in this layer
+    __global float* restrict outputs             // Output batch (batch x output_neurons)
+){
+    int neuron_id = get_global_id(0);
+    int image_id = get_global_id(1);
+
+    // Ensure we don't process more neurons than we have in this tile
+    if (neuron_id < output_neurons) {
+        __global const float* input_tile = inputs + image_id * input_stride + input_offset;
+        __global const float* weights_row = weights_tile + neuron_id * input_tile_size;
+
+        float temp_sum = 0.0f;
+        for (int i = 0; i < input_tile_size; ++i) {
+            temp_sum += input_tile[i] * weights_row[i];
+        }
+
+        // Accumulate across tiles, the host clears the buffer before the first tile
+        outputs[image_id * output_neurons + neuron_id] += temp_sum;
+    }
+}
@@ -0,0 +1,269 @@
+#ifndef DIGIT_DETECTOR_H
+#define DIGIT_DETECTOR_H
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "nn_layers.h"
+
+
+// Finds digits anywhere in a camera frame with the fully connected classifier.
+//
+// The frame is downscaled once per window size, so that a window of that size becomes
+// the 28x28 input of the classifier, and windows are taken step scaled pixels apart.
+// fc1 is linear, so its outputs for all windows of a scale are one correlation of the
+// scaled frame with the fc1 rows seen as hidden 28x28 filters: a conv2d_CPU layer with
+// one input channel, kernel 28 and stride step. Neighbouring windows overlap by up to
+// 27 of 28 columns; the correlation reads every pixel in place for all of them instead
+// of copying and normalizing each window for its own processTiles_weightStatinary_CPU
+// call. normalizeImage is folded into the filters (foldInputNormalization), so the
+// correlation runs on raw pixels. fc2 and log_softmax then run on the hidden vectors of
+// all windows of a scale as one batch.
+//
+// MNIST has no background class. A window is a candidate when its most likely class
+// reaches minScore and it looks like an MNIST digit: enough ink, and little of it in
+// the 4 pixel border MNIST leaves around the digit. Both sums come from an integral
+// image of the scaled frame. Greedy non-maximum suppression then keeps the best box and
+// drops every box that overlaps a kept one by more than maxOverlap, whatever its label.
+// Overlap is the intersection over the smaller box rather than over the union: a
+// stroke of a large digit seen through a small window (the foot of a 7 read as a 4)
+// lies inside the box of the digit, which union based suppression lets through.
+
+// The classifier input, and the empty border around an MNIST digit centered in it
+const int windowPixels = 28;
+const int borderPixels = 4;
+
+struct Detection {
+    int x, y, size; // square box in frame pixels, (x, y) is its top left corner
+    int label;
+    float score;    // probability of label
+};
+
+class DigitDetector {
+public:
+    std::vector<int> windowSizes; // frame pixels
+    int step;                     // scaled pixels between windows
+    float minScore;
+    float minInk;                 // mean pixel of the window over 255
+    float maxBorderInk;           // fraction of the ink of the window in its border
+    float maxOverlap;
+    ConvAlgorithm algorithm;      // of the fc1 correlation
+
+    DigitDetector()
+        : step(2), minScore(0.9f), minInk(0.05f), maxBorderInk(0.1f), maxOverlap(0.4f),
+          algorithm(CONV_DIRECT), hidden_(0), classes_(0), windows_(0), scratchFloats_(0) {
+        const int sizes[] = {48, 64, 84, 112, 150, 200};
+        windowSizes.assign(sizes, sizes + sizeof(sizes) / sizeof(sizes[0]));
+    }
+
+    // fc1 is hidden x 784, fc2 classes x hidden
+    bool load(ConstTensorView fc1Weights, ConstTensorView fc1Biases,
+              ConstTensorView fc2Weights, ConstTensorView fc2Biases) {
+        if (!fc1Weights.data || !fc2Weights.data || fc1Weights.cols != windowPixels * windowPixels ||
+            fc1Biases.cols != fc1Weights.rows || fc2Weights.cols != fc1Weights.rows || fc2Biases.cols != fc2Weights.rows) {
+            return false;
+        }
+        hidden_ = fc1Weights.rows;
+        classes_ = fc2Weights.rows;
+        fc1Weights_.assign(fc1Weights.data, fc1Weights.data + fc1Weights.size());
+        fc1Biases_.assign(fc1Biases.data, fc1Biases.data + hidden_);
+        fc2Weights_.assign(fc2Weights.data, fc2Weights.data + fc2Weights.size());
+        fc2Biases_.assign(fc2Biases.data, fc2Biases.data + classes_);
+
+        // The folded layer is stored pixel major, the filters are neuron major
+        PixelLayer folded;
+        foldInputNormalization(fc1Weights, fc1Biases, folded);
+        filters_.resize(fc1Weights.size());
+        for (int n = 0; n < hidden_; ++n) {
+            for (int p = 0; p < fc1Weights.cols; ++p) {
+                filters_[(size_t)n * fc1Weights.cols + p] = folded.weights[(size_t)p * hidden_ + n];
+            }
+        }
+        filterBiases_ = folded.biases;
+        return true;
+    }
+
+    // Boxes after suppression, best first
+    void detect(const unsigned char* frame, int width, int height, std::vector<Detection>& detections) {
+        scoreWindows(frame, width, height, false, detections);
+        suppressOverlaps(detections, maxOverlap);
+    }
+
+    // The candidates of every scale before suppression. perWindow runs fc1 once per
+    // window with processTiles_weightStatinary_CPU instead of the correlation, the
+    // reference -detect_report compares against.
+    void scoreWindows(const unsigned char* frame, int width, int height, bool perWindow,
+                      std::vector<Detection>& candidates) {
+        candidates.clear();
+        windows_ = 0;
+        for (size_t s = 0; s < windowSizes.size(); ++s) {
+            int size = windowSizes[s];
+            if (size < windowPixels || size > std::min(width, height)) {
+                continue;
+            }
+            scoreScale(frame, width, height, size, perWindow, candidates);
+        }
+    }
+
+    // Greedy non-maximum suppression, detections end up best first
+    static void suppressOverlaps(std::vector<Detection>& detections, float maxOverlap) {
+        std::stable_sort(detections.begin(), detections.end(),
+            [](const Detection& a, const Detection& b) { return a.score > b.score; });
+        size_t kept = 0;
+        for (size_t i = 0; i < detections.size(); ++i) {
+            bool overlaps = false;
+            for (size_t k = 0; k < kept && !overlaps; ++k) {
+                overlaps = overlap(detections[i], detections[k]) > maxOverlap;
+            }
+            if (!overlaps) {
+                detections[kept++] = detections[i];
+            }
+        }
+        detections.resize(kept);
+    }
+
+    // Intersection of two boxes over the area of the smaller one
+    static float overlap(const Detection& a, const Detection& b) {
+        int w = std::min(a.x + a.size, b.x + b.size) - std::max(a.x, b.x);
+        int h = std::min(a.y + a.size, b.y + b.size) - std::max(a.y, b.y);
+        if (w <= 0 || h <= 0) {
+            return 0.0f;
+        }
+        int smaller = std::min(a.size, b.size);
+        return (float)w * h / ((float)smaller * smaller);
+    }
+
+    // Windows classified by the last scoreWindows / detect call
+    long windowsEvaluated() const { return windows_; }
+
+private:
+    // Averages the pixels each scaled pixel covers, like downscaleFrame in capture_image.c
+    static void downscale(const unsigned char* frame, int width, int height, float* scaled, int scaledWidth, int scaledHeight) {
+        for (int sy = 0; sy < scaledHeight; ++sy) {
+            int y0 = (int)((long)sy * height / scaledHeight);
+            int y1 = std::max(y0 + 1, (int)((long)(sy + 1) * height / scaledHeight));
+            for (int sx = 0; sx < scaledWidth; ++sx) {
+                int x0 = (int)((long)sx * width / scaledWidth);
+                int x1 = std::max(x0 + 1, (int)((long)(sx + 1) * width / scaledWidth));
+                int sum = 0;
+                for (int y = y0; y < y1; ++y) {
+                    for (int x = x0; x < x1; ++x) {
+                        sum += frame[(size_t)y * width + x];
+                    }
+                }
+                scaled[(size_t)sy * scaledWidth + sx] = (float)sum / ((y1 - y0) * (x1 - x0));
+            }
+        }
+    }
+
+    // Sum of the n x n pixels from (x, y) out of the (width + 1) wide integral image
+    static double boxSum(const std::vector<double>& integral, int width, int x, int y, int n) {
+        size_t stride = width + 1;
+        return integral[(y + n) * stride + x + n] - integral[(size_t)y * stride + x + n] -
+               integral[(y + n) * stride + x] + integral[(size_t)y * stride + x];
+    }
+
+    void reserveScratch(size_t floats) {
+        if (floats > scratchFloats_) {
+            scratch_.reserve(floats);
+            scratchFloats_ = floats;
+        }
+    }
+
+    void scoreScale(const unsigned char* frame, int width, int height, int size, bool perWindow,
+                    std::vector<Detection>& candidates) {
+        const int scaledWidth = std::max(windowPixels, (int)lround((double)width * windowPixels / size));
+        const int scaledHeight = std::max(windowPixels, (int)lround((double)height * windowPixels / size));
+        scaled_.resize((size_t)scaledWidth * scaledHeight);
+        downscale(frame, width, height, scaled_.data(), scaledWidth, scaledHeight);
+
+        const ConvShape shape = {1, scaledHeight, scaledWidth, hidden_, windowPixels, step, 0};
+        const int outWidth = shape.outWidth();
+        const int positions = shape.outHeight() * outWidth;
+        const int patch = windowPixels * windowPixels;
+        hiddenMap_.resize((size_t)positions * hidden_);
+        batch_.resize((size_t)positions * hidden_);
+        logits_.resize((size_t)positions * classes_);
+        reserveScratch(std::max(std::max(conv2dScratchFloats(algorithm, shape), ScratchArena::roundUp(patch) +
+                                         layerScratchFloats(hidden_, inputTileSize)),
+                                std::max(gemmScratchFloats(classes_, hidden_), layerScratchFloats(classes_, hidden_))));
+
+        DataflowTraffic traffic;
+        if (!perWindow) {
+            // hidden x positions out of the correlation, positions x hidden for fc2
+            conv2d_CPU(algorithm, shape, viewOf(filters_, hidden_, patch), viewOf(filterBiases_, 1, hidden_),
+                ConstTensorView(scaled_.data(), 1, shape.inputSize()), TensorView(hiddenMap_.data(), 1, shape.outputSize()),
+                traffic, scratch_);
+            for (int n = 0; n < hidden_; ++n) {
+                for (int p = 0; p < positions; ++p) {
+                    batch_[(size_t)p * hidden_ + n] = hiddenMap_[(size_t)n * positions + p];
+                }
+            }
+        } else {
+            ArenaScope scope(scratch_);
+            float* window = scratch_.take(patch);
+            for (int p = 0; p < positions; ++p) {
+                const float* corner = scaled_.data() + (size_t)(p / outWidth) * step * scaledWidth + (p % outWidth) * step;
+                for (int y = 0; y < windowPixels; ++y) {
+                    for (int x = 0; x < windowPixels; ++x) {
+                        window[y * windowPixels + x] = (corner[(size_t)y * scaledWidth + x] / 255.0f - imageMean) / imageStd;
+                    }
+                }
+                float* out = batch_.data() + (size_t)p * hidden_;
+                std::fill(out, out + hidden_, 0.0f);
+                processTiles_weightStatinary_CPU(hidden_, patch, inputTileSize, fc1Weights_.data(), fc1Biases_.data(),
+                    window, out, traffic, scratch_);
+            }
+        }
+
+        TensorView hiddenBatch(batch_.data(), positions, hidden_);
+        TensorView logits(logits_.data(), positions, classes_);
+        relu(hiddenBatch);
+        denseLayer_CPU(WEIGHT_STATIONARY, viewOf(fc2Weights_, classes_, hidden_), viewOf(fc2Biases_, 1, classes_),
+            hiddenBatch, logits, hidden_, traffic, scratch_);
+        log_softmax(logits);
+        windows_ += positions;
+
+        // The ink tests on the scaled pixels, as fractions of full white
+        integral_.assign((size_t)(scaledWidth + 1) * (scaledHeight + 1), 0.0);
+        for (int y = 0; y < scaledHeight; ++y) {
+            double rowSum = 0.0;
+            for (int x = 0; x < scaledWidth; ++x) {
+                rowSum += scaled_[(size_t)y * scaledWidth + x];
+                integral_[(size_t)(y + 1) * (scaledWidth + 1) + x + 1] = integral_[(size_t)y * (scaledWidth + 1) + x + 1] + rowSum;
+            }
+        }
+
+        const double frameScaleX = (double)width / scaledWidth;
+        const double frameScaleY = (double)height / scaledHeight;
+        for (int p = 0; p < positions; ++p) {
+            int label = getMaxIn(logits, p);
+            float score = expf(logits.row(p)[label]);
+            if (score < minScore) {
+                continue;
+            }
+            int x = (p % outWidth) * step;
+            int y = (p / outWidth) * step;
+            double ink = boxSum(integral_, scaledWidth, x, y, windowPixels);
+            double inner = boxSum(integral_, scaledWidth, x + borderPixels, y + borderPixels, windowPixels - 2 * borderPixels);
+            if (ink < minInk * 255.0 * patch || ink - inner > maxBorderInk * ink) {
+                continue;
+            }
+            Detection detection = {(int)lround(x * frameScaleX), (int)lround(y * frameScaleY), size, label, score};
+            candidates.push_back(detection);
+        }
+    }
+
+    int hidden_;
+    int classes_;
+    FloatBuffer fc1Weights_, fc1Biases_, fc2Weights_, fc2Biases_;
+    FloatBuffer filters_, filterBiases_; // fc1 with the normalization folded in
+
+    FloatBuffer scaled_, hiddenMap_, batch_, logits_;
+    std::vector<double> integral_;
+    ScratchArena scratch_;
+    long windows_;
+    size_t scratchFloats_;
+};
+
+#endif
@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""Turns the raw float32 .bin files written by TrainNN.ipynb into model_weights.h.
+
+Each layer becomes a 64-byte aligned constexpr array with its shape as constexpr
+ints, so builds with -DMNIST_EMBEDDED_MODEL need no model files at run time.
+
+    python3 embed_weights.py fc1_weight.bin fc1_bias.bin fc2_weight.bin fc2_bias.bin -o model_weights.h
+"""
+
+import argparse
+import os
+import sys
+
+from weight_tools import read_floats
+
+
+def float_literal(value):
+    # 9 significant digits round trip any float32 exactly
+    text = f"{value:.9g}"
+    if "e" not in text and "." not in text and "n" not in text:
+        text += ".0"
+    return text + "f"
+
+
+def emit_array(out, name, values, per_line=8):
+    out.write(f"alignas(64) constexpr float {name}[{len(values)}] = {{\n")
+    for i in range(0, len(values), per_line):
+        out.write("    " + ", ".join(float_literal(v) for v in values[i:i + per_line]) + ",\n")
+    out.write("};\n\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("fc1_weight")
+    parser.add_argument("fc1_bias")
+    parser.add_argument("fc2_weight")
+    parser.add_argument("fc2_bias")
+    parser.add_argument("-o", "--output", default="model_weights.h")
+    args = parser.parse_args()
+
+    fc1_weight = read_floats(args.fc1_weight)
+    fc1_bias = read_floats(args.fc1_bias)
+    fc2_weight = read_floats(args.fc2_weight)
+    fc2_bias = read_floats(args.fc2_bias)
+
+    # Weights are stored row major, one row of inputs per output neuron
+    fc1_outputs = len(fc1_bias)
+    fc1_inputs = len(fc1_weight) // fc1_outputs
+    fc2_outputs = len(fc2_bias)
+    fc2_inputs = len(fc2_weight) // fc2_outputs
+    if fc1_inputs * fc1_outputs != len(fc1_weight) or fc2_inputs * fc2_outputs != len(fc2_weight):
+        sys.exit("weight sizes are not a multiple of the bias sizes")
+    if fc2_inputs != fc1_outputs:
+        sys.exit(f"fc2 takes {fc2_inputs} inputs but fc1 has {fc1_outputs} outputs")
+
+    sources = ", ".join(os.path.basename(p) for p in (args.fc1_weight, args.fc1_bias, args.fc2_weight, args.fc2_bias))
+
+    tmp_path = args.output + ".tmp"
+    with open(tmp_path, "w") as out:
+        out.write("// Generated by embed_weights.py from " + sources + ", do not edit.\n")
+        out.write("#ifndef MODEL_WEIGHTS_H\n#define MODEL_WEIGHTS_H\n\n")
+        out.write("namespace embedded_model {\n\n")
+        out.write(f"constexpr int fc1Inputs = {fc1_inputs};\n")
+        out.write(f"constexpr int fc1Outputs = {fc1_outputs};\n")
+        out.write(f"constexpr int fc2Inputs = {fc2_inputs};\n")
+        out.write(f"constexpr int fc2Outputs = {fc2_outputs};\n\n")
+        emit_array(out, "fc1_weight", fc1_weight)
+        emit_array(out, "fc1_bias", fc1_bias)
+        emit_array(out, "fc2_weight", fc2_weight)
+        emit_array(out, "fc2_bias", fc2_bias)
+        out.write("}\n\n#endif\n")
+    os.replace(tmp_path, args.output)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,218 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+
+
+// Single producer / single consumer ring of 28x28 frames in POSIX shared memory,
+// written by capture_image.c and read by the inference host. Both sides work on
+// the slots in place, a frame is never copied between the processes.
+//
+// head is only written by the producer and tail only by the consumer, each on
+// its own cache line. A slot is published by the release store of head and
+// returned by the release store of tail, so no lock is shared between processes.
+//
+// The producer never waits: it captures a frame first and, when every slot is
+// still unread, discards it and counts one overrun. Capturing paces the loop, so
+// a full ring does not spin. A consumer that falls behind may skip to the newest
+// frame, the frames it skips are counted as drops. Sequence numbers count the
+// published frames, so skipped frames show up as gaps on the consumer side.
+
+#define FRAME_RING_DEFAULT_NAME "/mnist_frames"
+
+const uint32_t frameRingMagic = 0x4d4e5246; // "MNRF"
+const uint32_t frameRingVersion = 1;
+const uint32_t frameRingSlots = 16; // power of two
+const int frameRingWidth = 28;
+const int frameRingHeight = 28;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring needs lock-free 64-bit atomics to work across processes");
+
+struct alignas(64) FrameSlot {
+    uint64_t seq;         // publish counter, overrun frames are not numbered
+    uint64_t timestampNs; // CLOCK_MONOTONIC at publish(), after the downscale, same clock as trace.h
+    uint8_t pixels[frameRingWidth * frameRingHeight]; // rows top to bottom
+};
+
+struct FrameRingHeader {
+    std::atomic<uint32_t> magic; // written last by the creator
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slotSize;
+
+    alignas(64) std::atomic<uint64_t> head;     // next slot the producer fills
+    std::atomic<uint64_t> captured;             // frames published by the producer
+    std::atomic<uint64_t> overruns;             // frames discarded because the ring was full
+
+    alignas(64) std::atomic<uint64_t> tail;     // next slot the consumer reads
+    std::atomic<uint64_t> drops;                // frames skipped by a consumer catching up
+
+    alignas(64) FrameSlot slot[frameRingSlots];
+};
+
+
+inline uint64_t frameRingNowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+class FrameRing {
+public:
+    FrameRing() : ring_(NULL), reserved_(NULL) {}
+    ~FrameRing() { close(); }
+
+    // Maps the ring, creating it when it does not exist yet. Either side may start first.
+    // An object left broken by a creator that died, or by an incompatible build, is
+    // unlinked and created again.
+    bool open(const std::string& name) {
+        bool broken = false;
+        if (map(name, broken)) {
+            return true;
+        }
+        if (!broken) {
+            return false;
+        }
+        fprintf(stderr, "Shared memory %s is not a compatible frame ring, recreating it\n", name.c_str());
+        shm_unlink(name.c_str());
+        return map(name, broken);
+    }
+
+    void close() {
+        if (ring_) {
+            munmap(ring_, sizeof(FrameRingHeader));
+            ring_ = NULL;
+        }
+    }
+
+    // Producer: the slot to write a frame that has been captured into, NULL when
+    // the ring is full. Call once per captured frame, a NULL counts it as an overrun.
+    FrameSlot* reserve() {
+        uint64_t head = ring_->head.load(std::memory_order_relaxed);
+        if (head - ring_->tail.load(std::memory_order_acquire) >= frameRingSlots) {
+            ring_->overruns.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+        reserved_ = &ring_->slot[head & (frameRingSlots - 1)];
+        return reserved_;
+    }
+
+    // Producer: numbers the reserved slot and makes it visible to the consumer
+    void publish() {
+        reserved_->seq = ring_->captured.fetch_add(1, std::memory_order_relaxed);
+        reserved_->timestampNs = frameRingNowNs();
+        reserved_ = NULL;
+        ring_->head.store(ring_->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: the oldest unread frame, or the newest one when latestOnly is set,
+    // NULL when nothing is queued. The slot stays valid until release().
+    const FrameSlot* peek(bool latestOnly) {
+        uint64_t tail = ring_->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring_->head.load(std::memory_order_acquire);
+        if (head == tail) {
+            return NULL;
+        }
+        if (latestOnly && head - tail > 1) {
+            ring_->drops.fetch_add(head - tail - 1, std::memory_order_relaxed);
+            tail = head - 1;
+            ring_->tail.store(tail, std::memory_order_release);
+        }
+        return &ring_->slot[tail & (frameRingSlots - 1)];
+    }
+
+    // Consumer: hands the slot returned by peek() back to the producer
+    void release() {
+        ring_->tail.store(ring_->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    uint64_t captured() const { return ring_->captured.load(std::memory_order_relaxed); }
+    uint64_t overruns() const { return ring_->overruns.load(std::memory_order_relaxed); }
+    uint64_t drops() const { return ring_->drops.load(std::memory_order_relaxed); }
+    uint64_t consumed() const { return ring_->tail.load(std::memory_order_relaxed) - drops(); }
+
+private:
+    // One attempt of open(), broken is set when the object exists but cannot be used
+    bool map(const std::string& name, bool& broken) {
+        bool creator = true;
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+        if (fd < 0 && errno == EEXIST) {
+            creator = false;
+            fd = shm_open(name.c_str(), O_RDWR, 0660);
+        }
+        if (fd < 0) {
+            perror("shm_open");
+            return false;
+        }
+        if (creator && ftruncate(fd, sizeof(FrameRingHeader)) != 0) {
+            perror("ftruncate");
+            ::close(fd);
+            shm_unlink(name.c_str());
+            return false;
+        }
+
+        // The creator may still be sizing the object. Mapping a short one would
+        // fault with SIGBUS on the first access past its end.
+        bool sized = creator;
+        for (int attempt = 0; !sized && attempt < 100; ++attempt) {
+            struct stat st;
+            sized = fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(FrameRingHeader);
+            if (!sized) {
+                usleep(10000);
+            }
+        }
+        if (!sized) {
+            ::close(fd);
+            broken = true;
+            return false;
+        }
+
+        void* base = mmap(NULL, sizeof(FrameRingHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        ring_ = static_cast<FrameRingHeader*>(base);
+
+        if (creator) {
+            // A fresh object is zero filled, so the counters already start at 0
+            ring_->version = frameRingVersion;
+            ring_->slots = frameRingSlots;
+            ring_->slotSize = sizeof(FrameSlot);
+            ring_->magic.store(frameRingMagic, std::memory_order_release);
+            return true;
+        }
+
+        for (int attempt = 0; attempt < 100; ++attempt) {
+            if (ring_->magic.load(std::memory_order_acquire) == frameRingMagic) {
+                break;
+            }
+            usleep(10000);
+        }
+        if (ring_->magic.load(std::memory_order_acquire) != frameRingMagic ||
+            ring_->version != frameRingVersion || ring_->slots != frameRingSlots ||
+            ring_->slotSize != sizeof(FrameSlot)) {
+            close();
+            broken = true;
+            return false;
+        }
+        return true;
+    }
+
+    FrameRingHeader* ring_;
+    FrameSlot* reserved_;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Converts a raw float32 weight file written by TrainNN.ipynb to fp16 or bf16.
+
+The output holds one little-endian 16-bit value per weight in the same order,
+rounded to nearest even like floatToHalf / floatToBFloat16 in nn_layers.h. The
+host picks the format from the extension, .f16 or .bf16, and keeps the layer
+16-bit in memory. Bias files stay float32.
+
+    python3 half_weights.py fc1_weight.bin --format fp16 -o fc1_weight.f16
+    ./host -fc1_weights=fc1_weight.f16
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+from weight_tools import read_floats
+
+
+def to_bfloat16(value):
+    bits = struct.unpack("<I", struct.pack("<f", value))[0]
+    if (bits & 0x7fffffff) > 0x7f800000:
+        return (bits >> 16) | 0x40  # keep NaN a NaN
+    return ((bits + 0x7fff + ((bits >> 16) & 1)) >> 16) & 0xffff
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("weights")
+    parser.add_argument("--format", choices=("fp16", "bf16"), default="fp16")
+    parser.add_argument("-o", "--output", help="defaults to the input name with .f16 or .bf16")
+    args = parser.parse_args()
+
+    extension = ".f16" if args.format == "fp16" else ".bf16"
+    output = args.output or os.path.splitext(args.weights)[0] + extension
+    if not output.endswith(extension):
+        sys.exit(f"{output}: the host reads {args.format} weights only from {extension} files")
+
+    weights = read_floats(args.weights)
+    if args.format == "fp16":
+        try:
+            data = struct.pack(f"<{len(weights)}e", *weights)
+        except OverflowError:
+            sys.exit(f"{args.weights}: a weight is outside the fp16 range")
+    else:
+        data = struct.pack(f"<{len(weights)}H", *(to_bfloat16(w) for w in weights))
+
+    tmp_path = output + ".tmp"
+    with open(tmp_path, "wb") as f:
+        f.write(data)
+    os.replace(tmp_path, output)
+
+    worst = 0.0
+    for w, h in zip(weights, struct.unpack(f"<{len(weights)}H", data)):
+        if args.format == "fp16":
+            back = struct.unpack("<e", struct.pack("<H", h))[0]
+        else:
+            back = struct.unpack("<f", struct.pack("<I", h << 16))[0]
+        worst = max(worst, abs(back - w))
+    print(f"{output}: {len(weights)} weights, {len(data)} bytes, largest rounding error {worst:g}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,441 @@
+#ifndef INFERENCE_SERVER_H
+#define INFERENCE_SERVER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mnist_infer.h"
+#include "metrics.h"
+#include "model_reloader.h"
+#include "trace.h"
+
+
+// Long running classification server on a Unix stream socket.
+//
+// A client connects once and sends any number of requests, each one is the raw
+// 28x28 uint8 image (MNIST_IMAGE_SIZE bytes, rows top to bottom). Every request
+// gets one InferenceResponse back, in the order the requests were sent.
+//
+// The I/O thread only reads payloads and queues them. The batcher thread waits for
+// the first queued request, then for up to windowUs more or until maxBatch requests
+// are queued, and runs them as one mnist_infer_batch_u8 call on its own context.
+// The context follows the reloader, a batch always runs on a single model.
+//
+// The batcher never writes to a socket. Replies go to the output buffer of their
+// connection and the I/O thread sends them without blocking, so a client that does
+// not read its replies only stalls itself. A connection stops being read while
+// serverMaxOutstanding of its requests are queued or have unsent replies, which bounds
+// both the queue and the buffer per client. If the batcher cannot start, run() returns
+// false and the server stops instead of queuing requests nobody will answer.
+
+struct InferenceResponse {
+    int32_t status; // mnist_status of the batch the request ran in
+    int32_t label;
+    float scores[MNIST_NUM_CLASSES]; // log-probabilities
+};
+
+
+// Requests of one connection that are queued or have replies not yet sent
+const int serverMaxOutstanding = 256;
+
+// A client socket, closed when the I/O thread and every queued request let go of it
+struct ServerConnection {
+    int fd;
+    std::vector<uint8_t> pending;   // bytes of a request not yet complete, I/O thread only
+    std::atomic<int> queued;        // requests waiting for the batcher
+    std::mutex outputMutex;
+    std::vector<uint8_t> output;    // replies not yet sent, appended by the batcher
+
+    explicit ServerConnection(int fd_) : fd(fd_), queued(0) {}
+    ~ServerConnection() { close(fd); }
+
+    int outstanding() {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        return queued.load() + (int)(output.size() / sizeof(InferenceResponse));
+    }
+
+    // Sends what the socket takes without blocking, false once the client is gone
+    bool flush() {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        while (!output.empty()) {
+            ssize_t n = send(fd, output.data(), output.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            output.erase(output.begin(), output.begin() + n);
+        }
+        return true;
+    }
+
+    bool hasOutput() {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        return !output.empty();
+    }
+};
+
+struct ServerRequest {
+    std::shared_ptr<ServerConnection> connection;
+    uint64_t receivedNs;
+    uint8_t pixels[MNIST_IMAGE_SIZE];
+};
+
+
+// Writes all of buf, the socket may accept it in pieces
+inline bool sendAll(int fd, const void* buf, size_t len) {
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+inline bool recvAll(int fd, void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+// Set by SIGINT / SIGTERM, the long running modes poll it
+inline std::atomic<bool>& stopRequested() {
+    static std::atomic<bool> stop(false);
+    return stop;
+}
+
+inline void stopSignalHandler(int) {
+    stopRequested().store(true);
+}
+
+
+class InferenceServer {
+public:
+    InferenceServer(ModelReloader& models, mnist_dataflow dataflow, int maxBatch, int windowUs)
+        : models_(models), dataflow_(dataflow), maxBatch_(maxBatch), windowUs_(windowUs),
+          listenFd_(-1), running_(false), batcherFailed_(false) {
+        wakeFds_[0] = wakeFds_[1] = -1;
+    }
+
+    ~InferenceServer() { stop(); }
+
+    bool start(const std::string& path) {
+        path_ = path;
+
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Socket path too long: %s\n", path.c_str());
+            return false;
+        }
+        strcpy(addr.sun_path, path.c_str());
+
+        listenFd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd_ < 0) {
+            perror("socket");
+            return false;
+        }
+        unlink(path.c_str()); // left behind by a server that was killed
+        if (bind(listenFd_, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd_, 64) < 0) {
+            perror("bind");
+            close(listenFd_);
+            listenFd_ = -1;
+            return false;
+        }
+
+        // The batcher wakes the I/O thread through this pipe when it queued replies
+        if (pipe(wakeFds_) < 0) {
+            perror("pipe");
+            close(listenFd_);
+            listenFd_ = -1;
+            return false;
+        }
+        fcntl(wakeFds_[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakeFds_[1], F_SETFL, O_NONBLOCK);
+
+        running_ = true;
+        batcher_ = std::thread(&InferenceServer::batchLoop, this);
+        return true;
+    }
+
+    // Serves until SIGINT / SIGTERM, the calling thread does the socket I/O.
+    // Returns false when the batcher could not start.
+    bool run() {
+        signal(SIGINT, stopSignalHandler);
+        signal(SIGTERM, stopSignalHandler);
+
+        std::map<int, std::shared_ptr<ServerConnection> > connections;
+        std::vector<struct pollfd> fds;
+        std::vector<uint8_t> buf(64 * 1024);
+
+        while (!stopRequested().load() && !batcherFailed_.load()) {
+            fds.clear();
+            struct pollfd listener = {listenFd_, POLLIN, 0};
+            fds.push_back(listener);
+            struct pollfd waker = {wakeFds_[0], POLLIN, 0};
+            fds.push_back(waker);
+            for (std::map<int, std::shared_ptr<ServerConnection> >::iterator it = connections.begin(); it != connections.end(); ++it) {
+                // A client with too many requests outstanding is not read until it catches up
+                short events = it->second->outstanding() < serverMaxOutstanding ? POLLIN : 0;
+                if (it->second->hasOutput()) {
+                    events |= POLLOUT;
+                }
+                struct pollfd client = {it->first, events, 0};
+                fds.push_back(client);
+            }
+
+            // The timeout only bounds how long a stop request waits
+            if (poll(fds.data(), fds.size(), 100) <= 0) {
+                continue;
+            }
+
+            if (fds[0].revents & POLLIN) {
+                int fd = accept(listenFd_, NULL, NULL);
+                if (fd >= 0) {
+                    connections[fd] = std::make_shared<ServerConnection>(fd);
+                }
+            }
+            if (fds[1].revents & POLLIN) {
+                char drain[64];
+                while (read(wakeFds_[0], drain, sizeof(drain)) > 0) {
+                }
+            }
+
+            for (size_t i = 2; i < fds.size(); ++i) {
+                std::shared_ptr<ServerConnection> connection = connections[fds[i].fd];
+                bool alive = true;
+                if (fds[i].revents & POLLOUT) {
+                    alive = connection->flush();
+                }
+                if (alive && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    ssize_t n = recv(connection->fd, buf.data(), buf.size(), 0);
+                    if (n <= 0) {
+                        alive = false;
+                    } else {
+                        connection->pending.insert(connection->pending.end(), buf.begin(), buf.begin() + n);
+                        enqueueComplete(connection);
+                    }
+                }
+                if (!alive) {
+                    connections.erase(fds[i].fd);
+                }
+            }
+
+            // Replies the batcher queued since the poll started
+            for (std::map<int, std::shared_ptr<ServerConnection> >::iterator it = connections.begin(); it != connections.end(); ) {
+                if (it->second->hasOutput() && !it->second->flush()) {
+                    connections.erase(it++);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        if (batcherFailed_.load()) {
+            fprintf(stderr, "The batcher stopped, shutting the server down\n");
+            return false;
+        }
+        return true;
+    }
+
+    void stop() {
+        if (!running_) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+        }
+        wake_.notify_all();
+        batcher_.join();
+
+        close(listenFd_);
+        listenFd_ = -1;
+        close(wakeFds_[0]);
+        close(wakeFds_[1]);
+        wakeFds_[0] = wakeFds_[1] = -1;
+        unlink(path_.c_str());
+    }
+
+private:
+    // Queues every whole request buffered on the connection
+    void enqueueComplete(const std::shared_ptr<ServerConnection>& connection) {
+        size_t complete = connection->pending.size() / MNIST_IMAGE_SIZE;
+        if (complete == 0) {
+            return;
+        }
+
+        uint64_t now = metricsNowNs();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t r = 0; r < complete; ++r) {
+                queue_.push_back(ServerRequest());
+                ServerRequest& request = queue_.back();
+                request.connection = connection;
+                request.receivedNs = now;
+                memcpy(request.pixels, &connection->pending[r * MNIST_IMAGE_SIZE], MNIST_IMAGE_SIZE);
+            }
+            connection->queued += (int)complete;
+        }
+        connection->pending.erase(connection->pending.begin(), connection->pending.begin() + complete * MNIST_IMAGE_SIZE);
+        wake_.notify_one();
+    }
+
+    void batchLoop() {
+        ReloadingContext context(models_, dataflow_);
+        if (!context.get()) {
+            fprintf(stderr, "Could not create the server context\n");
+            batcherFailed_ = true;
+            return;
+        }
+
+        std::vector<ServerRequest> batch;
+        std::vector<uint8_t> pixels((size_t)maxBatch_ * MNIST_IMAGE_SIZE);
+        std::vector<int> labels(maxBatch_);
+        std::vector<float> scores((size_t)maxBatch_ * MNIST_NUM_CLASSES);
+        long batchId = 0;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                while (running_ && queue_.empty()) {
+                    wake_.wait(lock);
+                }
+                if (!running_) {
+                    break;
+                }
+
+                // The window opens with the oldest request, a full batch closes it early
+                std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+                    std::chrono::microseconds(windowUs_);
+                while (running_ && (int)queue_.size() < maxBatch_ &&
+                       wake_.wait_until(lock, deadline) != std::cv_status::timeout) {
+                }
+
+                int count = std::min((int)queue_.size(), maxBatch_);
+                batch.assign(queue_.begin(), queue_.begin() + count);
+                queue_.erase(queue_.begin(), queue_.begin() + count);
+            }
+
+            int count = (int)batch.size();
+            for (int r = 0; r < count; ++r) {
+                memcpy(&pixels[(size_t)r * MNIST_IMAGE_SIZE], batch[r].pixels, MNIST_IMAGE_SIZE);
+            }
+
+            mnist_status status;
+            {
+                TraceSpan span("server_batch", "server", batchId++);
+                status = mnist_infer_batch_u8(context.get(), pixels.data(), count, labels.data(), scores.data());
+            }
+            metrics().batches.record(count);
+
+            for (int r = 0; r < count; ++r) {
+                InferenceResponse response;
+                response.status = status;
+                response.label = status == MNIST_OK ? labels[r] : -1;
+                for (int c = 0; c < MNIST_NUM_CLASSES; ++c) {
+                    response.scores[c] = status == MNIST_OK ? scores[(size_t)r * MNIST_NUM_CLASSES + c] : 0.0f;
+                }
+                ServerConnection& connection = *batch[r].connection;
+                {
+                    std::lock_guard<std::mutex> lock(connection.outputMutex);
+                    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&response);
+                    connection.output.insert(connection.output.end(), bytes, bytes + sizeof(response));
+                    connection.queued--;
+                }
+                metrics().requests.record(metricsNowNs() - batch[r].receivedNs);
+            }
+            batch.clear(); // drops the connection references
+
+            char wake = 1;
+            if (write(wakeFds_[1], &wake, 1) < 0) {
+                // Full pipe, the I/O thread has a wake up pending anyway
+            }
+        }
+    }
+
+    ModelReloader& models_;
+    mnist_dataflow dataflow_;
+    int maxBatch_;
+    int windowUs_;
+    int listenFd_;
+    std::string path_;
+
+    int wakeFds_[2];
+
+    bool running_;
+    std::atomic<bool> batcherFailed_;
+    std::deque<ServerRequest> queue_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::thread batcher_;
+};
+
+
+// Client side, one request at a time on a connection from inferenceClientConnect
+inline int inferenceClientConnect(const std::string& path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline bool inferenceClientClassify(int fd, const uint8_t* pixels, InferenceResponse& response) {
+    return sendAll(fd, pixels, MNIST_IMAGE_SIZE) && recvAll(fd, &response, sizeof(response));
+}
+
+#endif
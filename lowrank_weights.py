@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""Factorizes a raw float32 weight file written by TrainNN.ipynb into two low-rank factors.
+
+The rows x cols weights W are replaced by their truncated SVD, right (rank x cols)
+and left (rows x rank) with W ~= left right, the same factorization factorizeLowRank
+does in nn_layers.cpp: the smaller Gram matrix is diagonalized by cyclic Jacobi
+rotations and the largest singular values are kept. The host picks the format from
+the .lr extension and runs the two factors one after the other, rank (rows + cols)
+multiply-adds instead of rows cols. Bias files stay float32.
+
+    python3 lowrank_weights.py fc1_weight.bin --rank 4 -o fc1_weight.lr
+    ./host -fc1_weights=fc1_weight.lr
+
+The row count is read from the matching bias file (fc1_weight.bin -> fc1_bias.bin)
+unless --rows is given. With the MNIST test set the accuracy of fc1 at a list of
+ranks is reported instead, fc1_bias.bin and the fc2 files are read from --model-dir;
+./host -low_rank_report gives the latency of the same ranks:
+
+    python3 lowrank_weights.py fc1_weight.bin --report 1,2,4,8,10 \\
+        --images t10k-images-idx3-ubyte --labels t10k-labels-idx1-ubyte
+"""
+
+import argparse
+import math
+import os
+import struct
+import sys
+
+from weight_tools import load_test_set, read_floats, to_rows
+
+LOW_RANK_FILE_MAGIC = 0x524C4E4D  # "MNLR", lowRankFileMagic in nn_layers.cpp
+
+
+def jacobi_eigen(a):
+    """Eigenvalues and eigenvectors (as columns) of a symmetric matrix, like jacobiEigen"""
+    n = len(a)
+    a = [list(row) for row in a]
+    v = [[1.0 if i == j else 0.0 for j in range(n)] for i in range(n)]
+    total = sum(x * x for row in a for x in row)
+    for _ in range(64):
+        off = sum(a[p][q] ** 2 for p in range(n) for q in range(p + 1, n))
+        if off <= 1e-30 * total:
+            break
+        for p in range(n):
+            for q in range(p + 1, n):
+                if a[p][q] == 0.0:
+                    continue
+                theta = (a[q][q] - a[p][p]) / (2.0 * a[p][q])
+                t = (1.0 if theta >= 0.0 else -1.0) / (abs(theta) + math.sqrt(theta * theta + 1.0))
+                c = 1.0 / math.sqrt(t * t + 1.0)
+                s = t * c
+                for k in range(n):
+                    akp, akq = a[k][p], a[k][q]
+                    a[k][p], a[k][q] = c * akp - s * akq, s * akp + c * akq
+                for k in range(n):
+                    apk, aqk = a[p][k], a[q][k]
+                    a[p][k], a[q][k] = c * apk - s * aqk, s * apk + c * aqk
+                for k in range(n):
+                    vkp, vkq = v[k][p], v[k][q]
+                    v[k][p], v[k][q] = c * vkp - s * vkq, s * vkp + c * vkq
+    return [a[i][i] for i in range(n)], v
+
+
+def factorize(rows, rank):
+    """(right, left), rank x cols and rows x rank, with rows ~= left right"""
+    cols = len(rows[0])
+    gram_of_rows = len(rows) <= cols
+    if gram_of_rows:
+        gram = [[sum(x * y for x, y in zip(a, b)) for b in rows] for a in rows]
+    else:
+        columns = list(zip(*rows))
+        gram = [[sum(x * y for x, y in zip(a, b)) for b in columns] for a in columns]
+    values, vectors = jacobi_eigen(gram)
+    n = len(values)
+    order = sorted(range(n), key=lambda i: -values[i])[:max(1, min(rank, n))]
+
+    right, left_columns = [], []
+    for e in order:
+        vector = [vectors[i][e] for i in range(n)]
+        if gram_of_rows:
+            left_columns.append(vector)
+            right.append([sum(vector[r] * rows[r][c] for r in range(len(rows))) for c in range(cols)])
+        else:
+            right.append(vector)
+            left_columns.append([sum(w * x for w, x in zip(row, vector)) for row in rows])
+    left = [list(row) for row in zip(*left_columns)]
+    return right, left
+
+
+def accuracy(right, left, fc1_bias, fc2, fc2_bias, samples):
+    correct = 0
+    for x, label in samples:
+        projected = [sum(a * w for a, w in zip(x, row)) for row in right]
+        hidden = [max(0.0, sum(p * w for p, w in zip(projected, row)) + b) for row, b in zip(left, fc1_bias)]
+        logits = [sum(h * w for h, w in zip(hidden, row)) + b for row, b in zip(fc2, fc2_bias)]
+        correct += logits.index(max(logits)) == label
+    return correct / len(samples)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("weights", help="raw float32 weights, one row of inputs per output neuron")
+    parser.add_argument("--rank", type=int, help="singular values kept")
+    parser.add_argument("--rows", type=int, help="output neurons, defaults to the length of the bias file")
+    parser.add_argument("-o", "--output", help="defaults to the input name with .lr")
+    parser.add_argument("--report", help="comma separated ranks to report accuracy for")
+    parser.add_argument("--images", help="MNIST test images (t10k-images-idx3-ubyte)")
+    parser.add_argument("--labels", help="MNIST test labels (t10k-labels-idx1-ubyte)")
+    parser.add_argument("--limit", type=int, default=0, help="only use the first LIMIT test images")
+    parser.add_argument("--model-dir", default=".", help="directory of fc1_bias.bin and the fc2 files")
+    args = parser.parse_args()
+
+    weights = read_floats(args.weights)
+
+    if args.report is None:
+        if args.rank is None:
+            sys.exit("give --rank, or --report with --images and --labels")
+        output = args.output or os.path.splitext(args.weights)[0] + ".lr"
+        if not output.endswith(".lr"):
+            sys.exit(f"{output}: the host reads low-rank weights only from .lr files")
+        rows = args.rows
+        if rows is None:
+            bias_path = os.path.join(os.path.dirname(args.weights),
+                                     os.path.basename(args.weights).replace("weight", "bias"))
+            if bias_path == args.weights or not os.path.exists(bias_path):
+                sys.exit(f"{args.weights}: no bias file next to it, give --rows")
+            rows = len(read_floats(bias_path))
+        if rows <= 0 or len(weights) % rows != 0:
+            sys.exit(f"{args.weights}: {len(weights)} weights do not split into {rows} rows")
+
+        matrix = to_rows(weights, rows)
+        right, left = factorize(matrix, args.rank)
+        rank, cols = len(right), len(matrix[0])
+        flat = [x for row in right for x in row] + [x for row in left for x in row]
+        tmp_path = output + ".tmp"
+        with open(tmp_path, "wb") as f:
+            f.write(struct.pack("<Iiii", LOW_RANK_FILE_MAGIC, rows, cols, rank))
+            f.write(struct.pack(f"<{len(flat)}f", *flat))
+        os.replace(tmp_path, output)
+
+        worst = 0.0
+        for r in range(rows):
+            for c in range(cols):
+                worst = max(worst, abs(sum(left[r][k] * right[k][c] for k in range(rank)) - matrix[r][c]))
+        print(f"{output}: {rows}x{cols} at rank {rank}, {len(flat)} weights instead of {len(weights)},"
+              f" largest error {worst:g}")
+        return
+
+    if not args.images or not args.labels:
+        sys.exit("--report needs --images and --labels")
+    fc1_bias = read_floats(os.path.join(args.model_dir, "fc1_bias.bin"))
+    fc2_weight = read_floats(os.path.join(args.model_dir, "fc2_weight.bin"))
+    fc2_bias = read_floats(os.path.join(args.model_dir, "fc2_bias.bin"))
+    if len(weights) % len(fc1_bias) != 0 or len(fc2_weight) != len(fc2_bias) * len(fc1_bias):
+        sys.exit("the weight files do not describe a 784 -> N -> 10 network")
+    fc1 = to_rows(weights, len(fc1_bias))
+    fc2 = to_rows(fc2_weight, len(fc2_bias))
+    samples = load_test_set(args.images, args.labels, args.limit)
+
+    print("rank,weights,macs,accuracy")
+    for rank in (int(r) for r in args.report.split(",")):
+        right, left = factorize(fc1, rank)
+        kept = len(right)
+        count = kept * (len(fc1) + len(fc1[0]))
+        macs = count + len(fc2) * len(fc1)
+        print(f"{kept},{count},{macs},{accuracy(right, left, fc1_bias, fc2, fc2_bias, samples):.4f}")
+
+
+if __name__ == "__main__":
+    main()
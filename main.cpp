@@ -6,7 +6,21 @@
 #include <time.h>
 #include <numeric>
 #include <cmath>
+#include <float.h>
+#include <limits.h>
 #include "bmp_utility.h"
+#include "mnist_infer.h"
+#include "nn_layers.h"
+#include "metrics.h"
+#include "perf_counters.h"
+#include "trace.h"
+#include "inference_server.h"
+#include "frame_ring.h"
+#include "digit_detector.h"
+#ifdef MNIST_EMBEDDED_MODEL
+#include "model_weights.h"
+#endif
+#include <thread>
 
 
 
@@ -32,57 +46,130 @@
     cl_program program;
     std::string deviceInfo;
     std::string aocxFilename;
-    // namespace for Intel FPGA SDK
-    using namespace aocl_utils;
     unsigned num_devices = 0;
 #endif
 
+// namespace for Intel FPGA SDK, Options also parses the CPU arguments
+using namespace aocl_utils;
 
 
 
+// Command line front end. The CPU path runs through the inference library (mnist_infer.h),
+// the FPGA path keeps its own copy of the weights to stream tiles to the device.
 
 
-// Image size in 1D array = 28 x 28
-const int inputSize = 784; // 28x28 input image
+Dataflow cpuDataflow = WEIGHT_STATIONARY;
 
+// Number of times the inference is repeated on the loaded image
+int numIterations = 1;
+bool iterationsGiven = false; // long running modes stop after numIterations only when it is given
 
-// Number of neurons in the hidden layer
-// This code assumes a single hidden layer
-// If you use more layers modify accordingly
-const int numNeurons = 10;
+// Test hook: fail unless inferences after the first one allocate nothing
+bool checkAllocations = false;
 
-// Tile size to perform matrix multiplication
-// Experiment with this size and report those values 
-const int inputTileSize = 28;
+// Frame id attached to the trace spans, one per inference
+long frameId = 0;
     
 
 
 // Variables to hold input data
-std::vector<float> image_data; // image data
-
-
-
-std::vector<float> hidden_layer1_weights;
-std::vector<float> hidden_layer1_biases;
-std::vector<float> hidden_layer1_out;
+std::vector<unsigned char> image_pixels; // 28x28, rows top to bottom
 
 
 
-std::vector<float> output_layer_weights;
-std::vector<float> output_layer_biases;
-std::vector<float> output_layer_out;
+#if FPGA == 1
 
+FloatBuffer image_data; // normalized image data
 
+FloatBuffer hidden_layer1_weights;
+FloatBuffer hidden_layer1_biases;
 
-#if FPGA == 1
+FloatBuffer output_layer_weights;
+FloatBuffer output_layer_biases;
+FloatBuffer output_layer_out;
 
 // Neural network buffers
 // We transfer data to corresponding buffers before launching the Kernel
 
 
-cl_mem inputTileBuffer; // Buffer for the input image
+// The buffers are created once in init_opencl and reused by every layer and every run
+cl_mem inputTileBuffer; // Buffer for the input batch (maxBatchSize x inputSize)
 cl_mem weightsTileBuffer; // Buffers for layer1 weigths
-cl_mem outputBuffer; // Buffers for the output of each layer
+cl_mem outputBuffer; // Buffers for the output of each layer (maxBatchSize x numNeurons)
+
+// Images are processed in batches, the batch is the second NDRange dimension
+// so every weight tile written to the device is reused by all images of the batch
+const int maxBatchSize = 64;
+int batchSize = 1;
+bool benchmarkMode = false;
+
+FloatBuffer image_batch; // batchSize x inputSize
+FloatBuffer hidden_layer1_batch_out; // batchSize x numNeurons
+FloatBuffer output_layer_batch_out; // batchSize x numNeurons
+
+#else
+
+mnist_model* cpuModel = NULL;
+mnist_context* cpuContext = NULL;
+
+// Number of inference streams sharing cpuModel, each runs numIterations inferences
+int numThreads = 1;
+
+// Server mode keeps the model loaded and answers requests on a Unix socket,
+// client mode sends the loaded image to such a server instead of loading the model
+std::string serverSocketPath;
+std::string clientSocketPath;
+int serverMaxBatch = 32;
+int serverWindowUs = 500;
+
+// Ring mode classifies the frames capture_image.c streams into shared memory
+std::string frameRingName;
+bool frameRingLatestOnly = false;
+
+// Server and ring mode pick up changed model files without a restart
+bool watchModel = false;
+int watchIntervalMs = 500;
+
+// Prunes fc1 to a range of sparsities and compares the dense and CSR kernels
+bool sparsityReport = false;
+
+// Storage format of the CPU weights after loading, and the report comparing the formats
+mnist_weight_format cpuWeightFormat = MNIST_WEIGHTS_FP32;
+bool weightFormatGiven = false;
+bool precisionReport = false;
+
+// fc1 replaced by its truncated SVD at this rank after loading, 0 keeps it dense,
+// and the report of accuracy and latency against the rank
+int fc1Rank = 0;
+bool lowRankReport = false;
+
+// Blocked GEMM of the batched layers against the tiled batch loop and the peak of a core
+bool gemmReport = false;
+
+// Every layer kernel placed under the measured compute and bandwidth roofs of the host
+bool rooflineReport = false;
+
+// Error bounds and timings of the vectorized activations against the libm versions
+bool activationReport = false;
+
+// The convolutional network of TrainNN.ipynb (CnnNet) instead of the fully connected one.
+// Its files are named cnnPrefix + <layer>_weight.bin / _bias.bin. The kernel of each conv
+// and pooling layer comes from -conv_algorithm, and -conv_report times both kernels.
+bool cnnMode = false;
+std::string cnnPrefix = "cnn_";
+std::vector<ConvAlgorithm> cnnAlgorithms;
+bool convReport = false;
+
+// Finds digits anywhere in a gray camera frame (-detect=<bmp>) instead of classifying
+// the 28x28 image, and the report timing the shared fc1 against one call per window
+std::string detectFramePath;
+bool detectInvert = false;
+bool detectReport = false;
+DigitDetector detector;
+
+// What run_cpu asks the output layer for, the log-probabilities of every class by default
+mnist_head cpuHead = MNIST_HEAD_LOG_PROBABILITIES;
+int cpuTopK = 3;
 
 #endif
 
@@ -93,45 +180,306 @@ std::string layer1_biasesPath = "fc1_bias.bin";
 std::string output_weightsPath = "fc2_weight.bin";
 std::string output_biasesPath = "fc2_bias.bin";
 
+// Builds made with EMBED_MODEL=1 carry the weights and use them unless -weights=file
+#ifdef MNIST_EMBEDDED_MODEL
+bool useEmbeddedWeights = true;
+#else
+bool useEmbeddedWeights = false;
+#endif
+
 #if FPGA == 1 // functions that setup opencl environment, problem, run and cleanup 
             // needed only when running the kernel   
 bool init_opencl();
 void run();
+void run_batch(int batch);
+void run_benchmark();
+void fillImageBatch(int batch);
+void processTiles_weightStatinary(int numNeurons,
+    int inputSize, // Size of the input array
+    int inputTileSize,  // Tile size of the Input vector
+    int batch,  // Number of images in the batch
+    FloatBuffer& weights, // Weights array
+    FloatBuffer& biases,  // biases array
+    FloatBuffer& inputs,  // inputs array (batch x inputSize)
+    FloatBuffer& outputs  // outputs array (batch x numNeurons)
+    );
 void cleanup();
 #endif
 
-void normalizeImage(unsigned char* imageData, size_t imageSize, std::vector<float>& normalizedImage);
-void setupDataAndModels();
-void run_cpu();
-void processTiles_weightStatinary_CPU(int numNeurons,
-    int inputSize, // Size of the input array
-    int inputTileSize,  // Tile size of the Input vector          
-    std::vector<float>& weights, // Weights array
-    std::vector<float>& biases,  // biases array
-    std::vector<float>& inputs,  // inputs array 
-    std::vector<float>& outputs  // outputs array);
-    );
+bool loadInputImage();
+bool setupDataAndModels();
+int run_cpu();
+void run_cpu_streams(int threads);
+int run_server();
+int run_client();
+int run_ring();
+int run_allocation_check();
+void run_sparsity_report();
+void run_precision_report();
+void run_low_rank_report();
+void run_gemm_report();
+void run_roofline_report();
+void run_activation_report();
+int run_cnn();
+void run_conv_report();
+bool loadCnnModel();
+int run_detect();
+void run_detect_report();
+bool loadDetector();
+bool loadCpuModel(mnist_model** model);
+void startModelWatch(ModelReloader& reloader);
 void cleanup_cpu();
+void printOutputs(const char* label, const float* v, int count);
 
-void relu(std::vector<float>& v);
-
-int getMaxIn(std::vector<float>& v);
 
+// Every operator new is counted for the -check_allocs test hook, a relaxed increment
+void* operator new(size_t size) {
+    heapAllocations().fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
 
-bool loadModelParameters(const std::string& weightsPath, const std::string& biasesPath, 
-                         std::vector<float>& weightsBuffer, std::vector<float>& biases);
-
+// Kept out of line, GCC otherwise sees free() inlined against an operator new
+// pointer and warns about a mismatch that the replacement above rules out
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
 
-std::vector<float> loadFloatsFromFile(const std::string& filename);
-void log_softmax(std::vector<float>& v);
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
 
 
 // Code execution starts here
 int main(int argc, char **argv) {
 
-  #if FPGA == 1
   // Options from base OpenCL code, ignore for this lab  
   Options options(argc, argv);
+  int exitCode = 0;
+
+  // Loop order of the CPU layers: ws, os, is or auto
+    if(options.has("dataflow")) {
+        std::string name = options.get<std::string>("dataflow");
+        if(name == "os") {
+            cpuDataflow = OUTPUT_STATIONARY;
+        } else if(name == "is") {
+            cpuDataflow = INPUT_STATIONARY;
+        } else if(name == "auto") {
+            cpuDataflow = DATAFLOW_AUTO;
+        } else if(name == "ws") {
+            cpuDataflow = WEIGHT_STATIONARY;
+        } else {
+            std::cerr << "Unknown -dataflow=" << name << ", expected ws, os, is or auto" << std::endl;
+            return -1;
+        }
+    }
+
+  // Weights compiled into the binary or read from the .bin files
+    if(options.has("weights")) {
+        std::string source = options.get<std::string>("weights");
+        if(source != "embedded" && source != "file") {
+            std::cerr << "Unknown -weights=" << source << ", expected embedded or file" << std::endl;
+            return -1;
+        }
+        useEmbeddedWeights = (source == "embedded");
+        if(useEmbeddedWeights && !mnist_model_embedded_available()) {
+            std::cerr << "This build has no embedded weights, rebuild with EMBED_MODEL=1" << std::endl;
+            return -1;
+        }
+    }
+
+  // fc1 weights file, e.g. one pruned by prune_weights.py
+    if(options.has("fc1_weights")) {
+        layer1_weightsPath = options.get<std::string>("fc1_weights");
+    }
+
+  // Count heap allocations over -iterations inferences after a warm up run, exits with 1 if any
+    checkAllocations = options.has("check_allocs");
+
+  // Strip the per-inference console output
+    if(options.has("quiet")) {
+        metrics().quiet = true;
+    }
+
+    if(options.has("iterations")) {
+        numIterations = std::max(1, options.get<int>("iterations"));
+        iterationsGiven = true;
+    }
+
+  // Latency histograms are always recorded, they are exported only when a path is given
+    std::string metricsJsonPath;
+    std::string metricsPromPath;
+    int metricsIntervalMs = 1000;
+    if(options.has("metrics_json")) {
+        metricsJsonPath = options.get<std::string>("metrics_json");
+    }
+    if(options.has("metrics_prom")) {
+        metricsPromPath = options.get<std::string>("metrics_prom");
+    }
+    if(options.has("metrics_interval")) {
+        metricsIntervalMs = std::max(1, options.get<int>("metrics_interval"));
+    }
+
+  // Chrome trace of every stage, -trace=<file> or MNIST_TRACE=<file>
+    if(options.has("trace")) {
+        traceStart(options.get<std::string>("trace"));
+    } else {
+        traceStartFromEnv();
+    }
+
+  // Hardware counters around every stage on every thread that runs one, summed and reported at exit
+    bool perfMode = options.has("perf");
+    if(perfMode) {
+        perfCountersEnable();
+    }
+
+    MetricsExporter metricsExporter;
+    if(!metricsJsonPath.empty() || !metricsPromPath.empty()) {
+        metricsExporter.start(metricsJsonPath, metricsPromPath, metricsIntervalMs);
+    }
+
+  #if FPGA == 0
+  // Concurrent streams on one shared model, reports the aggregate throughput
+    if(options.has("threads")) {
+        numThreads = std::max(1, options.get<int>("threads"));
+    }
+
+  // -serve=<socket> batches the requests of every client, -connect=<socket> is one such client
+    if(options.has("serve")) {
+        serverSocketPath = options.get<std::string>("serve");
+    }
+    if(options.has("connect")) {
+        clientSocketPath = options.get<std::string>("connect");
+    }
+
+  // -ring[=<name>] consumes frames from capture_image.c, -ring_latest skips to the newest frame when behind
+    if(options.has("ring")) {
+        frameRingName = options.get<std::string>("ring");
+        if(frameRingName.empty()) {
+            frameRingName = FRAME_RING_DEFAULT_NAME;
+        }
+        frameRingLatestOnly = options.has("ring_latest");
+    }
+
+  // Reload retrained weights in server and ring mode, the files are checked every watch_interval_ms
+    watchModel = options.has("watch_model");
+    if(options.has("watch_interval_ms")) {
+        watchIntervalMs = std::max(10, options.get<int>("watch_interval_ms"));
+    }
+
+  // Accuracy and fc1 speed-up of the test image at several pruning levels
+    sparsityReport = options.has("sparsity_report");
+
+  // Weights kept as fp32, fp16, bf16, binary or ternary in memory, and the report comparing them
+    if(options.has("weight_format")) {
+        std::string format = options.get<std::string>("weight_format");
+        if(format != "fp32" && format != "fp16" && format != "bf16" && format != "binary" && format != "ternary") {
+            std::cerr << "Unknown -weight_format=" << format << ", expected fp32, fp16, bf16, binary or ternary" << std::endl;
+            return -1;
+        }
+        cpuWeightFormat = format == "fp16" ? MNIST_WEIGHTS_FP16 : format == "bf16" ? MNIST_WEIGHTS_BF16 :
+                          format == "binary" ? MNIST_WEIGHTS_BINARY : format == "ternary" ? MNIST_WEIGHTS_TERNARY :
+                          MNIST_WEIGHTS_FP32;
+        weightFormatGiven = true;
+    }
+    precisionReport = options.has("precision_report");
+
+  // fc1 as two low-rank factors, and the report trading the rank against accuracy and latency
+    if(options.has("fc1_rank")) {
+        fc1Rank = std::max(1, options.get<int>("fc1_rank"));
+    }
+    lowRankReport = options.has("low_rank_report");
+    gemmReport = options.has("gemm_report");
+    rooflineReport = options.has("roofline_report");
+
+  // fastExp / fastLog error bounds and the activation benchmark
+    activationReport = options.has("activation_report");
+
+  // -cnn runs CnnNet, -conv_algorithm=im2col|direct for every conv and pooling layer or a
+  // comma separated list with one per layer in order, e.g. im2col,direct,im2col,direct
+    cnnMode = options.has("cnn");
+    if(options.has("cnn_prefix")) {
+        cnnPrefix = options.get<std::string>("cnn_prefix");
+    }
+    if(options.has("conv_algorithm")) {
+        std::string list = options.get<std::string>("conv_algorithm");
+        for(size_t start = 0; start <= list.size(); ) {
+            size_t end = std::min(list.find(',', start), list.size());
+            std::string name = list.substr(start, end - start);
+            if(name != "im2col" && name != "direct") {
+                std::cerr << "Unknown -conv_algorithm entry " << name << ", expected im2col or direct" << std::endl;
+                return -1;
+            }
+            cnnAlgorithms.push_back(name == "direct" ? CONV_DIRECT : CONV_IM2COL);
+            start = end + 1;
+        }
+    }
+    convReport = options.has("conv_report");
+
+  // -detect=<frame.bmp> with -detect_sizes=48,64,... (window sizes in frame pixels), -detect_step=N
+  // (scaled pixels between windows), -detect_min_score=P, -detect_overlap=F (of the smaller box) and -detect_invert
+  // for dark digits on light paper. The first -conv_algorithm entry runs the fc1 correlation.
+    if(options.has("detect")) {
+        detectFramePath = options.get<std::string>("detect");
+    }
+    if(options.has("detect_sizes")) {
+        std::string list = options.get<std::string>("detect_sizes");
+        detector.windowSizes.clear();
+        for(size_t start = 0; start <= list.size(); ) {
+            size_t end = std::min(list.find(',', start), list.size());
+            std::string entry = list.substr(start, end - start);
+            char* parsed = NULL;
+            long size = strtol(entry.c_str(), &parsed, 10);
+            if(entry.empty() || *parsed != '\0' || size < MNIST_IMAGE_WIDTH || size > INT_MAX) {
+                std::cerr << "Invalid -detect_sizes entry " << entry << ", expected window sizes of at least "
+                          << MNIST_IMAGE_WIDTH << " pixels" << std::endl;
+                return -1;
+            }
+            detector.windowSizes.push_back((int)size);
+            start = end + 1;
+        }
+    }
+    if(options.has("detect_step")) {
+        detector.step = std::max(1, options.get<int>("detect_step"));
+    }
+    if(options.has("detect_min_score")) {
+        detector.minScore = options.get<float>("detect_min_score");
+    }
+    if(options.has("detect_overlap")) {
+        detector.maxOverlap = options.get<float>("detect_overlap");
+    }
+    if(!cnnAlgorithms.empty()) {
+        detector.algorithm = cnnAlgorithms[0];
+    }
+    detectInvert = options.has("detect_invert");
+    detectReport = options.has("detect_report");
+
+  // Output head: label (argmax only), topk (with -top_k=K), probabilities or log_probabilities
+    if(options.has("head")) {
+        std::string head = options.get<std::string>("head");
+        if(head != "label" && head != "topk" && head != "probabilities" && head != "log_probabilities") {
+            std::cerr << "Unknown -head=" << head << ", expected label, topk, probabilities or log_probabilities" << std::endl;
+            return -1;
+        }
+        cpuHead = head == "label" ? MNIST_HEAD_LABEL : head == "topk" ? MNIST_HEAD_TOP_K :
+                  head == "probabilities" ? MNIST_HEAD_PROBABILITIES : MNIST_HEAD_LOG_PROBABILITIES;
+    }
+    if(options.has("top_k")) {
+        cpuTopK = std::min(std::max(1, options.get<int>("top_k")), MNIST_NUM_CLASSES);
+    }
+
+  // A batch runs once max_batch requests are queued or batch_window_us after the first one
+    if(options.has("max_batch")) {
+        serverMaxBatch = std::max(1, options.get<int>("max_batch"));
+    }
+    if(options.has("batch_window_us")) {
+        serverWindowUs = std::max(0, options.get<int>("batch_window_us"));
+    }
+  #endif
+
+  #if FPGA == 1
 
   // Optional argument to specify the problem size.
   // Relative path to aocx filename.
@@ -141,21 +489,90 @@ int main(int argc, char **argv) {
         aocxFilename = "matrixMul";
     }
 
+  // Number of images processed per kernel launch
+    if(options.has("batch")) {
+        batchSize = options.get<int>("batch");
+        batchSize = std::max(1, std::min(batchSize, maxBatchSize));
+    }
+
+  // Report throughput for batch sizes 1..maxBatchSize instead of a single run
+    benchmarkMode = options.has("benchmark");
+
   // Initialize OpenCL.
   if(!init_opencl()) {
     return -1;
   }
   #endif
 
-  setupDataAndModels();
+  if(!setupDataAndModels()) {
+    #if FPGA == 1
+      cleanup();
+    #else
+      cleanup_cpu();
+    #endif
+    return -1;
+  }
 
 
   // Run the kernel.
   #if FPGA == 1
   //Initialize the problem data.
-  run();
+  if(benchmarkMode) {
+    run_benchmark();
+  } else {
+    run();
+  }
   #else
-  run_cpu();
+  if(!detectFramePath.empty()) {
+    if(detectReport) {
+      run_detect_report();
+    } else {
+      exitCode = run_detect() < 0 ? 1 : 0;
+    }
+  } else if(cnnMode) {
+  int Label = -1;
+  for(int i = 0; i < numIterations; ++i) {
+    frameId = i;
+    Label = run_cnn();
+  }
+  if(quietMode()) {
+    printf("Predicted label:%d\n",Label);
+  }
+  } else if(!serverSocketPath.empty()) {
+    run_server();
+  } else if(!clientSocketPath.empty()) {
+    run_client();
+  } else if(!frameRingName.empty()) {
+    run_ring();
+  } else if(sparsityReport) {
+    run_sparsity_report();
+  } else if(precisionReport) {
+    run_precision_report();
+  } else if(lowRankReport) {
+    run_low_rank_report();
+  } else if(gemmReport) {
+    run_gemm_report();
+  } else if(rooflineReport) {
+    run_roofline_report();
+  } else if(activationReport) {
+    run_activation_report();
+  } else if(convReport) {
+    run_conv_report();
+  } else if(checkAllocations) {
+    exitCode = run_allocation_check();
+  } else if(numThreads > 1) {
+    run_cpu_streams(numThreads);
+  } else {
+  int Label = -1;
+  for(int i = 0; i < numIterations; ++i) {
+    frameId = i;
+    Label = run_cpu();
+  }
+  // The per-inference lines are stripped in quiet mode, report the result once
+  if(quietMode()) {
+    printf("Predicted label:%d\n",Label);
+  }
+  }
   #endif
 
   // Free the resources allocated
@@ -165,126 +582,149 @@ int main(int argc, char **argv) {
     cleanup_cpu();
   #endif
 
+  metricsExporter.stop();
+  traceFinish();
+
+  if(perfMode) {
+    perfCountersReport(stdout);
+  }
 
-  return 0;
+  return exitCode;
 }
 
 
 
-void setupDataAndModels(){
+// Reads the 28x28 test image into image_pixels, rows top to bottom
+bool loadInputImage(){
     const char* filename = "first_image_mnist.bmp";
     int width = 0;
     int height = 0;
 
-    unsigned char* pre_image_data = loadBMPGrayscale(filename, &width, &height);
+    unsigned char* pre_image_data;
+    {
+        ScopedStageTimer timer(STAGE_LOAD);
+        ScopedPerfCounters perf(STAGE_LOAD);
+        TraceSpan span("bmp_read", "io", frameId);
+        pre_image_data = loadBMPGrayscale(filename, &width, &height);
+    }
+    if (!pre_image_data || width * height != inputSize) {
+        std::cerr << "Failed to load a 28x28 image from " << filename << std::endl;
+        delete[] pre_image_data;
+        metrics().failures++;
+        return false;
+    }
+
     flipImageVertically(pre_image_data, width, height);
+    image_pixels.assign(pre_image_data, pre_image_data + width * height);
+    delete[] pre_image_data;
 
-    normalizeImage(pre_image_data, width*height, image_data);
-    
     printf("done loading image:%d\n",width*height);
 
+    return true;
+}
 
-    if (!loadModelParameters(layer1_weightsPath,layer1_biasesPath,hidden_layer1_weights,hidden_layer1_biases)) {
 
-        std::cerr << "Failed to load model layer 1 parameters." << std::endl;
-        #if FPGA == 1
-            cleanup();
-        #endif
-        return;
+bool setupDataAndModels(){
+    #if FPGA == 0
+    // In ring mode the frames come from shared memory, detection reads its own frame
+    if (frameRingName.empty() && detectFramePath.empty() && !loadInputImage()) {
+        return false;
     }
-
-    if (!loadModelParameters(output_weightsPath,output_biasesPath,output_layer_weights,output_layer_biases)) {
-        std::cerr << "Failed to load model output layer parameters." << std::endl;
-        #if FPGA == 1
-            cleanup();
-        #endif
-        return;
+    #else
+    if (!loadInputImage()) {
+        return false;
     }
+    #endif
 
-    printf("loaded model parameters\n");
-
+    #if FPGA == 1
+    {
+        ScopedStageTimer timer(STAGE_PREPROCESS);
+        ScopedPerfCounters perf(STAGE_PREPROCESS);
+        TraceSpan span("normalization", "preprocess", frameId);
+        normalizeImage(image_pixels.data(), image_pixels.size(), image_data);
+    }
 
+    ScopedStageTimer timer(STAGE_LOAD);
+    ScopedPerfCounters perf(STAGE_LOAD, 0);
+    TraceSpan span("model_load", "io", frameId);
+
+    #ifdef MNIST_EMBEDDED_MODEL
+    if (useEmbeddedWeights) {
+        hidden_layer1_weights.assign(embedded_model::fc1_weight, embedded_model::fc1_weight + embedded_model::fc1Outputs * embedded_model::fc1Inputs);
+        hidden_layer1_biases.assign(embedded_model::fc1_bias, embedded_model::fc1_bias + embedded_model::fc1Outputs);
+        output_layer_weights.assign(embedded_model::fc2_weight, embedded_model::fc2_weight + embedded_model::fc2Outputs * embedded_model::fc2Inputs);
+        output_layer_biases.assign(embedded_model::fc2_bias, embedded_model::fc2_bias + embedded_model::fc2Outputs);
+        printf("loaded embedded model parameters\n");
+        return true;
+    }
+    #endif
 
-}
+    if (!loadModelParameters(layer1_weightsPath,layer1_biasesPath,hidden_layer1_weights,hidden_layer1_biases)) {
 
+        std::cerr << "Failed to load model layer 1 parameters." << std::endl;
+        metrics().failures++;
+        return false;
+    }
 
-void log_softmax(std::vector<float>& v) {
+    if (!loadModelParameters(output_weightsPath,output_biasesPath,output_layer_weights,output_layer_biases)) {
+        std::cerr << "Failed to load model output layer parameters." << std::endl;
+        metrics().failures++;
+        return false;
+    }
+    #else
+    // The server owns the model
+    if (!clientSocketPath.empty()) {
+        return true;
+    }
 
-    float maxElement = *std::max_element(v.begin(), v.end());
-    std::vector<float> exp_values(v.size());
-    float sum = 0.0f;
+    if (!detectFramePath.empty()) {
+        return loadDetector();
+    }
 
-    // Calculate exponentials and sum them
-    for(size_t i = 0; i < v.size(); ++i) {
-        exp_values[i] = std::exp(v[i] - maxElement);
-        sum += exp_values[i];
+    if (cnnMode) {
+        return loadCnnModel();
     }
 
-    // Normalize
-    for(size_t i = 0; i < v.size(); ++i) {
-        v[i] = std::log(exp_values[i] / sum);
+    if (!loadCpuModel(&cpuModel)) {
+        return false;
     }
 
+    mnist_status status = mnist_context_create(cpuModel, &cpuContext);
+    if (status != MNIST_OK) {
+        std::cerr << "Failed to create inference context: " << mnist_status_string(status) << std::endl;
+        return false;
+    }
+    mnist_context_set_dataflow(cpuContext, (mnist_dataflow)cpuDataflow);
+    #endif
 
+    printf("loaded model parameters\n");
 
+    return true;
 }
 
 
-void normalizeImage(unsigned char* imageData, size_t imageSize, std::vector<float>& normalizedImage) {
-    normalizedImage.resize(imageSize);
-
-    float mean=0.1307f;
-    float std=0.3081f;
-    for (size_t i = 0; i < imageSize; ++i) {
-        normalizedImage[i] = (imageData[i] / 255.0f - mean) / std;
+#if FPGA == 0
+// Loads the model the options name and stores it in -weight_format when one is given,
+// files named *.f16 / *.bf16 are already 16-bit, *.b1 / *.t2 binary / ternary
+bool loadCpuModel(mnist_model** model) {
+    mnist_status status = useEmbeddedWeights ? mnist_model_load_embedded(model) :
+        mnist_model_load(layer1_weightsPath.c_str(), layer1_biasesPath.c_str(),
+                         output_weightsPath.c_str(), output_biasesPath.c_str(), model);
+    if (status == MNIST_OK && weightFormatGiven) {
+        status = mnist_model_convert_weights(*model, cpuWeightFormat);
     }
-}
-
-
-std::vector<float> loadFloatsFromFile(const std::string& filename) {
-    // Open the file in binary mode
-    std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
-    
-    if (!file.is_open()) {
-        std::cerr << "Failed to open file: " << filename << std::endl;
-        return {}; // Return an empty vector in case of failure
+    if (status == MNIST_OK && fc1Rank > 0) {
+        status = mnist_model_factorize_layer(*model, 0, fc1Rank);
     }
-
-    // Determine the file size
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    // Calculate the number of float elements
-    std::streamsize numElements = size / sizeof(float);
-
-    std::vector<float> buffer(numElements);
-
-    // Read the file content into the buffer
-    if (!file.read(reinterpret_cast<char*>(buffer.data()), size)) {
-        std::cerr << "Failed to read floats from file: " << filename << std::endl;
-        return {}; // Return an empty vector in case of failure
+    if (status != MNIST_OK) {
+        std::cerr << "Failed to load model parameters: " << mnist_status_string(status) << std::endl;
+        mnist_model_free(*model);
+        *model = NULL;
+        return false;
     }
-
-    file.close(); // Close the file
-    return buffer; // Return the loaded floats
-}
-
-
-
-
-
-bool loadModelParameters(const std::string& weightsPath, const std::string& biasesPath, 
-                         std::vector<float>& weightsBuffer, std::vector<float>& biases) {
-
-
-    weightsBuffer = loadFloatsFromFile(weightsPath);
-
-
-    biases = loadFloatsFromFile(biasesPath);
-
-
-    return true; // Successfully loaded and transferred weights and biases
+    return true;
 }
+#endif
 
 
 #if FPGA == 1
@@ -337,6 +777,15 @@ bool init_opencl() {
     kernel = clCreateKernel(program, "matrixMul", &status);
     checkError(status, "Failed to create cnn kernel");
 
+    // Create the persistent buffers, sized for the largest layer and batch
+    inputTileBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY, maxBatchSize * inputSize * sizeof(float), NULL, &err);
+    checkError(err, "Failed to create input buffer");
+
+    weightsTileBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY, numNeurons * inputTileSize * sizeof(float), NULL, &err);
+    checkError(err, "Failed to create weights tile buffer");
+
+    outputBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, maxBatchSize * numNeurons * sizeof(float), NULL, &err);
+    checkError(err, "Failed to create output buffer");
 
     if(err != CL_SUCCESS){
     }else{
@@ -349,281 +798,1437 @@ bool init_opencl() {
 
 
 
-#if FPGA == 1
 void processTiles_weightStatinary(int numNeurons,
     int inputSize, // Size of the input array
-    int inputTileSize,  // Tile size of the Input vector          
-    std::vector<float>& weights, // Weights array
-    std::vector<float>& biases,  // biases array
-    std::vector<float>& inputs,  // inputs array 
-    std::vector<float>& outputs  // outputs array
+    int inputTileSize,  // Tile size of the Input vector
+    int batch,  // Number of images in the batch
+    FloatBuffer& weights, // Weights array
+    FloatBuffer& biases,  // biases array
+    FloatBuffer& inputs,  // inputs array (batch x inputSize)
+    FloatBuffer& outputs  // outputs array (batch x numNeurons)
     ) {
 
-    printf("in the weight stationary function\n");
-
     cl_int err;
 
-    int outputNeuronsTileSize = 10;
-    int currentTileSize = inputTileSize;
+    int numTiles = inputSize / inputTileSize; // Ensure this division is an integer
+    int weightsPerTile = numNeurons * inputTileSize;
 
-    #if FPGA == 1
-        weightsTileBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY, currentTileSize * outputNeuronsTileSize * sizeof(float), NULL, &err);
-        
-        //#TODO : create remaining required buffers
+    float pattern = 0.0f; // The pattern to fill, here it's 0.0 for float
+    size_t pattern_size = sizeof(float); // Size of the pattern, here it's the size of a float
+    size_t offset = 0; // Start offset within the buffer
+    size_t size = batch * numNeurons * sizeof(float); // Size of the buffer to fill
+
+    //set output buffer to zeros, use this buffer to accumulate results for dot product
+    err = clEnqueueFillBuffer(queue, outputBuffer, &pattern, pattern_size, offset, size, 0, NULL, NULL);
+    checkError(err, "Failed to fill output buffer");
+
+    // The whole input batch is transferred once, the kernel reads each tile at an offset
+    err = clEnqueueWriteBuffer(queue, inputTileBuffer, CL_FALSE, 0, batch * inputSize * sizeof(float), inputs.data(), 0, NULL, NULL);
+    checkError(err, "Failed to write input buffer");
+
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&inputTileBuffer);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&weightsTileBuffer);
+    clSetKernelArg(kernel, 2, sizeof(int), &inputTileSize);
+    clSetKernelArg(kernel, 4, sizeof(int), &inputSize);
+    clSetKernelArg(kernel, 5, sizeof(int), &numNeurons);
+    clSetKernelArg(kernel, 6, sizeof(cl_mem), (void*)&outputBuffer);
+
+    FloatBuffer temp_wts(weightsPerTile);
+
+    // dimension 0 is the neuron, dimension 1 is the image in the batch
+    size_t global_work_size[] = {static_cast<size_t>(numNeurons), static_cast<size_t>(batch)};
+    size_t local_work_size[] = {static_cast<size_t>(numNeurons), static_cast<size_t>(1)};
+
+    for (int tileIndex = 0; tileIndex < numTiles; ++tileIndex) {
+        int weightsStartIndex = tileIndex * inputTileSize;
+        loadWeights(weightsStartIndex, numNeurons, inputTileSize, inputSize, weights.data(), temp_wts.data());
+
+        // Blocking write, temp_wts is refilled for the next tile
+        err = clEnqueueWriteBuffer(queue, weightsTileBuffer, CL_TRUE, 0, weightsPerTile * sizeof(float), temp_wts.data(), 0, NULL, NULL);
+        checkError(err, "Failed to write weights tile buffer");
+
+        clSetKernelArg(kernel, 3, sizeof(int), &weightsStartIndex);
 
-        if(err != CL_SUCCESS){
-        }else{
-            printf("done creating buffer\n");
+        err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL);
+        checkError(err, "Failed to launch kernel");
+    }
+
+    // OpenCL kernels running on FPGA are not synchornous, the blocking read waits for the queue
+    outputs.resize(batch * numNeurons);
+    err = clEnqueueReadBuffer(queue, outputBuffer, CL_TRUE, 0, batch * numNeurons * sizeof(float), outputs.data(), 0, NULL, NULL);
+    checkError(err, "Failed to read output buffer");
+
+    for (int b = 0; b < batch; ++b) {
+        for (int i = 0; i < numNeurons; ++i) {
+            outputs[b * numNeurons + i] += biases[i];
         }
+    }
+}
 
 
-        float pattern = 0.0f; // The pattern to fill, here it's 1.0 for float
-        size_t pattern_size = sizeof(float); // Size of the pattern, here it's the size of a float
-        size_t offset = 0; // Start offset within the buffer
-        size_t size = numNeurons * sizeof(float); // Size of the buffer to fill
+// Replicates the loaded image batch times, until more input sources are wired in
+void fillImageBatch(int batch) {
+    image_batch.resize(batch * inputSize);
+    for (int b = 0; b < batch; ++b) {
+        std::copy(image_data.begin(), image_data.end(), image_batch.begin() + b * inputSize);
+    }
+}
 
-        //set output buffer to zeros, use this buffer to accumulate results for dot product
-        err = clEnqueueFillBuffer(queue, outputBuffer, &pattern, pattern_size, offset, size, 0, NULL, NULL);
-    #else
-    #endif
 
-    #if FPGA == 1    
-        clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&inputTileBuffer);
-        //#TODO : set remaining kernel arguments
-    #endif
+void run_batch(int batch) {
+    {
+        ScopedStageTimer timer(STAGE_FC1);
+        ScopedPerfCounters perf(STAGE_FC1, batch);
+        TraceSpan span("fc1", "layer", frameId);
+        processTiles_weightStatinary(numNeurons,
+            inputSize, // Size of the input array
+            inputTileSize,  // Tile size of the Input vector
+            batch,
+            hidden_layer1_weights, // Weights array
+            hidden_layer1_biases,  // biases array
+            image_batch,  // inputs array
+            hidden_layer1_batch_out  // outputs array
+        );
 
+        relu(hidden_layer1_batch_out);
+    }
 
-    //#TODO: similar to weightstationary_cpu code implemnt the same logic with inner loop taken care by the parallel kernes
+    {
+        ScopedStageTimer timer(STAGE_FC2);
+        ScopedPerfCounters perf(STAGE_FC2, batch);
+        TraceSpan span("fc2", "layer", frameId);
+        processTiles_weightStatinary(numNeurons,
+            numNeurons, // Size of the input array
+            numNeurons,  // Tile size of the Input vector
+            batch,
+            output_layer_weights, // Weights array
+            output_layer_biases,  // biases array
+            hidden_layer1_batch_out,  // inputs array
+            output_layer_batch_out  // outputs array
+        );
+    }
+}
 
-    //For each kernel launch you write data to the buffers using a command similar to the following 
-    // err = clEnqueueWriteBuffer(queue, weightsTileBuffer, CL_TRUE, 0, weightsPerTile * sizeof(float), &hidden_layer1_weights[weightsStartIndex], 0, NULL, NULL);
 
-    //#TODO: After writing buffers to each kernel launch kernel using the follwoing code
+void run() {
 
-    // global work size and local work sizes are the kernel dimensions, for this lab sizes as simple as the following is good
+    HOT_PRINTF("started running on fpga, batch size:%d\n", batchSize);
 
-    //size_t global_work_size[] = {static_cast<size_t>(10)};
-    //size_t local_work_size[] = {static_cast<size_t>(1)};
+    fillImageBatch(batchSize);
+    run_batch(batchSize);
 
-    // assuming you implemented a 1D kernel in OpenCL, if you implemented 2D please discuss with TA    
+    for (int b = 0; b < batchSize; ++b) {
+        output_layer_out.assign(output_layer_batch_out.begin() + b * numNeurons,
+                                output_layer_batch_out.begin() + (b + 1) * numNeurons);
 
-    //err = clEnqueueNDRangeKernel(queue, kernel, 0, NULL, global_work_size, local_work_size, 1, NULL, NULL);
+        printOutputs("Output of fc2 (before LogSoftmax): ", output_layer_out.data(), numNeurons);
 
-    // OpenCL kernels running on FPGA are not synchornous. You will synchronize your computations by waiting till the queue is finished by the following code    
-    // clFinish(queue);    
-    
+        int Label;
+        {
+            ScopedStageTimer timer(STAGE_POSTPROCESS);
+            ScopedPerfCounters perf(STAGE_POSTPROCESS);
+            TraceSpan span("softmax", "postprocess", frameId + b);
+            log_softmax(output_layer_out);
+            Label = getMaxIn(output_layer_out);
+        }
 
-    #if FPGA == 1
-        clReleaseMemObject(inputTileBuffer);
-        //#TODO: release remaining memory buffers
-    #endif
+        TraceSpan span("result", "postprocess", frameId + b);
+        metrics().inferences++;
+        HOT_PRINTF("Image %d predicted label:%d\n", b, Label);
+    }
+}
+
+
+// Throughput vs. batch size, every batch size is run for the same number of images
+void run_benchmark() {
+    const int imagesPerPoint = 256;
+
+    printf("batch,images,seconds,images_per_second\n");
+
+    for (int batch = 1; batch <= maxBatchSize; batch *= 2) {
+        fillImageBatch(batch);
+        run_batch(batch); // warm up
+
+        int launches = imagesPerPoint / batch;
+        double start = getCurrentTimestamp();
+        for (int i = 0; i < launches; ++i) {
+            run_batch(batch);
+        }
+        double elapsed = getCurrentTimestamp() - start;
+
+        printf("%d,%d,%f,%f\n", batch, launches * batch, elapsed, launches * batch / elapsed);
+    }
 }
 #endif
 
+#if FPGA == 0
+int run_cpu() {
 
+    HOT_PRINTF("started running on CPU\n");
 
+    mnist_result result;
 
-void run() {
-    cl_int status;
+    mnist_status status = mnist_infer_head_u8(cpuContext, image_pixels.data(), 1, cpuHead, cpuTopK, &result);
+    if (status != MNIST_OK) {
+        std::cerr << "Inference failed: " << mnist_status_string(status) << std::endl;
+        return -1;
+    }
+
+    const char* layerNames[MNIST_NUM_LAYERS] = {"fc1", "fc2"};
+    for (int layer = 0; layer < MNIST_NUM_LAYERS; ++layer) {
+        mnist_dataflow dataflow;
+        uint64_t weightBytes, inputBytes, psumBytes;
+        mnist_context_get_traffic(cpuContext, layer, &dataflow, &weightBytes, &inputBytes, &psumBytes);
+        HOT_PRINTF("%s %s traffic: weights:%llu inputs:%llu psums:%llu bytes\n", layerNames[layer],
+            dataflowName((Dataflow)dataflow), (unsigned long long)weightBytes,
+            (unsigned long long)inputBytes, (unsigned long long)psumBytes);
+    }
+
+    TraceSpan span("result", "postprocess", frameId);
+
+    if (cpuHead == MNIST_HEAD_LOG_PROBABILITIES) {
+        printOutputs("Output of fc2 (after LogSoftmax): ", result.scores, MNIST_NUM_CLASSES);
+    } else if (cpuHead == MNIST_HEAD_PROBABILITIES) {
+        printOutputs("Output of fc2 (after Softmax): ", result.scores, MNIST_NUM_CLASSES);
+    } else if (cpuHead == MNIST_HEAD_TOP_K) {
+        for (int i = 0; i < result.count; ++i) {
+            HOT_PRINTF("top %d: class %d log-probability %g\n", i + 1, result.classes[i], result.scores[i]);
+        }
+    }
 
-    // hidden 
-    const unsigned hiddenLayerIndex = 0;
-    const unsigned outputLayerIndex = 1;
+    HOT_PRINTF("Predicted label:%d\n",result.label);
+
+    return result.label;
+}
 
-    size_t hidden_weights_offset = 0; // Starting at the beginning for the hidden layer
-    size_t output_weights_offset = 784 * 10; // Adjust based on your buffer organization
-    size_t hidden_biases_offset = 0;
-    size_t output_biases_offset = 10; // Assuming biases are also concatenated
 
-    size_t hidden_work_size = {10};
-    size_t output_work_size = {10};
+// Every stream owns a context on the shared model, the inference path takes no locks
+void run_cpu_streams(int threads) {
+    std::vector<mnist_context*> contexts(threads, NULL);
+    for (int t = 0; t < threads; ++t) {
+        if (mnist_context_create(cpuModel, &contexts[t]) != MNIST_OK) {
+            std::cerr << "Could not create context for stream " << t << std::endl;
+            for (int c = 0; c < t; ++c) {
+                mnist_context_free(contexts[c]);
+            }
+            return;
+        }
+        mnist_context_set_dataflow(contexts[t], (mnist_dataflow)cpuDataflow);
+    }
+
+    std::vector<int> labels(threads, -1);
+    std::vector<std::thread> workers;
 
+    double start = getCurrentTimestamp();
+    for (int t = 0; t < threads; ++t) {
+        workers.push_back(std::thread([t, &contexts, &labels]() {
+            for (int i = 0; i < numIterations; ++i) {
+                mnist_infer_u8(contexts[t], image_pixels.data(), &labels[t], NULL);
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); ++t) {
+        workers[t].join();
+    }
+    double elapsed = getCurrentTimestamp() - start;
 
-    printf("started running on fpga\n");
+    for (int t = 0; t < threads; ++t) {
+        if (labels[t] != labels[0]) {
+            std::cerr << "Stream " << t << " predicted " << labels[t] << ", stream 0 predicted " << labels[0] << std::endl;
+        }
+        mnist_context_free(contexts[t]);
+    }
 
-    //#TODO: similar to connecting computing each layer and connecting them in CPU code, implement same logic here but calling the FPGA functions
+    long images = (long)threads * numIterations;
+    printf("threads:%d images:%ld seconds:%f images_per_second:%f\n", threads, images, elapsed, images / elapsed);
+    printf("Predicted label:%d\n", labels[0]);
 }
-#endif
 
-void matrixMulCPU(
-    std::vector<float>& input_tile,  // Tile of the Input vector
-    std::vector<float>& weights_tile, // Tile of the Weights matrix
-    int input_tile_size,                  // Size of the input tile
-    int output_neurons_tile_size,         // Size of the output tile (number of neurons in this tile)
-    std::vector<float>& output_tile                // Output vector tile
-){
 
-    int neuron_id = 0;
-    for(neuron_id;neuron_id<output_neurons_tile_size;neuron_id++){
-    // Ensure we don't process more neurons than we have in this tile
-    if (neuron_id < output_neurons_tile_size) {
-        float temp_sum = 0.0;
-        
-        // Compute the dot product of the input tile and the corresponding weights
-        for (int i = 0; i < input_tile_size; ++i) {
+// Layers of CnnNet, run one after another. Activations move between two buffers, every
+// layer reads one and writes the other; flatten only changes how the next layer reads.
+enum CnnLayerType {
+    CNN_CONV,
+    CNN_POOL,
+    CNN_FLATTEN,
+    CNN_DENSE
+};
+
+struct CnnLayer {
+    CnnLayerType type;
+    std::string name; // parameter files are cnnPrefix + name + _weight.bin / _bias.bin
+    ConvShape conv;
+    PoolShape pool;
+    PoolType poolType;
+    ConvAlgorithm algorithm;
+    int channels, height, width; // of the output, flatten keeps those of its input
+    int inputSize, outputSize; // floats per image
+    bool relu; // applied to the outputs
+    FloatBuffer weights, biases;
+
+    CnnLayer(CnnLayerType type_, const char* name_)
+        : type(type_), name(name_), conv(), pool(), poolType(POOL_MAX), algorithm(CONV_IM2COL),
+          channels(1), height(1), width(1), inputSize(0), outputSize(0), relu(false) {}
+};
+
+std::vector<CnnLayer> cnnLayers;
+FloatBuffer cnnActivations[2];
+ScratchArena cnnScratch;
+
+static CnnLayer cnnConv(const char* name, ConvShape shape) {
+    CnnLayer layer(CNN_CONV, name);
+    layer.conv = shape;
+    layer.channels = shape.outChannels;
+    layer.height = shape.outHeight();
+    layer.width = shape.outWidth();
+    layer.inputSize = shape.inputSize();
+    layer.outputSize = shape.outputSize();
+    layer.relu = true;
+    return layer;
+}
 
-          int weight_index = neuron_id * input_tile_size + i;
-          //printf("weight index:%d\n",weight_index);
-          temp_sum += (float)input_tile[i] * (float)weights_tile[weight_index];
-     }
+static CnnLayer cnnPool(const char* name, PoolType type, PoolShape shape) {
+    CnnLayer layer(CNN_POOL, name);
+    layer.pool = shape;
+    layer.poolType = type;
+    layer.channels = shape.channels;
+    layer.height = shape.outHeight();
+    layer.width = shape.outWidth();
+    layer.inputSize = shape.inputSize();
+    layer.outputSize = shape.outputSize();
+    return layer;
+}
+
+static CnnLayer cnnFlatten(const CnnLayer& previous) {
+    CnnLayer layer(CNN_FLATTEN, "flatten");
+    layer.channels = previous.channels;
+    layer.height = previous.height;
+    layer.width = previous.width;
+    layer.inputSize = layer.outputSize = previous.outputSize;
+    return layer;
+}
+
+static CnnLayer cnnDense(const char* name, int inputs, int outputs) {
+    CnnLayer layer(CNN_DENSE, name);
+    layer.channels = outputs;
+    layer.inputSize = inputs;
+    layer.outputSize = outputs;
+    return layer;
+}
+
+// CnnNet of TrainNN.ipynb, change both together
+static std::vector<CnnLayer> buildCnnNet() {
+    const ConvShape conv1 = {1, 28, 28, 8, 3, 1, 1};
+    const PoolShape pool1 = {8, 28, 28, 2, 2};
+    const ConvShape conv2 = {8, 14, 14, 16, 3, 1, 1};
+    const PoolShape pool2 = {16, 14, 14, 2, 2};
+
+    std::vector<CnnLayer> layers;
+    layers.push_back(cnnConv("conv1", conv1));
+    layers.push_back(cnnPool("pool1", POOL_MAX, pool1));
+    layers.push_back(cnnConv("conv2", conv2));
+    layers.push_back(cnnPool("pool2", POOL_AVERAGE, pool2));
+    layers.push_back(cnnFlatten(layers.back()));
+    layers.push_back(cnnDense("fc", pool2.outputSize(), numNeurons));
+    return layers;
+}
+
+// A fully connected layer of the CNN runs with the tile size of fc1 when it divides the inputs
+static int cnnTileSize(const CnnLayer& layer) {
+    return layer.inputSize % inputTileSize == 0 ? inputTileSize : layer.inputSize;
+}
+
+// Builds the layers, loads their weights and sizes the activations and the scratch once.
+// -conv_algorithm is applied to the conv and pooling layers in order, the last entry
+// to any layer past the end of the list.
+bool loadCnnModel() {
+    cnnLayers = buildCnnNet();
+
+    size_t largest = inputSize;
+    size_t scratchFloats = 0;
+    size_t algorithmIndex = 0;
+    for (size_t l = 0; l < cnnLayers.size(); ++l) {
+        CnnLayer& layer = cnnLayers[l];
+        if ((layer.type == CNN_CONV || layer.type == CNN_POOL) && !cnnAlgorithms.empty()) {
+            layer.algorithm = cnnAlgorithms[std::min(algorithmIndex++, cnnAlgorithms.size() - 1)];
+        }
+        largest = std::max(largest, (size_t)layer.outputSize);
+
+        if (layer.type == CNN_POOL) {
+            scratchFloats = std::max(scratchFloats, pool2dScratchFloats(layer.algorithm, layer.pool));
+        }
+        if (layer.type != CNN_CONV && layer.type != CNN_DENSE) {
+            continue;
+        }
 
-        // Write the computed sum for this neuron to the output tile
-        output_tile[neuron_id] += temp_sum;
+        std::string weightsPath = cnnPrefix + layer.name + "_weight.bin";
+        std::string biasesPath = cnnPrefix + layer.name + "_bias.bin";
+        if (!loadModelParameters(weightsPath, biasesPath, layer.weights, layer.biases)) {
+            std::cerr << "Failed to load " << weightsPath << ", export CnnNet with TrainNN.ipynb" << std::endl;
+            metrics().failures++;
+            return false;
+        }
+        size_t rows = layer.type == CNN_CONV ? layer.conv.outChannels : layer.outputSize;
+        size_t cols = layer.type == CNN_CONV ? layer.conv.patchSize() : layer.inputSize;
+        if (layer.weights.size() != rows * cols || layer.biases.size() != rows) {
+            std::cerr << weightsPath << " does not hold a " << rows << "x" << cols << " layer" << std::endl;
+            metrics().failures++;
+            return false;
+        }
+        scratchFloats = std::max(scratchFloats, layer.type == CNN_CONV ?
+            conv2dScratchFloats(layer.algorithm, layer.conv) :
+            layerScratchFloats((int)rows, cnnTileSize(layer)));
     }
+
+    cnnActivations[0].assign(largest, 0.0f);
+    cnnActivations[1].assign(largest, 0.0f);
+    cnnScratch.reserve(scratchFloats);
+
+    // The shapes are checked here once, the layers run without checks
+    ConstTensorView activations = viewOf(cnnActivations[0], 1, inputSize);
+    for (size_t l = 0; l < cnnLayers.size(); ++l) {
+        const CnnLayer& layer = cnnLayers[l];
+        TensorView output = viewOf(cnnActivations[0], 1, layer.outputSize);
+        bool match = activations.cols == layer.inputSize;
+        if (layer.type == CNN_CONV) {
+            match = match && convShapesMatch(layer.conv, viewOf(layer.weights, layer.conv.outChannels, layer.conv.patchSize()),
+                viewOf(layer.biases, 1, layer.conv.outChannels), activations, output);
+        } else if (layer.type == CNN_POOL) {
+            match = match && poolShapesMatch(layer.pool, activations, output);
+        } else if (layer.type == CNN_FLATTEN) {
+            match = match && flatten(activations, layer.channels, layer.height, layer.width).data != NULL;
+        } else {
+            match = match && layerShapesMatch(viewOf(layer.weights, layer.outputSize, layer.inputSize),
+                viewOf(layer.biases, 1, layer.outputSize), activations, output, cnnTileSize(layer));
+        }
+        if (!match) {
+            std::cerr << "CnnNet layer " << layer.name << " does not fit the layer before it" << std::endl;
+            return false;
+        }
+        activations = output;
     }
 
+    printf("loaded CNN parameters\n");
+    return true;
 }
 
+// Runs one image through cnnLayers and returns the label, scores gets the log-probabilities
+static int runCnnLayers(const unsigned char* pixels, float* scores) {
+    int current = 0;
+    TensorView input = viewOf(cnnActivations[current], 1, inputSize);
+    {
+        ScopedStageTimer timer(STAGE_PREPROCESS);
+        TraceSpan span("normalization", "preprocess", frameId);
+        normalizeImage(pixels, input);
+    }
 
-std::vector<float> loadWeights(int weightsStartIndex,int numNeurons,int inputTileSize,int inputSize,
-    std::vector<float>& weights,std::vector<float>& temp_wts){
-    
-    int index = 0;
-    for(int i=0;i<numNeurons;i++){
-        for(int j=0;j<inputTileSize;j++){
-            temp_wts[index] = weights[(i)*inputSize + j+weightsStartIndex];
-            //printf("index:%d\n",index);
-            index++;
+    ConstTensorView activations = input;
+    for (size_t l = 0; l < cnnLayers.size(); ++l) {
+        const CnnLayer& layer = cnnLayers[l];
+        if (layer.type == CNN_FLATTEN) {
+            activations = flatten(activations, layer.channels, layer.height, layer.width);
+            continue;
         }
+
+        TraceSpan span(layer.name.c_str(), "layer", frameId);
+        TensorView output = viewOf(cnnActivations[1 - current], 1, layer.outputSize);
+        DataflowTraffic traffic;
+        if (layer.type == CNN_CONV) {
+            conv2d_CPU(layer.algorithm, layer.conv, viewOf(layer.weights, layer.conv.outChannels, layer.conv.patchSize()),
+                viewOf(layer.biases, 1, layer.conv.outChannels), activations, output, traffic, cnnScratch);
+            HOT_PRINTF("%s %s traffic: weights:%llu inputs:%llu psums:%llu bytes\n", layer.name.c_str(),
+                convAlgorithmName(layer.algorithm), (unsigned long long)traffic.weightBytes,
+                (unsigned long long)traffic.inputBytes, (unsigned long long)traffic.psumBytes);
+        } else if (layer.type == CNN_POOL) {
+            pool2d_CPU(layer.algorithm, layer.poolType, layer.pool, activations, output, cnnScratch);
+        } else {
+            Dataflow ran = denseLayer_CPU(cpuDataflow, viewOf(layer.weights, layer.outputSize, layer.inputSize),
+                viewOf(layer.biases, 1, layer.outputSize), activations, output, cnnTileSize(layer), traffic, cnnScratch);
+            HOT_PRINTF("%s %s traffic: weights:%llu inputs:%llu psums:%llu bytes\n", layer.name.c_str(),
+                dataflowName(ran), (unsigned long long)traffic.weightBytes,
+                (unsigned long long)traffic.inputBytes, (unsigned long long)traffic.psumBytes);
+        }
+        if (layer.relu) {
+            relu(output);
+        }
+        activations = output;
+        current = 1 - current;
     }
-    return temp_wts;    
+
+    ScopedStageTimer timer(STAGE_POSTPROCESS);
+    TensorView logits = viewOf(cnnActivations[current], 1, activations.cols);
+    log_softmax(logits);
+    std::copy(logits.data, logits.data + logits.cols, scores);
+    return getMaxIn(logits, 0);
 }
 
-#if FPGA == 0
-void processTiles_weightStatinary_CPU(
-    int numNeurons,
-    int inputSize, // Size of the input array
-    int inputTileSize,  // Tile size of the Input vector          
-    std::vector<float>& weights, // Weights array
-    std::vector<float>& biases,  // biases array
-    std::vector<float>& inputs,  // inputs array 
-    std::vector<float>& outputs  // outputs array
-    ) {
+// The loaded image through CnnNet, printed like run_cpu prints the fully connected model
+int run_cnn() {
+    HOT_PRINTF("started running CNN on CPU\n");
 
-    printf("in the weight stationary function of CPU\n");    
+    float scores[MNIST_NUM_CLASSES];
+    int label = runCnnLayers(image_pixels.data(), scores);
 
-    int numTiles = inputSize / inputTileSize; // Ensure this division is an integer
-    int totalWeights = inputSize * numNeurons;
-    int weightsPerTile = numNeurons*inputTileSize; // Assuming an even distribution of neurons per tile
+    TraceSpan span("result", "postprocess", frameId);
+    printOutputs("Output of fc (after LogSoftmax): ", scores, MNIST_NUM_CLASSES);
+    HOT_PRINTF("Predicted label:%d\n", label);
+    return label;
+}
 
 
+// The fully connected model for -detect, fp32 weights from the .bin files or the build
+bool loadDetector() {
+    FloatBuffer fc1Weights, fc1Biases, fc2Weights, fc2Biases;
+    #ifdef MNIST_EMBEDDED_MODEL
+    if (useEmbeddedWeights) {
+        fc1Weights.assign(embedded_model::fc1_weight, embedded_model::fc1_weight + embedded_model::fc1Outputs * embedded_model::fc1Inputs);
+        fc1Biases.assign(embedded_model::fc1_bias, embedded_model::fc1_bias + embedded_model::fc1Outputs);
+        fc2Weights.assign(embedded_model::fc2_weight, embedded_model::fc2_weight + embedded_model::fc2Outputs * embedded_model::fc2Inputs);
+        fc2Biases.assign(embedded_model::fc2_bias, embedded_model::fc2_bias + embedded_model::fc2Outputs);
+    } else
+    #endif
+    if (weightFormatFromPath(layer1_weightsPath) != WEIGHTS_FP32 || weightFormatFromPath(output_weightsPath) != WEIGHTS_FP32 ||
+        !loadModelParameters(layer1_weightsPath, layer1_biasesPath, fc1Weights, fc1Biases) ||
+        !loadModelParameters(output_weightsPath, output_biasesPath, fc2Weights, fc2Biases)) {
+        std::cerr << "Detection needs the fp32 .bin weights of fc1 and fc2" << std::endl;
+        metrics().failures++;
+        return false;
+    }
 
-    for (int tileIndex = 0; tileIndex < numTiles; ++tileIndex) {
-        
-        int weightsStartIndex = tileIndex * inputTileSize; 
-        std::vector<float> temp_wts;
-        temp_wts.resize(numNeurons * inputTileSize);
-        loadWeights(weightsStartIndex,numNeurons,inputTileSize,inputSize,weights,temp_wts);
-
-        std::vector<float> inputSlice(std::next(inputs.begin(), weightsStartIndex), std::next(inputs.begin(), weightsStartIndex+inputTileSize));
-
-        matrixMulCPU(
-            inputSlice,  // Tile of the Input vector
-            temp_wts, // Tile of the Weights matrix
-            inputTileSize,                  // Size of the input tile
-            numNeurons,         // Size of the output tile (number of neurons in this tile)
-            outputs
-        );
+    int hidden = (int)fc1Biases.size();
+    int classes = (int)fc2Biases.size();
+    if (fc1Weights.size() != (size_t)hidden * inputSize || fc2Weights.size() != (size_t)classes * hidden ||
+        !detector.load(viewOf(fc1Weights, hidden, inputSize), viewOf(fc1Biases, 1, hidden),
+                       viewOf(fc2Weights, classes, hidden), viewOf(fc2Biases, 1, classes))) {
+        std::cerr << "The weight files do not describe a 784 -> N -> classes network" << std::endl;
+        metrics().failures++;
+        return false;
+    }
+    printf("loaded model parameters\n");
+    return true;
+}
+
+// Reads the -detect frame, rows top to bottom, inverted with -detect_invert
+static bool loadDetectFrame(std::vector<unsigned char>& frame, int& width, int& height) {
+    ScopedStageTimer timer(STAGE_LOAD);
+    TraceSpan span("bmp_read", "io", frameId);
+    unsigned char* pixels = loadBMPGrayFrame(detectFramePath.c_str(), &width, &height);
+    if (!pixels || width < windowPixels || height < windowPixels) {
+        std::cerr << "Failed to load a frame of at least 28x28 from " << detectFramePath << std::endl;
+        delete[] pixels;
+        metrics().failures++;
+        return false;
+    }
+    frame.assign(pixels, pixels + width * height);
+    delete[] pixels;
+    if (detectInvert) {
+        for (size_t i = 0; i < frame.size(); ++i) {
+            frame[i] = 255 - frame[i];
+        }
     }
+    return true;
+}
 
-    for(int i=0;i<numNeurons;i++){
-        outputs[i] += biases[i];
-    } 
+// Prints every digit found in the -detect frame, one CSV row per box after suppression
+int run_detect() {
+    std::vector<unsigned char> frame;
+    int width = 0, height = 0;
+    if (!loadDetectFrame(frame, width, height)) {
+        return -1;
+    }
 
+    std::vector<Detection> detections;
+    double start = getCurrentTimestamp();
+    {
+        TraceSpan span("detect", "layer", frameId);
+        detector.detect(frame.data(), width, height, detections);
+    }
+    double seconds = getCurrentTimestamp() - start;
+
+    printf("frame:%dx%d windows:%ld detections:%d time:%.2f ms\n", width, height,
+        detector.windowsEvaluated(), (int)detections.size(), seconds * 1e3);
+    printf("x,y,size,label,score\n");
+    for (size_t i = 0; i < detections.size(); ++i) {
+        const Detection& d = detections[i];
+        printf("%d,%d,%d,%d,%.4f\n", d.x, d.y, d.size, d.label, d.score);
+    }
+    return (int)detections.size();
 }
 
-void run_cpu() {
-    
+// Time per frame of the window scoring with fc1 as one correlation per scale, on both
+// conv kernels, against one processTiles_weightStatinary_CPU call per window. The
+// candidates of all three must agree; the difference counts the ones that do not.
+void run_detect_report() {
+    std::vector<unsigned char> frame;
+    int width = 0, height = 0;
+    if (!loadDetectFrame(frame, width, height)) {
+        return;
+    }
 
-    // hidden 
-    const unsigned hiddenLayerIndex = 0;
-    const unsigned outputLayerIndex = 1;
+    struct Method {
+        const char* name;
+        ConvAlgorithm algorithm;
+        bool perWindow;
+    };
+    const Method methods[] = {
+        {"per_window", CONV_DIRECT, true},
+        {"correlation_im2col", CONV_IM2COL, false},
+        {"correlation_direct", CONV_DIRECT, false},
+    };
+
+    printf("method,windows,candidates,detections,us_per_frame,speedup,mismatched_candidates\n");
+    std::vector<Detection> reference;
+    double referenceSeconds = 0.0;
+    for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m) {
+        detector.algorithm = methods[m].algorithm;
+        std::vector<Detection> candidates;
+        int iterations = iterationsGiven ? numIterations : 10;
+        double start = getCurrentTimestamp();
+        for (int i = 0; i < iterations; ++i) {
+            detector.scoreWindows(frame.data(), width, height, methods[m].perWindow, candidates);
+        }
+        double seconds = (getCurrentTimestamp() - start) / iterations;
 
-    size_t hidden_weights_offset = 0; // Starting at the beginning for the hidden layer
-    size_t output_weights_offset = 784 * 10; // Adjust based on your buffer organization
-    size_t hidden_biases_offset = 0;
-    size_t output_biases_offset = 10; // Assuming biases are also concatenated
+        if (m == 0) {
+            reference = candidates;
+            referenceSeconds = seconds;
+        }
+        // A window near minScore may land on the other side of it, count those too
+        int mismatched = std::abs((int)candidates.size() - (int)reference.size());
+        for (size_t i = 0; i < std::min(candidates.size(), reference.size()); ++i) {
+            const Detection& a = candidates[i];
+            const Detection& b = reference[i];
+            mismatched += a.x != b.x || a.y != b.y || a.size != b.size || a.label != b.label;
+        }
 
-    size_t hidden_work_size = {10};
-    size_t output_work_size = {10};
+        std::vector<Detection> detections = candidates;
+        DigitDetector::suppressOverlaps(detections, detector.maxOverlap);
+        printf("%s,%ld,%d,%d,%.1f,%.2f,%d\n", methods[m].name, detector.windowsEvaluated(), (int)candidates.size(),
+            (int)detections.size(), seconds * 1e6, referenceSeconds / seconds, mismatched);
+    }
+}
 
 
-    printf("started running on CPU\n");
+// Serves until SIGINT / SIGTERM, the model is loaded once for every request
+// With -watch_model new weights are loaded in the background and swapped in between
+// inferences, the weights in use are never changed or freed under a running inference
+void startModelWatch(ModelReloader& reloader) {
+    if (!watchModel) {
+        return;
+    }
+    if (useEmbeddedWeights) {
+        std::cerr << "The embedded weights have no files to watch, run with -weights=file" << std::endl;
+        return;
+    }
+    std::vector<std::string> paths;
+    paths.push_back(layer1_weightsPath);
+    paths.push_back(layer1_biasesPath);
+    paths.push_back(output_weightsPath);
+    paths.push_back(output_biasesPath);
+    reloader.watch(paths, loadCpuModel, watchIntervalMs);
+    printf("watching the model files every %d ms\n", watchIntervalMs);
+}
 
-    hidden_layer1_out.resize(numNeurons * inputTileSize);
-    processTiles_weightStatinary_CPU(hidden_work_size,
-    inputSize, // Size of the input array
-    inputTileSize,  // Tile size of the Input vector          
-    hidden_layer1_weights, // Weights array
-    hidden_layer1_biases,  // biases array
-    image_data,  // inputs array 
-    hidden_layer1_out  // outputs array);
-    );
 
-    //printf("done first layer: %d\n",hidden_layer1_out.size());
+int run_server() {
+    ModelReloader reloader(cpuModel);
+    startModelWatch(reloader);
+
+    InferenceServer server(reloader, (mnist_dataflow)cpuDataflow, serverMaxBatch, serverWindowUs);
+    if (!server.start(serverSocketPath)) {
+        return -1;
+    }
+    printf("serving on %s, max batch %d, window %d us\n", serverSocketPath.c_str(), serverMaxBatch, serverWindowUs);
+    bool served = server.run();
+    server.stop();
+    reloader.stop();
+    printf("server stopped after %llu requests, %llu model reloads\n",
+        (unsigned long long)metrics().requests.count.load(), (unsigned long long)metrics().modelReloads.load());
+    return served ? 0 : -1;
+}
 
-    std::cout << "Output of fc1 (before ReLU): ";
 
-    for(int i=0;i<10;i++){
-        std::cout << hidden_layer1_out[i] << " ";
+// Sends the loaded image numIterations times over one connection
+int run_client() {
+    int fd = inferenceClientConnect(clientSocketPath);
+    if (fd < 0) {
+        std::cerr << "Could not connect to " << clientSocketPath << std::endl;
+        return -1;
     }
-    std::cout << std::endl;
 
-    relu(hidden_layer1_out);
+    InferenceResponse response;
+    response.label = -1;
+    double start = getCurrentTimestamp();
+    for (int i = 0; i < numIterations; ++i) {
+        if (!inferenceClientClassify(fd, image_pixels.data(), response) || response.status != MNIST_OK) {
+            std::cerr << "Request " << i << " failed" << std::endl;
+            close(fd);
+            return -1;
+        }
+    }
+    double elapsed = getCurrentTimestamp() - start;
+    close(fd);
+
+    HOT_PRINTF("requests:%d seconds:%f requests_per_second:%f\n", numIterations, elapsed, numIterations / elapsed);
+    printf("Predicted label:%d\n", response.label);
+    return response.label;
+}
+
 
-    std::cout << "Output of fc1 (after ReLU): ";
+// The first inference may size buffers, every later one must not allocate
+int run_allocation_check() {
+    run_cpu();
 
-    for(int i=0;i<10;i++){
-        std::cout << hidden_layer1_out[i] << " ";
+    unsigned long long before = heapAllocations().load();
+    for (int i = 0; i < numIterations; ++i) {
+        frameId = i + 1;
+        run_cpu();
     }
-    std::cout << std::endl;
+    unsigned long long allocations = heapAllocations().load() - before;
+
+    printf("heap allocations after warm up: %llu in %d inferences\n", allocations, numIterations);
+    return allocations == 0 ? 0 : 1;
+}
 
-    output_layer_out.resize(numNeurons * inputTileSize);
 
-    processTiles_weightStatinary_CPU(output_work_size,
-    output_work_size, // Size of the input array
-    10,  // Tile size of the Input vector          
-    output_layer_weights, // Weights array
-    output_layer_biases,  // biases array
-    hidden_layer1_out,  // inputs array 
-    output_layer_out  // outputs array);
-    );
+// Runs the test image with the weights stored in each format. The error is the largest
+// log-probability difference to fp32, the weight bytes are those one inference streams.
+// The binary and ternary rows quantize fc1 after training, fc2 stays fp32 (its inputs
+// are never negative), their accuracy over the test set is reported by bitpack_weights.py --report.
+void run_precision_report() {
+    struct Config {
+        const char* name;
+        mnist_weight_format fc1;
+        mnist_weight_format fc2;
+    };
+    const Config configs[] = {
+        {"fp32", MNIST_WEIGHTS_FP32, MNIST_WEIGHTS_FP32},
+        {"fp16", MNIST_WEIGHTS_FP16, MNIST_WEIGHTS_FP16},
+        {"bf16", MNIST_WEIGHTS_BF16, MNIST_WEIGHTS_BF16},
+        {"ternary_fc1", MNIST_WEIGHTS_TERNARY, MNIST_WEIGHTS_FP32},
+        {"binary_fc1", MNIST_WEIGHTS_BINARY, MNIST_WEIGHTS_FP32},
+    };
+    const int iterations = iterationsGiven ? numIterations : 2000;
+    float reference[MNIST_NUM_CLASSES];
+
+    // fp16 and bf16 only save time over fp32 when converted in hardware, see halfConvertsInHardware
+    printf("format,label,max_logprob_error,weight_bytes,us_per_inference,half_conversion\n");
+
+    for (size_t f = 0; f < sizeof(configs) / sizeof(configs[0]); ++f) {
+        mnist_model* model = NULL;
+        mnist_context* context = NULL;
+        if (mnist_model_load(layer1_weightsPath.c_str(), layer1_biasesPath.c_str(),
+                             output_weightsPath.c_str(), output_biasesPath.c_str(), &model) != MNIST_OK ||
+            mnist_model_convert_layer(model, 0, configs[f].fc1) != MNIST_OK ||
+            mnist_model_convert_layer(model, 1, configs[f].fc2) != MNIST_OK ||
+            mnist_context_create(model, &context) != MNIST_OK) {
+            std::cerr << "Could not set up the " << configs[f].name << " model" << std::endl;
+            mnist_model_free(model);
+            return;
+        }
+
+        int Label = -1;
+        float scores[MNIST_NUM_CLASSES];
+        double start = getCurrentTimestamp();
+        for (int i = 0; i < iterations; ++i) {
+            mnist_infer_u8(context, image_pixels.data(), &Label, scores);
+        }
+        double seconds = (getCurrentTimestamp() - start) / iterations;
 
+        if (f == 0) {
+            std::copy(scores, scores + MNIST_NUM_CLASSES, reference);
+        }
+        float maxError = 0.0f;
+        for (int c = 0; c < MNIST_NUM_CLASSES; ++c) {
+            maxError = std::max(maxError, std::fabs(scores[c] - reference[c]));
+        }
+
+        uint64_t weightBytes = 0;
+        for (int layer = 0; layer < MNIST_NUM_LAYERS; ++layer) {
+            uint64_t bytes = 0;
+            mnist_context_get_traffic(context, layer, NULL, &bytes, NULL, NULL);
+            weightBytes += bytes;
+        }
+
+        const char* conversion = "none";
+        if (configs[f].fc1 == MNIST_WEIGHTS_FP16 || configs[f].fc1 == MNIST_WEIGHTS_BF16) {
+            conversion = halfConvertsInHardware(configs[f].fc1 == MNIST_WEIGHTS_FP16 ? WEIGHTS_FP16 : WEIGHTS_BF16)
+                ? "hardware" : "software";
+        }
+        printf("%s,%d,%g,%llu,%.3f,%s\n", configs[f].name, Label, maxError, (unsigned long long)weightBytes,
+            seconds * 1e6, conversion);
 
-    std::cout << "Output of fc2 (before LogSoftmax): "; 
-    for(int i=0;i<10;i++){
-        std::cout << output_layer_out[i] << " ";
+        mnist_context_free(context);
+        mnist_model_free(model);
     }
-    std::cout << std::endl;
+}
 
-    log_softmax(output_layer_out);
 
+// fc1 factorized at ranks 1, 2, 4, ... up to full rank, against the dense model in
+// the first row. Multiply-adds count both layers, the accuracy over the MNIST test
+// set comes from lowrank_weights.py --report.
+void run_low_rank_report() {
+    const int iterations = iterationsGiven ? numIterations : 2000;
+    const int hiddenSize = (int)loadFloatsFromFile(layer1_biasesPath).size();
+    const int fullRank = std::min(hiddenSize, MNIST_IMAGE_SIZE);
 
-    std::cout << "Output of fc2 (after LogSoftmax): "; 
-    for(int i=0;i<10;i++){
-        std::cout << output_layer_out[i] << " ";
+    std::vector<int> ranks(1, 0); // 0 is the dense fc1
+    for (int rank = 1; rank < fullRank; rank *= 2) {
+        ranks.push_back(rank);
     }
-    std::cout << std::endl;
+    ranks.push_back(fullRank);
+
+    float reference[MNIST_NUM_CLASSES];
+    printf("rank,label,max_logprob_error,weight_bytes,macs,us_per_inference\n");
+
+    for (size_t i = 0; i < ranks.size(); ++i) {
+        int rank = ranks[i];
+        mnist_model* model = NULL;
+        mnist_context* context = NULL;
+        if (mnist_model_load(layer1_weightsPath.c_str(), layer1_biasesPath.c_str(),
+                             output_weightsPath.c_str(), output_biasesPath.c_str(), &model) != MNIST_OK ||
+            (rank > 0 && mnist_model_factorize_layer(model, 0, rank) != MNIST_OK) ||
+            mnist_context_create(model, &context) != MNIST_OK) {
+            std::cerr << "Could not set up the rank " << rank << " model" << std::endl;
+            mnist_model_free(model);
+            return;
+        }
 
-    int Label = getMaxIn(output_layer_out);
-    printf("Predicted label:%d\n",Label);
+        int Label = -1;
+        float scores[MNIST_NUM_CLASSES];
+        double start = getCurrentTimestamp();
+        for (int n = 0; n < iterations; ++n) {
+            mnist_infer_u8(context, image_pixels.data(), &Label, scores);
+        }
+        double seconds = (getCurrentTimestamp() - start) / iterations;
+
+        if (rank == 0) {
+            std::copy(scores, scores + MNIST_NUM_CLASSES, reference);
+        }
+        float maxError = 0.0f;
+        for (int c = 0; c < MNIST_NUM_CLASSES; ++c) {
+            maxError = std::max(maxError, std::fabs(scores[c] - reference[c]));
+        }
+
+        uint64_t weightBytes = 0;
+        for (int layer = 0; layer < MNIST_NUM_LAYERS; ++layer) {
+            uint64_t bytes = 0;
+            mnist_context_get_traffic(context, layer, NULL, &bytes, NULL, NULL);
+            weightBytes += bytes;
+        }
+        long long fc1Macs = rank > 0 ? (long long)rank * (hiddenSize + MNIST_IMAGE_SIZE)
+                                     : (long long)hiddenSize * MNIST_IMAGE_SIZE;
+        long long macs = fc1Macs + (long long)MNIST_NUM_CLASSES * hiddenSize;
+
+        char name[16];
+        snprintf(name, sizeof(name), rank > 0 ? "%d" : "dense", rank);
+        printf("%s,%d,%g,%llu,%lld,%.3f\n", name, Label, maxError, (unsigned long long)weightBytes, macs, seconds * 1e6);
+
+        mnist_context_free(context);
+        mnist_model_free(model);
+    }
+}
+
+
+// GFLOP/s of the batched layers with processTiles_batch_CPU, the schedule batches used
+// before, with the -dataflow schedule run image by image and with gemmLayer_CPU, against
+// the peak of one core measured with the same multiply-adds on registers only. fc1 and
+// fc2 have the shapes of the loaded model, wide is a 256 neuron hidden layer, the shape a
+// wider network would give fc1. speedup is the GEMM over the image by image schedule.
+// The crossover is the smallest batch from which the GEMM beats that schedule at every
+// larger batch measured, printed next to the gemmMinBatch denseLayer_CPU switches at.
+void run_gemm_report() {
+    const int batches[] = {2, 3, 4, 6, 8, 32, 128};
+    const int numBatches = sizeof(batches) / sizeof(batches[0]);
+    const int hiddenSize = (int)loadFloatsFromFile(layer1_biasesPath).size();
+    struct Shape {
+        const char* name;
+        int neurons;
+        int inputs;
+        int tile;
+    };
+    const Shape shapes[] = {
+        {"fc1", hiddenSize, inputSize, inputTileSize},
+        {"fc2", numNeurons, hiddenSize, hiddenSize},
+        {"wide", 256, inputSize, inputTileSize},
+    };
+
+    long peakIterations = 20000000;
+    double start = getCurrentTimestamp();
+    double flops = peakFlopLoop(peakIterations);
+    double peakGflops = flops / (getCurrentTimestamp() - start) / 1e9;
+
+    GemmBlocking blocking = gemmBlocking();
+    printf("peak_gflops_per_core,%.2f\n", peakGflops);
+    printf("blocking,mr=%d,nr=%d,mc=%d,kc=%d,nc=%d\n", blocking.mr, blocking.nr, blocking.mc, blocking.kc, blocking.nc);
+    printf("layer,neurons,inputs,batch,tiled_gflops,per_image_gflops,gemm_gflops,speedup,fraction_of_peak,dense_kernel\n");
+
+    const int numShapes = sizeof(shapes) / sizeof(shapes[0]);
+    int crossover[numShapes];
+    for (int s = 0; s < numShapes; ++s) {
+        const Shape& shape = shapes[s];
+        crossover[s] = 0;
+        for (int b = 0; b < numBatches; ++b) {
+            int batch = batches[b];
+            FloatBuffer weights((size_t)shape.neurons * shape.inputs), biases(shape.neurons);
+            FloatBuffer inputs((size_t)batch * shape.inputs), outputs((size_t)batch * shape.neurons);
+            for (size_t i = 0; i < weights.size(); ++i) {
+                weights[i] = (float)((i * 7919) % 1000) / 1000.0f - 0.5f;
+            }
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                inputs[i] = (float)((i * 31) % 100) / 50.0f - 1.0f;
+            }
+
+            ScratchArena arena;
+            arena.reserve(std::max(layerScratchFloats(shape.neurons, shape.tile), gemmScratchFloats(shape.neurons, shape.inputs)));
+            DataflowTraffic traffic;
+            double layerFlops = 2.0 * shape.neurons * shape.inputs * batch;
+            int iterations = iterationsGiven ? numIterations : std::max(10, (int)(2e8 / layerFlops));
+
+            start = getCurrentTimestamp();
+            for (int i = 0; i < iterations; ++i) {
+                processTiles_batch_CPU(shape.neurons, shape.inputs, shape.tile, batch, weights.data(), biases.data(),
+                    inputs.data(), outputs.data(), traffic, arena);
+            }
+            double tiledSeconds = (getCurrentTimestamp() - start) / iterations;
+
+            start = getCurrentTimestamp();
+            for (int i = 0; i < iterations; ++i) {
+                for (int r = 0; r < batch; ++r) {
+                    float* row = outputs.data() + (size_t)r * shape.neurons;
+                    std::fill(row, row + shape.neurons, 0.0f);
+                    processTiles_CPU(cpuDataflow, shape.neurons, shape.inputs, shape.tile, weights.data(), biases.data(),
+                        inputs.data() + (size_t)r * shape.inputs, row, traffic, arena);
+                }
+            }
+            double perImageSeconds = (getCurrentTimestamp() - start) / iterations;
+
+            start = getCurrentTimestamp();
+            for (int i = 0; i < iterations; ++i) {
+                gemmLayer_CPU(shape.neurons, shape.inputs, batch, weights.data(), biases.data(),
+                    inputs.data(), outputs.data(), traffic, arena);
+            }
+            double gemmSeconds = (getCurrentTimestamp() - start) / iterations;
+
+            if (gemmSeconds >= perImageSeconds) {
+                crossover[s] = 0;
+            } else if (crossover[s] == 0) {
+                crossover[s] = batch;
+            }
+            bool gemm = batch >= gemmMinBatch(cpuDataflow, shape.neurons, shape.inputs, shape.tile);
+            double gemmGflops = layerFlops / gemmSeconds / 1e9;
+            printf("%s,%d,%d,%d,%.2f,%.2f,%.2f,%.2f,%.3f,%s\n", shape.name, shape.neurons, shape.inputs, batch,
+                layerFlops / tiledSeconds / 1e9, layerFlops / perImageSeconds / 1e9, gemmGflops,
+                perImageSeconds / gemmSeconds, gemmGflops / peakGflops, gemm ? "gemm" : "per_image");
+        }
+    }
+
+    // 0 when the GEMM does not win at the largest batch measured
+    printf("layer,gemm_crossover_batch,gemm_min_batch\n");
+    for (int s = 0; s < numShapes; ++s) {
+        printf("%s,%d,%d\n", shapes[s].name, crossover[s],
+            gemmMinBatch(cpuDataflow, shapes[s].neurons, shapes[s].inputs, shapes[s].tile));
+    }
+}
 
+
+// One layer in every form the roofline report runs it in
+struct RooflineLayer {
+    const char* name;
+    int neurons;
+    int inputs;
+    int tile;
+    FloatBuffer weights;
+    FloatBuffer biases;
+    HalfBuffer fp16;
+    HalfBuffer bf16;
+    BitMatrix ternary;
+    PixelLayer folded; // fc1 only
+};
+
+// Kernels of one layer, matrixMulCPU under the three schedules and its successors
+enum RooflineKernel {
+    ROOF_WEIGHT_STATIONARY,
+    ROOF_OUTPUT_STATIONARY,
+    ROOF_INPUT_STATIONARY,
+    ROOF_FP16,
+    ROOF_BF16,
+    ROOF_TERNARY,
+    ROOF_FOLDED_INPUT,
+    ROOF_GEMM,
+    ROOF_KERNELS
+};
+
+static const char* rooflineKernelName(int kernel) {
+    static const char* names[ROOF_KERNELS] = {"ws", "os", "is", "fp16", "bf16", "ternary", "folded", "gemm"};
+    return names[kernel];
+}
+
+// Runs one kernel once, traffic is left at the bytes it moved
+static void runRooflineKernel(int kernel, RooflineLayer& layer, int batch, ConstTensorView input,
+                              TensorView output, DataflowTraffic& traffic, ScratchArena& arena) {
+    ConstTensorView weights = viewOf(layer.weights, layer.neurons, layer.inputs);
+    ConstTensorView biases = viewOf(layer.biases, 1, layer.neurons);
+    traffic = DataflowTraffic();
+    switch (kernel) {
+    case ROOF_WEIGHT_STATIONARY:
+    case ROOF_OUTPUT_STATIONARY:
+    case ROOF_INPUT_STATIONARY: {
+        const Dataflow schedules[] = {WEIGHT_STATIONARY, OUTPUT_STATIONARY, INPUT_STATIONARY};
+        std::fill(output.data, output.data + output.cols, 0.0f);
+        processTiles_CPU(schedules[kernel], layer.neurons, layer.inputs, layer.tile, weights.data, biases.data,
+            input.data, output.data, traffic, arena);
+        break;
+    }
+    case ROOF_FP16:
+    case ROOF_BF16:
+        halfLayer_CPU(kernel == ROOF_FP16 ? WEIGHTS_FP16 : WEIGHTS_BF16,
+            ConstHalfView(kernel == ROOF_FP16 ? layer.fp16.data() : layer.bf16.data(), layer.neurons, layer.inputs),
+            biases, input, output, traffic);
+        break;
+    case ROOF_TERNARY:
+        bitLayer_CPU(layer.ternary, biases, input, output, traffic, arena);
+        break;
+    case ROOF_FOLDED_INPUT:
+        pixelLayer_CPU(layer.folded, image_pixels.data(), output, traffic);
+        break;
+    default:
+        gemmLayer_CPU(layer.neurons, layer.inputs, batch, weights.data, biases.data, input.data, output.data,
+            traffic, arena);
+        break;
+    }
+}
+
+
+// Where every layer kernel sits under the roofline of this host. The roofs are measured:
+// the multiply-add peak of one core with peakFlopLoop, and the read bandwidth of memory
+// (a 64 MB buffer) and of the cache (128 KB, inside L2 on our hosts) with bandwidthLoop.
+// Arithmetic intensity is the flops of a kernel over the bytes its traffic counters
+// report, its roof is min(peak, intensity x bandwidth) of the level its bytes fit in.
+// Below the ridge point, peak / bandwidth, a kernel is memory bound and only moving
+// fewer bytes speeds it up; above it only doing the flops faster does. The ternary
+// kernel is counted with the multiply-adds it stands in for. wide is a 256 neuron
+// hidden layer, the size where the weights leave L2.
+void run_roofline_report() {
+    const size_t memoryFloats = 16 << 20, cacheFloats = 32 << 10;
+    FloatBuffer stream(memoryFloats, 1.0f);
+
+    double start = getCurrentTimestamp();
+    double flops = peakFlopLoop(20000000);
+    double peakGflops = flops / (getCurrentTimestamp() - start) / 1e9;
+    bandwidthLoop(stream.data(), memoryFloats, 1); // faults the pages in
+    start = getCurrentTimestamp();
+    double bytes = bandwidthLoop(stream.data(), memoryFloats, 8);
+    double memoryGBs = bytes / (getCurrentTimestamp() - start) / 1e9;
+    start = getCurrentTimestamp();
+    bytes = bandwidthLoop(stream.data(), cacheFloats, 4000);
+    double cacheGBs = bytes / (getCurrentTimestamp() - start) / 1e9;
+
+    printf("peak_gflops_per_core,%.2f\n", peakGflops);
+    printf("memory_gb_per_s,%.2f,ridge_flops_per_byte,%.2f\n", memoryGBs, peakGflops / memoryGBs);
+    printf("cache_gb_per_s,%.2f,ridge_flops_per_byte,%.2f\n", cacheGBs, peakGflops / cacheGBs);
+
+    RooflineLayer layers[3];
+    if (!loadModelParameters(layer1_weightsPath, layer1_biasesPath, layers[0].weights, layers[0].biases) ||
+        !loadModelParameters(output_weightsPath, output_biasesPath, layers[1].weights, layers[1].biases)) {
+        std::cerr << "Failed to load the model files for the report" << std::endl;
+        return;
+    }
+    int hiddenSize = (int)layers[0].biases.size();
+    layers[0].name = "fc1";
+    layers[0].neurons = hiddenSize;
+    layers[0].inputs = inputSize;
+    layers[0].tile = inputTileSize;
+    layers[1].name = "fc2";
+    layers[1].neurons = numNeurons;
+    layers[1].inputs = hiddenSize;
+    layers[1].tile = hiddenSize;
+    layers[2].name = "wide";
+    layers[2].neurons = 256;
+    layers[2].inputs = inputSize;
+    layers[2].tile = inputTileSize;
+    layers[2].weights.resize((size_t)256 * inputSize);
+    layers[2].biases.assign(256, 0.0f);
+    for (size_t i = 0; i < layers[2].weights.size(); ++i) {
+        layers[2].weights[i] = layers[0].weights[i % layers[0].weights.size()];
+    }
+    foldInputNormalization(viewOf(layers[0].weights, hiddenSize, inputSize), viewOf(layers[0].biases, 1, hiddenSize),
+        layers[0].folded);
+
+    const int gemmBatch = 64;
+    printf("layer,kernel,batch,flops,bytes,intensity,gflops,roof_level,roof_gflops,fraction_of_roof,bound\n");
+
+    for (int l = 0; l < 3; ++l) {
+        RooflineLayer& layer = layers[l];
+        layer.fp16.resize(layer.weights.size());
+        layer.bf16.resize(layer.weights.size());
+        convertWeights(layer.weights.data(), layer.weights.size(), WEIGHTS_FP16, layer.fp16.data());
+        convertWeights(layer.weights.data(), layer.weights.size(), WEIGHTS_BF16, layer.bf16.data());
+        quantizeToBits(viewOf(layer.weights, layer.neurons, layer.inputs), true, layer.ternary);
+
+        // Inputs in [-1, 1), the same row repeated for the batch
+        FloatBuffer input((size_t)gemmBatch * layer.inputs), output((size_t)gemmBatch * layer.neurons);
+        for (size_t i = 0; i < input.size(); ++i) {
+            input[i] = (float)((i % layer.inputs) * 31 % 100) / 50.0f - 1.0f;
+        }
+        ScratchArena arena;
+        arena.reserve(std::max(std::max(layerScratchFloats(layer.neurons, layer.tile),
+                                        gemmScratchFloats(layer.neurons, layer.inputs)),
+                               bitLayerScratchFloats(layer.inputs)));
+
+        for (int kernel = 0; kernel < ROOF_KERNELS; ++kernel) {
+            if (kernel == ROOF_FOLDED_INPUT && layer.folded.rows == 0) {
+                continue;
+            }
+            int batch = kernel == ROOF_GEMM ? gemmBatch : 1;
+            ConstTensorView in = viewOf(input, batch, layer.inputs);
+            TensorView out = viewOf(output, batch, layer.neurons);
+            double layerFlops = 2.0 * layer.neurons * layer.inputs * batch;
+            int iterations = iterationsGiven ? numIterations : std::max(20, (int)(1e8 / layerFlops));
+
+            DataflowTraffic traffic;
+            runRooflineKernel(kernel, layer, batch, in, out, traffic, arena); // warm up
+            start = getCurrentTimestamp();
+            for (int i = 0; i < iterations; ++i) {
+                runRooflineKernel(kernel, layer, batch, in, out, traffic, arena);
+            }
+            double seconds = (getCurrentTimestamp() - start) / iterations;
+
+            double moved = (double)(traffic.weightBytes + traffic.inputBytes + traffic.psumBytes);
+            double intensity = layerFlops / moved;
+            bool inCache = moved <= cacheFloats * sizeof(float);
+            double roof = std::min(peakGflops, intensity * (inCache ? cacheGBs : memoryGBs));
+            double gflops = layerFlops / seconds / 1e9;
+            bool memoryBound = intensity * (inCache ? cacheGBs : memoryGBs) < peakGflops;
+
+            printf("%s,%s,%d,%.0f,%.0f,%.3f,%.2f,%s,%.2f,%.3f,%s\n", layer.name, rooflineKernelName(kernel), batch,
+                layerFlops, moved, intensity, gflops, inCache ? "cache" : "memory", roof, gflops / roof,
+                memoryBound ? "memory" : "compute");
+        }
+    }
+}
+
+
+// Both kernels of every conv and pooling layer of CnnNet on one image, plus a stride 2
+// conv and a wider one. Weights and inputs are synthetic, only the shapes matter here.
+// The difference is the largest between the two kernels' outputs, the last line is the
+// -conv_algorithm that picks the faster kernel for each layer of CnnNet.
+void run_conv_report() {
+    std::vector<CnnLayer> layers = buildCnnNet();
+    size_t netLayers = layers.size();
+    const ConvShape strided = {8, 28, 28, 16, 3, 2, 1};
+    const ConvShape wide = {16, 14, 14, 32, 3, 1, 1};
+    layers.push_back(cnnConv("conv_s2", strided));
+    layers.push_back(cnnConv("conv_wide", wide));
+
+    printf("layer,type,input,output,algorithm,us_per_image,gflops,max_difference\n");
+    std::string fastest;
+    for (size_t l = 0; l < layers.size(); ++l) {
+        const CnnLayer& layer = layers[l];
+        if (layer.type != CNN_CONV && layer.type != CNN_POOL) {
+            continue;
+        }
+        bool isConv = layer.type == CNN_CONV;
+        int inChannels = isConv ? layer.conv.inChannels : layer.pool.channels;
+        int inHeight = isConv ? layer.conv.height : layer.pool.height;
+        int inWidth = isConv ? layer.conv.width : layer.pool.width;
+
+        FloatBuffer weights(isConv ? (size_t)layer.conv.outChannels * layer.conv.patchSize() : 1);
+        FloatBuffer biases(isConv ? layer.conv.outChannels : 1);
+        FloatBuffer input(layer.inputSize);
+        FloatBuffer outputs[2] = {FloatBuffer(layer.outputSize), FloatBuffer(layer.outputSize)};
+        for (size_t i = 0; i < weights.size(); ++i) {
+            weights[i] = (float)((i * 7919) % 1000) / 1000.0f - 0.5f;
+        }
+        for (size_t i = 0; i < biases.size(); ++i) {
+            biases[i] = 0.01f * i;
+        }
+        for (size_t i = 0; i < input.size(); ++i) {
+            input[i] = (float)((i * 31) % 100) / 50.0f - 1.0f;
+        }
+
+        // One op per multiply-add term, compare or add of a window
+        double ops = isConv ? 2.0 * layer.outputSize * layer.conv.patchSize() :
+                              (double)layer.outputSize * layer.pool.size * layer.pool.size;
+        int iterations = iterationsGiven ? numIterations : std::max(10, (int)(1e8 / ops));
+
+        const ConvAlgorithm algorithms[2] = {CONV_IM2COL, CONV_DIRECT};
+        double seconds[2];
+        for (int a = 0; a < 2; ++a) {
+            ScratchArena arena;
+            arena.reserve(std::max((size_t)1, isConv ? conv2dScratchFloats(algorithms[a], layer.conv) :
+                                                        pool2dScratchFloats(algorithms[a], layer.pool)));
+            ConstTensorView in = viewOf(input, 1, layer.inputSize);
+            TensorView out = viewOf(outputs[a], 1, layer.outputSize);
+            DataflowTraffic traffic;
+            double start = getCurrentTimestamp();
+            for (int i = 0; i < iterations; ++i) {
+                if (isConv) {
+                    conv2d_CPU(algorithms[a], layer.conv, viewOf(weights, layer.conv.outChannels, layer.conv.patchSize()),
+                        viewOf(biases, 1, layer.conv.outChannels), in, out, traffic, arena);
+                } else {
+                    pool2d_CPU(algorithms[a], layer.poolType, layer.pool, in, out, arena);
+                }
+            }
+            seconds[a] = (getCurrentTimestamp() - start) / iterations;
+        }
+
+        float difference = 0.0f;
+        for (int i = 0; i < layer.outputSize; ++i) {
+            difference = std::max(difference, std::fabs(outputs[0][i] - outputs[1][i]));
+        }
+        for (int a = 0; a < 2; ++a) {
+            printf("%s,%s,%dx%dx%d,%dx%dx%d,%s,%.2f,%.3f,%g\n", layer.name.c_str(),
+                isConv ? "conv" : layer.poolType == POOL_MAX ? "max_pool" : "avg_pool",
+                inChannels, inHeight, inWidth, layer.channels, layer.height, layer.width,
+                convAlgorithmName(algorithms[a]), seconds[a] * 1e6, ops / seconds[a] / 1e9, difference);
+        }
+        if (l < netLayers) {
+            fastest += std::string(fastest.empty() ? "" : ",") + convAlgorithmName(seconds[1] < seconds[0] ? CONV_DIRECT : CONV_IM2COL);
+        }
+    }
+    printf("fastest,-conv_algorithm=%s\n", fastest.c_str());
+}
+
+
+// The scalar libm versions the activation library replaced, kept as the reference of
+// -activation_report
+static void referenceRelu(const float* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = std::max(0.0f, in[i]);
+    }
+}
+
+static void referenceLeakyRelu(const float* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = in[i] > 0.0f ? in[i] : 0.01f * in[i];
+    }
+}
+
+static void referenceSigmoid(const float* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = 1.0f / (1.0f + std::exp(-in[i]));
+    }
+}
+
+static void referenceSoftmax(const float* in, float* out, size_t n) {
+    float maxElement = *std::max_element(in, in + n);
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = std::exp(in[i] - maxElement);
+        sum += out[i];
+    }
+    for (size_t i = 0; i < n; ++i) {
+        out[i] /= sum;
+    }
 }
-#endif
 
-int getMaxIn(std::vector<float>& v){
-    int maxIndex = std::distance(v.begin(), std::max_element(v.begin(), v.end()));
-    return maxIndex;
+static void referenceLogSoftmax(const float* in, float* out, size_t n) {
+    float maxElement = *std::max_element(in, in + n);
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        sum += std::exp(in[i] - maxElement);
+    }
+    float logSum = std::log(sum);
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = in[i] - maxElement - logSum;
+    }
 }
 
-void relu(std::vector<float>& v) {
-    for (size_t i = 0; i < v.size(); ++i) {
-        v[i] = std::max(0.0f, v[i]);
+static void fastLeakyRelu(const float* in, float* out, size_t n) {
+    leakyRelu(in, out, n, 0.01f);
+}
+
+// Measured error of fastExp / fastLog over their whole range, then every
+// activation against the libm version: the largest difference on inputs in [-10, 10]
+// and the time per row, rows of 10 (the fc2 output), 128 (the hidden layer) and 4096.
+void run_activation_report() {
+    // In units in the last place of the correctly rounded float result
+    double worstExp = 0.0, worstLog = 0.0;
+    for (float x = -87.0f; x <= 88.7f; x += 0.000977f) {
+        double exact = std::exp((double)x);
+        float rounded = (float)exact;
+        worstExp = std::max(worstExp, std::fabs(fastExp(x) - exact) / (std::nextafter(rounded, FLT_MAX) - rounded));
+    }
+    for (float x = FLT_MIN; x < FLT_MAX / 1.0001f; x *= 1.0001f) {
+        double exact = std::log((double)x);
+        float magnitude = std::fabs((float)exact);
+        worstLog = std::max(worstLog, std::fabs(fastLog(x) - exact) / (std::nextafter(magnitude, FLT_MAX) - magnitude));
+    }
+    printf("fastExp max error on [-87, 88.7]: %.2f ulp\n", worstExp);
+    printf("fastLog max error on [FLT_MIN, FLT_MAX]: %.2f ulp\n", worstLog);
+
+    typedef void (*Activation)(const float*, float*, size_t);
+    const char* names[] = {"relu", "leaky_relu", "sigmoid", "softmax", "log_softmax"};
+    const Activation references[] = {referenceRelu, referenceLeakyRelu, referenceSigmoid, referenceSoftmax, referenceLogSoftmax};
+    const Activation fast[] = {relu, fastLeakyRelu, sigmoid, softmax, log_softmax};
+    const size_t sizes[] = {10, 128, 4096};
+
+    printf("function,n,max_error,reference_ns,fast_ns,speedup\n");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        size_t n = sizes[s];
+        const int iterations = iterationsGiven ? numIterations : (int)std::max<size_t>(100, 4000000 / n);
+        FloatBuffer input(n), expected(n), output(n);
+        for (size_t i = 0; i < n; ++i) {
+            input[i] = -10.0f + 20.0f * (float)((i * 7919) % n) / n; // spread over [-10, 10)
+        }
+
+        for (int f = 0; f < 5; ++f) {
+            references[f](input.data(), expected.data(), n);
+            fast[f](input.data(), output.data(), n);
+            float maxError = 0.0f;
+            for (size_t i = 0; i < n; ++i) {
+                maxError = std::max(maxError, std::fabs(output[i] - expected[i]));
+            }
+
+            double times[2];
+            for (int pass = 0; pass < 2; ++pass) {
+                Activation run = pass == 0 ? references[f] : fast[f];
+                double start = getCurrentTimestamp();
+                for (int i = 0; i < iterations; ++i) {
+                    run(input.data(), output.data(), n);
+                    asm volatile("" : : "r"(output.data()) : "memory"); // keeps the calls in the loop
+                }
+                times[pass] = (getCurrentTimestamp() - start) / iterations;
+            }
+
+            printf("%s,%zu,%g,%.1f,%.1f,%.2f\n", names[f], n, maxError, times[0] * 1e9, times[1] * 1e9, times[0] / times[1]);
+        }
     }
 }
 
+
+// Prunes a copy of fc1 to each sparsity and runs the test image through the dense
+// weight stationary kernel and the CSR kernel. The log-probability error is against
+// the unpruned model, the times are per fc1 call averaged over -iterations calls.
+void run_sparsity_report() {
+    const double sparsities[] = {0.0, 0.5, 0.7, 0.8, 0.9, 0.95, 0.98};
+    const int iterations = iterationsGiven ? numIterations : 2000;
+
+    FloatBuffer fc1Weights, fc1Biases, fc2Weights, fc2Biases;
+    if (!loadModelParameters(layer1_weightsPath, layer1_biasesPath, fc1Weights, fc1Biases) ||
+        !loadModelParameters(output_weightsPath, output_biasesPath, fc2Weights, fc2Biases)) {
+        std::cerr << "Failed to load the model files for the report" << std::endl;
+        return;
+    }
+    int hiddenSize = (int)fc1Biases.size();
+
+    FloatBuffer image(inputSize), hidden(hiddenSize), output(numNeurons), reference(numNeurons);
+    normalizeImage(image_pixels.data(), image_pixels.size(), image.data());
+
+    ScratchArena arena;
+    arena.reserve(std::max(layerScratchFloats(hiddenSize, inputTileSize), layerScratchFloats(numNeurons, hiddenSize)));
+    DataflowTraffic traffic;
+
+    printf("sparsity,density,nonzeros,label,max_logprob_error,dense_us,sparse_us,speedup\n");
+
+    for (size_t level = 0; level < sizeof(sparsities) / sizeof(sparsities[0]); ++level) {
+        FloatBuffer pruned(fc1Weights);
+        pruneByMagnitude(pruned.data(), pruned.size(), sparsities[level]);
+        SparseMatrix sparse;
+        denseToSparse(viewOf(pruned, hiddenSize, inputSize), sparse);
+
+        double start = getCurrentTimestamp();
+        for (int i = 0; i < iterations; ++i) {
+            std::fill(hidden.begin(), hidden.end(), 0.0f);
+            processTiles_CPU(WEIGHT_STATIONARY, hiddenSize, inputSize, inputTileSize,
+                pruned.data(), fc1Biases.data(), image.data(), hidden.data(), traffic, arena);
+        }
+        double denseSeconds = (getCurrentTimestamp() - start) / iterations;
+
+        start = getCurrentTimestamp();
+        for (int i = 0; i < iterations; ++i) {
+            sparseLayer_CPU(sparse, viewOf(fc1Biases, 1, hiddenSize), viewOf(image, 1, inputSize),
+                viewOf(hidden, 1, hiddenSize), traffic);
+        }
+        double sparseSeconds = (getCurrentTimestamp() - start) / iterations;
+
+        // The rest of the network on the sparse result
+        relu(hidden);
+        std::fill(output.begin(), output.end(), 0.0f);
+        processTiles_CPU(WEIGHT_STATIONARY, numNeurons, hiddenSize, hiddenSize,
+            fc2Weights.data(), fc2Biases.data(), hidden.data(), output.data(), traffic, arena);
+        log_softmax(output);
+        if (level == 0) {
+            reference = output;
+        }
+        float maxError = 0.0f;
+        for (int c = 0; c < numNeurons; ++c) {
+            maxError = std::max(maxError, std::fabs(output[c] - reference[c]));
+        }
+
+        printf("%.2f,%.4f,%zu,%d,%g,%.3f,%.3f,%.2f\n", sparsities[level], sparse.density(), sparse.nonZeros(),
+            getMaxIn(output), maxError, denseSeconds * 1e6, sparseSeconds * 1e6, denseSeconds / sparseSeconds);
+    }
+}
+
+
+// Classifies frames straight out of their ring slots until SIGINT / SIGTERM,
+// or until -iterations frames when it is given
+int run_ring() {
+    FrameRing ring;
+    if (!ring.open(frameRingName)) {
+        return -1;
+    }
+    printf("reading frames from %s\n", frameRingName.c_str());
+
+    ModelReloader reloader(cpuModel);
+    startModelWatch(reloader);
+    ReloadingContext context(reloader, (mnist_dataflow)cpuDataflow);
+
+    signal(SIGINT, stopSignalHandler);
+    signal(SIGTERM, stopSignalHandler);
+
+    int Label = -1;
+    long frames = 0;
+    while (!stopRequested().load() && (!iterationsGiven || frames < numIterations)) {
+        const FrameSlot* slot = ring.peek(frameRingLatestOnly);
+        if (!slot) {
+            usleep(100); // the ring is empty, the capture rate is far below this
+            continue;
+        }
+
+        mnist_status status = mnist_infer_u8(context.get(), slot->pixels, &Label, NULL);
+        uint64_t ageNs = frameRingNowNs() - slot->timestampNs;
+        uint64_t seq = slot->seq;
+        ring.release();
+
+        if (status != MNIST_OK) {
+            std::cerr << "Inference failed: " << mnist_status_string(status) << std::endl;
+            continue;
+        }
+        HOT_PRINTF("frame:%llu label:%d age:%.1f us\n", (unsigned long long)seq, Label, ageNs / 1000.0);
+        frames++;
+    }
+
+    printf("frames:%ld captured:%llu overruns:%llu drops:%llu\n", frames,
+        (unsigned long long)ring.captured(), (unsigned long long)ring.overruns(), (unsigned long long)ring.drops());
+    printf("Predicted label:%d\n", Label);
+    return Label;
+}
+#endif
+
 void cleanup_cpu() {
+    #if FPGA == 0
+    mnist_context_free(cpuContext);
+    mnist_model_free(cpuModel);
+    cpuContext = NULL;
+    cpuModel = NULL;
+    #endif
+}
+
 
+// Prints the first count values of a layer output, skipped in quiet mode
+void printOutputs(const char* label, const float* v, int count) {
+    if (quietMode()) {
+        return;
+    }
+    std::cout << label;
+    for(int i=0;i<count;i++){
+        std::cout << v[i] << " ";
+    }
+    std::cout << std::endl;
 }
 
 
@@ -631,6 +2236,17 @@ void cleanup() {
     #if FPGA == 1
     cl_int status;
 
+    // Release the persistent buffers
+    if(inputTileBuffer) {
+        clReleaseMemObject(inputTileBuffer);
+    }
+    if(weightsTileBuffer) {
+        clReleaseMemObject(weightsTileBuffer);
+    }
+    if(outputBuffer) {
+        clReleaseMemObject(outputBuffer);
+    }
+
     // Release kernels
     if(kernel) {
         status = clReleaseKernel(kernel);
@@ -645,6 +2261,11 @@ void cleanup() {
     }
 
 
+    if(queue) {
+        status = clReleaseCommandQueue(queue);
+        checkError(status, "Failed to release queue");
+    }
+
     // Finally, release the context
     if(context) {
         status = clReleaseContext(context);
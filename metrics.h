@@ -0,0 +1,334 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// Pipeline stages with their own latency histogram
+enum Stage {
+    STAGE_LOAD,         // BMP read and model files
+    STAGE_PREPROCESS,   // flip and normalization
+    STAGE_FC1,
+    STAGE_FC2,
+    STAGE_POSTPROCESS,  // softmax and argmax
+    NUM_STAGES
+};
+
+inline const char* stageName(int stage) {
+    static const char* names[NUM_STAGES] = {"load", "preprocess", "fc1", "fc2", "postprocess"};
+    return names[stage];
+}
+
+
+// Upper bounds of the histogram buckets in microseconds, the last bucket is +Inf
+const int numLatencyBuckets = 16;
+const uint64_t latencyBucketBoundsUs[numLatencyBuckets - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 50000, 100000
+};
+
+
+// Fixed-bucket histogram, recording is a few relaxed atomic adds so any thread can record
+struct LatencyHistogram {
+    std::atomic<uint64_t> buckets[numLatencyBuckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sumNs;
+    std::atomic<uint64_t> maxNs;
+
+    LatencyHistogram() : count(0), sumNs(0), maxNs(0) {
+        for (int i = 0; i < numLatencyBuckets; ++i) {
+            buckets[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t ns) {
+        uint64_t us = ns / 1000;
+        int bucket = 0;
+        while (bucket < numLatencyBuckets - 1 && us > latencyBucketBoundsUs[bucket]) {
+            bucket++;
+        }
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sumNs.fetch_add(ns, std::memory_order_relaxed);
+
+        uint64_t prev = maxNs.load(std::memory_order_relaxed);
+        while (ns > prev && !maxNs.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+
+// Batch sizes run by the inference server, powers of two up to 64 and +Inf
+const int numBatchBuckets = 8;
+const uint64_t batchBucketBounds[numBatchBuckets - 1] = {1, 2, 4, 8, 16, 32, 64};
+
+struct BatchSizeHistogram {
+    std::atomic<uint64_t> buckets[numBatchBuckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+
+    BatchSizeHistogram() : count(0), sum(0) {
+        for (int i = 0; i < numBatchBuckets; ++i) {
+            buckets[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t size) {
+        int bucket = 0;
+        while (bucket < numBatchBuckets - 1 && size > batchBucketBounds[bucket]) {
+            bucket++;
+        }
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(size, std::memory_order_relaxed);
+    }
+};
+
+
+struct MetricsRegistry {
+    LatencyHistogram stages[NUM_STAGES];
+    LatencyHistogram requests; // Server requests, from the last payload byte read to the reply queued for sending
+    BatchSizeHistogram batches;
+    std::atomic<uint64_t> inferences;
+    std::atomic<uint64_t> failures;
+    std::atomic<uint64_t> modelReloads;        // New weights swapped in by the model watcher
+    std::atomic<uint64_t> modelReloadFailures; // New weights that did not load or validate
+    std::atomic<bool> quiet; // Strips the per-inference console output
+
+    MetricsRegistry() : inferences(0), failures(0), modelReloads(0), modelReloadFailures(0), quiet(false) {}
+};
+
+inline MetricsRegistry& metrics() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+inline bool quietMode() {
+    return metrics().quiet.load(std::memory_order_relaxed);
+}
+
+
+// printf that is skipped in quiet mode, use it for anything printed per inference
+#define HOT_PRINTF(...) do { if (!quietMode()) printf(__VA_ARGS__); } while (0)
+
+
+inline uint64_t metricsNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Records the lifetime of the scope into the histogram of a stage
+class ScopedStageTimer {
+public:
+    explicit ScopedStageTimer(Stage stage) : stage_(stage), start_(metricsNowNs()) {}
+    ~ScopedStageTimer() { metrics().stages[stage_].record(metricsNowNs() - start_); }
+private:
+    Stage stage_;
+    uint64_t start_;
+};
+
+
+// Both writers go through a temporary file and rename it,
+// so a scraper never reads a half written snapshot
+inline bool writeMetricsJSON(const std::string& path) {
+    std::string tmpPath = path + ".tmp";
+    FILE* f = fopen(tmpPath.c_str(), "w");
+    if (!f) {
+        return false;
+    }
+
+    MetricsRegistry& m = metrics();
+    fprintf(f, "{\n  \"inferences\": %llu,\n  \"failures\": %llu,\n  \"model_reloads\": %llu,\n  \"model_reload_failures\": %llu,\n  \"stages\": {\n",
+        (unsigned long long)m.inferences.load(), (unsigned long long)m.failures.load(),
+        (unsigned long long)m.modelReloads.load(), (unsigned long long)m.modelReloadFailures.load());
+
+    for (int s = 0; s < NUM_STAGES; ++s) {
+        LatencyHistogram& h = m.stages[s];
+        fprintf(f, "    \"%s\": {\"count\": %llu, \"sum_ns\": %llu, \"max_ns\": %llu, \"buckets_us\": [",
+            stageName(s), (unsigned long long)h.count.load(), (unsigned long long)h.sumNs.load(),
+            (unsigned long long)h.maxNs.load());
+        for (int b = 0; b < numLatencyBuckets; ++b) {
+            if (b < numLatencyBuckets - 1) {
+                fprintf(f, "{\"le\": %llu, \"count\": %llu}, ", (unsigned long long)latencyBucketBoundsUs[b],
+                    (unsigned long long)h.buckets[b].load());
+            } else {
+                fprintf(f, "{\"le\": \"+Inf\", \"count\": %llu}", (unsigned long long)h.buckets[b].load());
+            }
+        }
+        fprintf(f, "]}%s\n", s < NUM_STAGES - 1 ? "," : "");
+    }
+    fprintf(f, "  },\n");
+
+    LatencyHistogram& r = m.requests;
+    fprintf(f, "  \"requests\": {\"count\": %llu, \"sum_ns\": %llu, \"max_ns\": %llu, \"buckets_us\": [",
+        (unsigned long long)r.count.load(), (unsigned long long)r.sumNs.load(), (unsigned long long)r.maxNs.load());
+    for (int b = 0; b < numLatencyBuckets; ++b) {
+        if (b < numLatencyBuckets - 1) {
+            fprintf(f, "{\"le\": %llu, \"count\": %llu}, ", (unsigned long long)latencyBucketBoundsUs[b],
+                (unsigned long long)r.buckets[b].load());
+        } else {
+            fprintf(f, "{\"le\": \"+Inf\", \"count\": %llu}", (unsigned long long)r.buckets[b].load());
+        }
+    }
+    fprintf(f, "]},\n");
+
+    BatchSizeHistogram& bs = m.batches;
+    fprintf(f, "  \"batches\": {\"count\": %llu, \"sum\": %llu, \"buckets\": [",
+        (unsigned long long)bs.count.load(), (unsigned long long)bs.sum.load());
+    for (int b = 0; b < numBatchBuckets; ++b) {
+        if (b < numBatchBuckets - 1) {
+            fprintf(f, "{\"le\": %llu, \"count\": %llu}, ", (unsigned long long)batchBucketBounds[b],
+                (unsigned long long)bs.buckets[b].load());
+        } else {
+            fprintf(f, "{\"le\": \"+Inf\", \"count\": %llu}", (unsigned long long)bs.buckets[b].load());
+        }
+    }
+    fprintf(f, "]}\n}\n");
+    fclose(f);
+
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+
+// Prometheus text exposition format, for the node exporter textfile collector
+inline bool writeMetricsPrometheus(const std::string& path) {
+    std::string tmpPath = path + ".tmp";
+    FILE* f = fopen(tmpPath.c_str(), "w");
+    if (!f) {
+        return false;
+    }
+
+    MetricsRegistry& m = metrics();
+    fprintf(f, "# HELP mnist_inferences_total Completed inferences.\n");
+    fprintf(f, "# TYPE mnist_inferences_total counter\n");
+    fprintf(f, "mnist_inferences_total %llu\n", (unsigned long long)m.inferences.load());
+    fprintf(f, "# HELP mnist_failures_total Failed inferences.\n");
+    fprintf(f, "# TYPE mnist_failures_total counter\n");
+    fprintf(f, "mnist_failures_total %llu\n", (unsigned long long)m.failures.load());
+    fprintf(f, "# HELP mnist_model_reloads_total Model weights swapped in without a restart.\n");
+    fprintf(f, "# TYPE mnist_model_reloads_total counter\n");
+    fprintf(f, "mnist_model_reloads_total %llu\n", (unsigned long long)m.modelReloads.load());
+    fprintf(f, "# HELP mnist_model_reload_failures_total Changed model files that failed to load or validate.\n");
+    fprintf(f, "# TYPE mnist_model_reload_failures_total counter\n");
+    fprintf(f, "mnist_model_reload_failures_total %llu\n", (unsigned long long)m.modelReloadFailures.load());
+
+    fprintf(f, "# HELP mnist_stage_latency_seconds Latency of each pipeline stage.\n");
+    fprintf(f, "# TYPE mnist_stage_latency_seconds histogram\n");
+    for (int s = 0; s < NUM_STAGES; ++s) {
+        LatencyHistogram& h = m.stages[s];
+        uint64_t cumulative = 0;
+        for (int b = 0; b < numLatencyBuckets; ++b) {
+            cumulative += h.buckets[b].load();
+            if (b < numLatencyBuckets - 1) {
+                fprintf(f, "mnist_stage_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                    stageName(s), latencyBucketBoundsUs[b] * 1e-6, (unsigned long long)cumulative);
+            } else {
+                fprintf(f, "mnist_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                    stageName(s), (unsigned long long)cumulative);
+            }
+        }
+        fprintf(f, "mnist_stage_latency_seconds_sum{stage=\"%s\"} %g\n", stageName(s), h.sumNs.load() * 1e-9);
+        fprintf(f, "mnist_stage_latency_seconds_count{stage=\"%s\"} %llu\n", stageName(s),
+            (unsigned long long)h.count.load());
+    }
+
+    fprintf(f, "# HELP mnist_request_latency_seconds Server requests, from receipt to reply.\n");
+    fprintf(f, "# TYPE mnist_request_latency_seconds histogram\n");
+    LatencyHistogram& r = m.requests;
+    uint64_t cumulative = 0;
+    for (int b = 0; b < numLatencyBuckets; ++b) {
+        cumulative += r.buckets[b].load();
+        if (b < numLatencyBuckets - 1) {
+            fprintf(f, "mnist_request_latency_seconds_bucket{le=\"%g\"} %llu\n",
+                latencyBucketBoundsUs[b] * 1e-6, (unsigned long long)cumulative);
+        } else {
+            fprintf(f, "mnist_request_latency_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+        }
+    }
+    fprintf(f, "mnist_request_latency_seconds_sum %g\n", r.sumNs.load() * 1e-9);
+    fprintf(f, "mnist_request_latency_seconds_count %llu\n", (unsigned long long)r.count.load());
+
+    fprintf(f, "# HELP mnist_batch_size Images per batch run by the server.\n");
+    fprintf(f, "# TYPE mnist_batch_size histogram\n");
+    BatchSizeHistogram& bs = m.batches;
+    cumulative = 0;
+    for (int b = 0; b < numBatchBuckets; ++b) {
+        cumulative += bs.buckets[b].load();
+        if (b < numBatchBuckets - 1) {
+            fprintf(f, "mnist_batch_size_bucket{le=\"%llu\"} %llu\n",
+                (unsigned long long)batchBucketBounds[b], (unsigned long long)cumulative);
+        } else {
+            fprintf(f, "mnist_batch_size_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+        }
+    }
+    fprintf(f, "mnist_batch_size_sum %llu\n", (unsigned long long)bs.sum.load());
+    fprintf(f, "mnist_batch_size_count %llu\n", (unsigned long long)bs.count.load());
+    fclose(f);
+
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+
+// Background thread writing both exports every intervalMs, and once more on stop
+class MetricsExporter {
+public:
+    MetricsExporter() : running_(false), intervalMs_(1000) {}
+    ~MetricsExporter() { stop(); }
+
+    void start(const std::string& jsonPath, const std::string& promPath, int intervalMs) {
+        jsonPath_ = jsonPath;
+        promPath_ = promPath;
+        intervalMs_ = intervalMs;
+        running_ = true;
+        thread_ = std::thread(&MetricsExporter::loop, this);
+    }
+
+    void stop() {
+        if (!running_) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+        }
+        wake_.notify_all();
+        thread_.join();
+        writeAll();
+    }
+
+private:
+    void writeAll() {
+        if (!jsonPath_.empty()) {
+            writeMetricsJSON(jsonPath_);
+        }
+        if (!promPath_.empty()) {
+            writeMetricsPrometheus(promPath_);
+        }
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (running_) {
+            wake_.wait_for(lock, std::chrono::milliseconds(intervalMs_));
+            if (running_) {
+                writeAll();
+            }
+        }
+    }
+
+    bool running_;
+    int intervalMs_;
+    std::string jsonPath_;
+    std::string promPath_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+};
+
+#endif
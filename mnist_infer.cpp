@@ -0,0 +1,849 @@
+#include <algorithm>
+#include <cmath>
+#include <new>
+#include <vector>
+#include "mnist_infer.h"
+#include "nn_layers.h"
+#include "metrics.h"
+#include "perf_counters.h"
+#include "trace.h"
+#ifdef MNIST_EMBEDDED_MODEL
+#include "model_weights.h"
+#endif
+
+
+// Read-only once loaded and converted, shared by every context
+struct mnist_model {
+    FloatBuffer hidden_layer1_weights;
+    FloatBuffer hidden_layer1_biases;
+    FloatBuffer output_layer_weights;
+    FloatBuffer output_layer_biases;
+    int hiddenSize;
+
+    // Layers stored as fp16 / bf16, binary / ternary or low-rank factors keep their
+    // weights here, their fp32 buffer is empty
+    WeightFormat weightFormat[MNIST_NUM_LAYERS];
+    HalfBuffer halfWeights[MNIST_NUM_LAYERS];
+    BitMatrix bitWeights[MNIST_NUM_LAYERS];
+    LowRankLayer lowRank[MNIST_NUM_LAYERS];
+
+    // Shapes of the buffers above, set by checkModelShape. Layer 0 is fc1, hiddenSize x 784,
+    // layer 1 is fc2, 10 x hiddenSize. Only the view of the stored format is set, bit
+    // and low-rank layers carry their shape in bitWeights and lowRank.
+    ConstTensorView weights[MNIST_NUM_LAYERS];
+    ConstHalfView halfWeightViews[MNIST_NUM_LAYERS];
+    ConstTensorView biases[MNIST_NUM_LAYERS];
+
+    // CSR copies of the fp32 layers pruned below sparseDensityThreshold, set by prepareSparse
+    double density[MNIST_NUM_LAYERS];
+    bool sparse[MNIST_NUM_LAYERS];
+    SparseMatrix sparseWeights[MNIST_NUM_LAYERS];
+
+    // fc1 with normalizeImage folded in, for a dense fp32 fc1 only, set by prepareFoldedInput
+    PixelLayer foldedInput;
+
+    mnist_model() {
+        for (int l = 0; l < MNIST_NUM_LAYERS; ++l) {
+            weightFormat[l] = WEIGHTS_FP32;
+        }
+    }
+
+    FloatBuffer& layerWeights(int layer) { return layer == 0 ? hidden_layer1_weights : output_layer_weights; }
+    FloatBuffer& layerBiases(int layer) { return layer == 0 ? hidden_layer1_biases : output_layer_biases; }
+};
+
+// Everything one inference writes to, a context is only used by one thread at a time
+// and is allocated on its own cache lines so neighbouring contexts never share one
+struct mnist_context {
+    const mnist_model* model;
+    Dataflow dataflow;
+
+    // Activations and kernel scratch, carved from one block sized from the model
+    // in mnist_context_create, so mnist_infer_u8 never touches the heap
+    ScratchArena arena;
+    TensorView image;   // 1 x 784
+    TensorView hidden;  // 1 x hiddenSize
+    TensorView output;  // 1 x 10
+
+    // Activations of mnist_infer_batch_u8, grow to the largest batch seen
+    FloatBuffer batch_images;
+    FloatBuffer batch_hidden;
+    FloatBuffer batch_out;
+
+    Dataflow layerDataflow[MNIST_NUM_LAYERS];
+    DataflowTraffic layerTraffic[MNIST_NUM_LAYERS];
+
+    long frame; // Trace frame id, counts the inferences of this context
+};
+
+
+static_assert(MNIST_IMAGE_SIZE % inputTileSize == 0, "fc1 is tiled by inputTileSize");
+
+// Reads a layer in the format its weights file name asks for, see weightFormatFromPath
+static bool loadLayer(mnist_model* m, int layer, const char* weightsPath, const char* biasesPath) {
+    m->weightFormat[layer] = weightFormatFromPath(weightsPath);
+    if (m->weightFormat[layer] == WEIGHTS_FP32) {
+        return loadModelParameters(weightsPath, biasesPath, m->layerWeights(layer), m->layerBiases(layer));
+    }
+    if (isBitFormat(m->weightFormat[layer])) {
+        BitMatrix& bits = m->bitWeights[layer];
+        m->layerBiases(layer) = loadFloatsFromFile(biasesPath);
+        return loadBitMatrixFromFile(weightsPath, bits) && !m->layerBiases(layer).empty() &&
+               bits.ternary == (m->weightFormat[layer] == WEIGHTS_TERNARY);
+    }
+    if (m->weightFormat[layer] == WEIGHTS_LOW_RANK) {
+        m->layerBiases(layer) = loadFloatsFromFile(biasesPath);
+        return loadLowRankFromFile(weightsPath, m->lowRank[layer]) && !m->layerBiases(layer).empty();
+    }
+    m->halfWeights[layer] = loadHalfsFromFile(weightsPath);
+    m->layerBiases(layer) = loadFloatsFromFile(biasesPath);
+    return !m->halfWeights[layer].empty() && !m->layerBiases(layer).empty();
+}
+
+
+// fc1 is hiddenSize x 784, fc2 is 10 x hiddenSize
+static bool checkModelShape(mnist_model* m) {
+    m->hiddenSize = (int)m->hidden_layer1_biases.size();
+    const int rows[MNIST_NUM_LAYERS] = { m->hiddenSize, MNIST_NUM_CLASSES };
+    const int cols[MNIST_NUM_LAYERS] = { MNIST_IMAGE_SIZE, m->hiddenSize };
+
+    for (int l = 0; l < MNIST_NUM_LAYERS; ++l) {
+        bool fp32 = m->weightFormat[l] == WEIGHTS_FP32;
+        size_t stored = fp32 ? m->layerWeights(l).size() : m->halfWeights[l].size();
+        if (isBitFormat(m->weightFormat[l])) {
+            const BitMatrix& bits = m->bitWeights[l];
+            stored = bits.rows == rows[l] && bits.cols == cols[l] ? (size_t)rows[l] * cols[l] : 0;
+        } else if (m->weightFormat[l] == WEIGHTS_LOW_RANK) {
+            const LowRankLayer& factors = m->lowRank[l];
+            stored = factors.rows == rows[l] && factors.cols == cols[l] ? (size_t)rows[l] * cols[l] : 0;
+        }
+        if (stored != (size_t)rows[l] * cols[l] || m->layerBiases(l).size() != (size_t)rows[l]) {
+            return false;
+        }
+        m->weights[l] = fp32 ? ConstTensorView(viewOf(m->layerWeights(l), rows[l], cols[l])) : ConstTensorView();
+        m->halfWeightViews[l] = isHalfFormat(m->weightFormat[l]) ? ConstHalfView(m->halfWeights[l].data(), rows[l], cols[l])
+                                                                 : ConstHalfView();
+        m->biases[l] = viewOf(m->layerBiases(l), 1, rows[l]);
+    }
+    return true;
+}
+
+
+// A NaN weight is silently flattened to 0 by relu, so it is caught here instead
+static bool checkModelFinite(const mnist_model* m) {
+    for (int l = 0; l < MNIST_NUM_LAYERS; ++l) {
+        if (m->weightFormat[l] == WEIGHTS_FP32) {
+            for (size_t i = 0; i < m->weights[l].size(); ++i) {
+                if (!std::isfinite(m->weights[l].data[i])) {
+                    return false;
+                }
+            }
+        } else if (isBitFormat(m->weightFormat[l])) {
+            const FloatBuffer& scales = m->bitWeights[l].scales;
+            for (size_t i = 0; i < scales.size(); ++i) {
+                if (!std::isfinite(scales[i])) {
+                    return false;
+                }
+            }
+        } else if (m->weightFormat[l] == WEIGHTS_LOW_RANK) {
+            const LowRankLayer& factors = m->lowRank[l];
+            for (size_t i = 0; i < factors.right.size(); ++i) {
+                if (!std::isfinite(factors.right[i])) {
+                    return false;
+                }
+            }
+            for (size_t i = 0; i < factors.left.size(); ++i) {
+                if (!std::isfinite(factors.left[i])) {
+                    return false;
+                }
+            }
+        } else {
+            // All-ones exponent is inf or NaN in both 16-bit formats
+            uint16_t exponent = m->weightFormat[l] == WEIGHTS_BF16 ? 0x7f80 : 0x7c00;
+            for (size_t i = 0; i < m->halfWeights[l].size(); ++i) {
+                if ((m->halfWeights[l][i] & exponent) == exponent) {
+                    return false;
+                }
+            }
+        }
+        for (size_t i = 0; i < m->biases[l].size(); ++i) {
+            if (!std::isfinite(m->biases[l].data[i])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+// Measures every layer and keeps a CSR copy of the fp32 ones pruned enough to gain from it
+static void prepareSparse(mnist_model* m) {
+    for (int l = 0; l < MNIST_NUM_LAYERS; ++l) {
+        size_t size, zeros;
+        if (m->weightFormat[l] == WEIGHTS_FP32) {
+            size = m->weights[l].size();
+            zeros = std::count(m->weights[l].data, m->weights[l].data + size, 0.0f);
+        } else if (isBitFormat(m->weightFormat[l])) {
+            const BitMatrix& bits = m->bitWeights[l];
+            size = (size_t)bits.rows * bits.cols;
+            zeros = 0;
+            for (size_t w = 0; bits.ternary && w < bits.nonZero.size(); ++w) {
+                zeros += 64 - __builtin_popcountll(bits.nonZero[w]);
+            }
+            zeros -= bits.ternary ? (size_t)bits.rows * (bits.words * 64 - bits.cols) : 0; // padding bits
+        } else if (m->weightFormat[l] == WEIGHTS_LOW_RANK) {
+            // The product of the factors is dense, the CSR kernel has nothing to skip
+            size = (size_t)m->lowRank[l].rows * m->lowRank[l].cols;
+            zeros = 0;
+        } else {
+            size = m->halfWeights[l].size();
+            zeros = 0;
+            for (size_t i = 0; i < size; ++i) {
+                zeros += (m->halfWeights[l][i] & 0x7fff) == 0;
+            }
+        }
+        m->density[l] = (double)(size - zeros) / size;
+        // The flag is only set once the CSR copy is complete, denseToSparse may throw
+        m->sparse[l] = false;
+        m->sparseWeights[l] = SparseMatrix();
+        if (m->weightFormat[l] == WEIGHTS_FP32 && m->density[l] <= sparseDensityThreshold) {
+            denseToSparse(m->weights[l], m->sparseWeights[l]);
+            m->sparse[l] = true;
+        }
+    }
+}
+
+
+// The raw pixel copy of fc1, the CSR and 16-bit layers keep normalizing the image
+static void prepareFoldedInput(mnist_model* m) {
+    PixelLayer folded;
+    if (m->weightFormat[0] == WEIGHTS_FP32 && !m->sparse[0]) {
+        foldInputNormalization(m->weights[0], m->biases[0], folded);
+    }
+    std::swap(m->foldedInput, folded); // a throw above keeps no half-folded copy
+
+}
+
+
+// fc1 straight from the pixels, skipping the normalized float image
+static bool runsFoldedInput(const mnist_context* context) {
+    return context->dataflow == DATAFLOW_AUTO && context->model->foldedInput.rows > 0;
+}
+
+
+// One fully connected layer from the copy of the weights the model keeps
+static void runLayer(mnist_context* context, int layer, ConstTensorView input, TensorView output, int tile) {
+    const mnist_model* model = context->model;
+    if (model->sparse[layer]) {
+        sparseLayer_CPU(model->sparseWeights[layer], model->biases[layer], input, output, context->layerTraffic[layer]);
+        context->layerDataflow[layer] = SPARSE_CSR;
+    } else if (isBitFormat(model->weightFormat[layer])) {
+        // Each output keeps its popcounts in registers, counted like output stationary
+        bitLayer_CPU(model->bitWeights[layer], model->biases[layer], input, output,
+            context->layerTraffic[layer], context->arena);
+        context->layerDataflow[layer] = OUTPUT_STATIONARY;
+    } else if (model->weightFormat[layer] == WEIGHTS_LOW_RANK) {
+        lowRankLayer_CPU(model->lowRank[layer], model->biases[layer], input, output,
+            context->layerTraffic[layer], context->arena);
+        context->layerDataflow[layer] = OUTPUT_STATIONARY;
+    } else if (isHalfFormat(model->weightFormat[layer])) {
+        halfLayer_CPU(model->weightFormat[layer], model->halfWeightViews[layer], model->biases[layer],
+            input, output, context->layerTraffic[layer]);
+        context->layerDataflow[layer] = OUTPUT_STATIONARY;
+    } else {
+        context->layerDataflow[layer] = denseLayer_CPU(context->dataflow, model->weights[layer], model->biases[layer],
+            input, output, tile, context->layerTraffic[layer], context->arena);
+    }
+}
+
+
+// Layer shapes against the activations of a context
+static bool layerShapesMatch(const mnist_model* model, int layer, ConstTensorView input, ConstTensorView output, int tile) {
+    if (model->weightFormat[layer] == WEIGHTS_FP32) {
+        return layerShapesMatch(model->weights[layer], model->biases[layer], input, output, tile);
+    }
+    if (isBitFormat(model->weightFormat[layer])) {
+        const BitMatrix& bits = model->bitWeights[layer];
+        return input.cols == bits.cols && output.cols == bits.rows && output.rows == input.rows &&
+               model->biases[layer].size() == (size_t)bits.rows;
+    }
+    if (model->weightFormat[layer] == WEIGHTS_LOW_RANK) {
+        const LowRankLayer& factors = model->lowRank[layer];
+        return input.cols == factors.cols && output.cols == factors.rows && output.rows == input.rows &&
+               model->biases[layer].size() == (size_t)factors.rows;
+    }
+    return layerShapesMatch(model->halfWeightViews[layer], model->biases[layer], input, output, tile);
+}
+
+
+// Where the output head of runModel writes, every non-NULL array gets one entry per image
+struct HeadOutput {
+    mnist_head head;
+    int k;
+    int* labels;
+    float* scores;          // MNIST_NUM_CLASSES per image, in class order
+    mnist_result* results;
+};
+
+
+// Runs one head on the logits of an image, in place. Only the label head leaves them as they are.
+static void applyHead(float* logits, int classes, mnist_head head, int k, mnist_result& result) {
+    switch (head) {
+    case MNIST_HEAD_LABEL:
+        result.label = getMaxIn(logits, classes);
+        result.count = 0;
+        return;
+
+    case MNIST_HEAD_TOP_K: {
+        // One exp per class for the normalizer, the ordering only ever looks at k candidates
+        topK(logits, classes, k, result.classes);
+        float logSum = logSumExp(logits, classes);
+        for (int i = 0; i < k; ++i) {
+            result.scores[i] = logits[result.classes[i]] - logSum;
+        }
+        result.label = result.classes[0];
+        result.count = k;
+        return;
+    }
+
+    case MNIST_HEAD_PROBABILITIES:
+    case MNIST_HEAD_LOG_PROBABILITIES:
+        if (head == MNIST_HEAD_PROBABILITIES) {
+            softmax(logits, classes);
+        } else {
+            log_softmax(logits, classes);
+        }
+        for (int c = 0; c < classes; ++c) {
+            result.classes[c] = c;
+            result.scores[c] = logits[c];
+        }
+        result.label = getMaxIn(logits, classes);
+        result.count = classes;
+        return;
+    }
+}
+
+
+static const char* headSpanName(mnist_head head) {
+    switch (head) {
+    case MNIST_HEAD_LABEL: return "argmax";
+    case MNIST_HEAD_TOP_K: return "top_k";
+    default: return "softmax";
+    }
+}
+
+
+// Both layers and the output head on every image, one row of hidden per image.
+// The views decide how many images run and how many elements each stage touches,
+// image is left untouched when fc1 runs on the pixels.
+static void runModel(mnist_context* context, const uint8_t* pixels,
+                     TensorView image, TensorView hidden, TensorView output,
+                     const HeadOutput& out, long frame) {
+    const mnist_model* model = context->model;
+    int count = hidden.rows;
+    bool folded = runsFoldedInput(context);
+
+    if (!folded) {
+        ScopedStageTimer timer(STAGE_PREPROCESS);
+        ScopedPerfCounters perf(STAGE_PREPROCESS, count);
+        TraceSpan span("normalization", "preprocess", frame);
+        normalizeImage(pixels, image);
+    }
+
+    {
+        ScopedStageTimer timer(STAGE_FC1);
+        ScopedPerfCounters perf(STAGE_FC1, count);
+        TraceSpan span("fc1", "layer", frame);
+
+        if (folded) {
+            pixelLayer_CPU(model->foldedInput, pixels, hidden, context->layerTraffic[0]);
+            context->layerDataflow[0] = FOLDED_INPUT;
+        } else {
+            runLayer(context, 0, image, hidden, inputTileSize);
+        }
+        relu(hidden);
+    }
+
+    {
+        ScopedStageTimer timer(STAGE_FC2);
+        ScopedPerfCounters perf(STAGE_FC2, count);
+        TraceSpan span("fc2", "layer", frame);
+
+        // fc2 is small enough to take the whole hidden vector as one tile
+        runLayer(context, 1, hidden, output, model->hiddenSize);
+    }
+
+    {
+        ScopedStageTimer timer(STAGE_POSTPROCESS);
+        ScopedPerfCounters perf(STAGE_POSTPROCESS, count);
+        TraceSpan span(headSpanName(out.head), "postprocess", frame);
+
+        for (int r = 0; r < count; ++r) {
+            mnist_result local;
+            mnist_result& result = out.results ? out.results[r] : local;
+            applyHead(output.row(r), output.cols, out.head, out.k, result);
+            if (out.labels) {
+                out.labels[r] = result.label;
+            }
+            if (out.scores) {
+                std::copy(result.scores, result.scores + output.cols, out.scores + (size_t)r * output.cols);
+            }
+        }
+    }
+}
+
+
+// The images of a call that runs more than one, on the grow-only batch buffers
+static void runBatch(mnist_context* context, const uint8_t* pixels, int count, const HeadOutput& out, long frame) {
+    const mnist_model* model = context->model;
+    if (!runsFoldedInput(context)) {
+        context->batch_images.resize((size_t)count * MNIST_IMAGE_SIZE);
+    }
+    context->batch_hidden.resize((size_t)count * model->hiddenSize);
+    context->batch_out.resize((size_t)count * MNIST_NUM_CLASSES);
+    runModel(context, pixels, TensorView(context->batch_images.data(), count, MNIST_IMAGE_SIZE),
+             viewOf(context->batch_hidden, count, model->hiddenSize),
+             viewOf(context->batch_out, count, MNIST_NUM_CLASSES), out, frame);
+}
+
+
+extern "C" {
+
+int mnist_api_version(void) {
+    return MNIST_API_VERSION;
+}
+
+
+const char* mnist_status_string(mnist_status status) {
+    switch (status) {
+    case MNIST_OK: return "ok";
+    case MNIST_ERR_ARGUMENT: return "invalid argument";
+    case MNIST_ERR_IO: return "could not read model file";
+    case MNIST_ERR_SHAPE: return "unexpected model shape";
+    case MNIST_ERR_NO_MEMORY: return "out of memory";
+    case MNIST_ERR_UNSUPPORTED: return "not supported by this build";
+    case MNIST_ERR_NOT_FINITE: return "model has NaN or infinite values";
+    }
+    return "unknown status";
+}
+
+
+mnist_status mnist_model_load(const char* fc1_weights_path, const char* fc1_bias_path,
+                              const char* fc2_weights_path, const char* fc2_bias_path,
+                              mnist_model** model) {
+    if (!fc1_weights_path || !fc1_bias_path || !fc2_weights_path || !fc2_bias_path || !model) {
+        return MNIST_ERR_ARGUMENT;
+    }
+    *model = NULL;
+
+    ScopedStageTimer timer(STAGE_LOAD);
+    ScopedPerfCounters perf(STAGE_LOAD, 0);
+    TraceSpan span("model_load", "io", 0);
+
+    mnist_model* m = new (std::nothrow) mnist_model();
+    if (!m) {
+        return MNIST_ERR_NO_MEMORY;
+    }
+
+    try {
+        if (!loadLayer(m, 0, fc1_weights_path, fc1_bias_path) || !loadLayer(m, 1, fc2_weights_path, fc2_bias_path)) {
+            delete m;
+            metrics().failures++;
+            return MNIST_ERR_IO;
+        }
+    } catch (const std::bad_alloc&) {
+        delete m;
+        return MNIST_ERR_NO_MEMORY;
+    }
+
+    if (!checkModelShape(m)) {
+        delete m;
+        metrics().failures++;
+        return MNIST_ERR_SHAPE;
+    }
+    if (!checkModelFinite(m)) {
+        delete m;
+        metrics().failures++;
+        return MNIST_ERR_NOT_FINITE;
+    }
+
+    try {
+        prepareSparse(m);
+        prepareFoldedInput(m);
+    } catch (const std::bad_alloc&) {
+        delete m;
+        return MNIST_ERR_NO_MEMORY;
+    }
+
+    *model = m;
+    return MNIST_OK;
+}
+
+
+mnist_status mnist_model_load_embedded(mnist_model** model) {
+    if (!model) {
+        return MNIST_ERR_ARGUMENT;
+    }
+    *model = NULL;
+
+#ifdef MNIST_EMBEDDED_MODEL
+    using namespace embedded_model;
+    static_assert(fc1Inputs == MNIST_IMAGE_SIZE && fc2Outputs == MNIST_NUM_CLASSES && fc2Inputs == fc1Outputs,
+                  "model_weights.h does not describe a 784 -> N -> 10 network");
+
+    ScopedStageTimer timer(STAGE_LOAD);
+    TraceSpan span("model_load_embedded", "io", 0);
+
+    mnist_model* m = new (std::nothrow) mnist_model();
+    if (!m) {
+        return MNIST_ERR_NO_MEMORY;
+    }
+
+    // One copy into aligned buffers, the layer kernels take FloatBuffer
+    try {
+        m->hidden_layer1_weights.assign(fc1_weight, fc1_weight + fc1Outputs * fc1Inputs);
+        m->hidden_layer1_biases.assign(fc1_bias, fc1_bias + fc1Outputs);
+        m->output_layer_weights.assign(fc2_weight, fc2_weight + fc2Outputs * fc2Inputs);
+        m->output_layer_biases.assign(fc2_bias, fc2_bias + fc2Outputs);
+        checkModelShape(m); // holds by the static_assert, sets the views
+        prepareSparse(m);
+        prepareFoldedInput(m);
+    } catch (const std::bad_alloc&) {
+        delete m;
+        return MNIST_ERR_NO_MEMORY;
+    }
+
+    *model = m;
+    return MNIST_OK;
+#else
+    return MNIST_ERR_UNSUPPORTED;
+#endif
+}
+
+
+int mnist_model_embedded_available(void) {
+#ifdef MNIST_EMBEDDED_MODEL
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+void mnist_model_free(mnist_model* model) {
+    delete model;
+}
+
+
+// Re-stores one layer, every conversion passes through fp32. Throws std::bad_alloc.
+static void convertLayer(mnist_model* model, int l, WeightFormat target) {
+    if (model->weightFormat[l] == target) {
+        return;
+    }
+
+    FloatBuffer& weights = model->layerWeights(l);
+    if (isHalfFormat(model->weightFormat[l])) {
+        const HalfBuffer& half = model->halfWeights[l];
+        weights.resize(half.size());
+        for (size_t i = 0; i < half.size(); ++i) {
+            weights[i] = model->weightFormat[l] == WEIGHTS_BF16 ? bfloat16ToFloat(half[i]) : halfToFloat(half[i]);
+        }
+        HalfBuffer().swap(model->halfWeights[l]);
+    } else if (isBitFormat(model->weightFormat[l])) {
+        const BitMatrix& bits = model->bitWeights[l];
+        weights.resize((size_t)bits.rows * bits.cols);
+        unpackBits(bits, weights.data());
+        model->bitWeights[l] = BitMatrix();
+    } else if (model->weightFormat[l] == WEIGHTS_LOW_RANK) {
+        const LowRankLayer& factors = model->lowRank[l];
+        weights.resize((size_t)factors.rows * factors.cols);
+        expandLowRank(factors, weights.data());
+        model->lowRank[l] = LowRankLayer();
+    }
+    // The layer is fp32 from here on, a throw below leaves it usable as such
+    model->weightFormat[l] = WEIGHTS_FP32;
+
+    if (isHalfFormat(target)) {
+        model->halfWeights[l].resize(weights.size());
+        convertWeights(weights.data(), weights.size(), target, model->halfWeights[l].data());
+        FloatBuffer().swap(weights); // the footprint halves only without the fp32 copy
+    } else if (isBitFormat(target)) {
+        int rows = (int)model->layerBiases(l).size();
+        quantizeToBits(viewOf(weights, rows, (int)(weights.size() / rows)), target == WEIGHTS_TERNARY,
+                       model->bitWeights[l]);
+        FloatBuffer().swap(weights);
+    }
+    model->weightFormat[l] = target;
+}
+
+
+// Replaces a layer with its truncated SVD at rank, from the fp32 weights it stands
+// for. Throws std::bad_alloc.
+static void factorizeLayer(mnist_model* model, int l, int rank) {
+    convertLayer(model, l, WEIGHTS_FP32);
+    FloatBuffer& weights = model->layerWeights(l);
+    int rows = (int)model->layerBiases(l).size();
+    factorizeLowRank(viewOf(weights, rows, (int)(weights.size() / rows)), rank, model->lowRank[l]);
+    FloatBuffer().swap(weights);
+    model->weightFormat[l] = WEIGHTS_LOW_RANK;
+}
+
+
+// Views, CSR and folded copies follow the formats after a conversion
+static mnist_status finishConversion(mnist_model* model) {
+    try {
+        checkModelShape(model);
+        prepareSparse(model);
+        prepareFoldedInput(model);
+    } catch (const std::bad_alloc&) {
+        return MNIST_ERR_NO_MEMORY;
+    }
+    return MNIST_OK;
+}
+
+
+// A conversion that ran out of memory may have converted some layers already, every
+// layer is left in a usable format (see convertLayer), the views are made to match it
+static mnist_status conversionFailed(mnist_model* model) {
+    finishConversion(model);
+    return MNIST_ERR_NO_MEMORY;
+}
+
+
+// fc2 reads the ReLU outputs of fc1, which are never negative: packed to bits they
+// would all be +1 and every image would get the same scores. Bits are for fc1 only.
+static bool formatFitsLayer(int layer, WeightFormat format) {
+    return layer == 0 || !isBitFormat(format);
+}
+
+
+mnist_status mnist_model_convert_weights(mnist_model* model, mnist_weight_format format) {
+    if (!model || format < MNIST_WEIGHTS_FP32 || format > MNIST_WEIGHTS_TERNARY) {
+        return MNIST_ERR_ARGUMENT;
+    }
+
+    try {
+        for (int l = 0; l < MNIST_NUM_LAYERS; ++l) {
+            convertLayer(model, l, formatFitsLayer(l, (WeightFormat)format) ? (WeightFormat)format : WEIGHTS_FP32);
+        }
+    } catch (const std::bad_alloc&) {
+        return conversionFailed(model);
+    }
+    return finishConversion(model);
+}
+
+
+mnist_status mnist_model_convert_layer(mnist_model* model, int layer, mnist_weight_format format) {
+    if (!model || layer < 0 || layer >= MNIST_NUM_LAYERS || format < MNIST_WEIGHTS_FP32 || format > MNIST_WEIGHTS_TERNARY ||
+        !formatFitsLayer(layer, (WeightFormat)format)) {
+        return MNIST_ERR_ARGUMENT;
+    }
+
+    try {
+        convertLayer(model, layer, (WeightFormat)format);
+    } catch (const std::bad_alloc&) {
+        return conversionFailed(model);
+    }
+    return finishConversion(model);
+}
+
+
+mnist_status mnist_model_factorize_layer(mnist_model* model, int layer, int rank) {
+    if (!model || layer < 0 || layer >= MNIST_NUM_LAYERS || rank < 1) {
+        return MNIST_ERR_ARGUMENT;
+    }
+
+    try {
+        factorizeLayer(model, layer, rank);
+    } catch (const std::bad_alloc&) {
+        return conversionFailed(model);
+    }
+    return finishConversion(model);
+}
+
+
+mnist_status mnist_model_get_rank(const mnist_model* model, int layer, int* rank) {
+    if (!model || !rank || layer < 0 || layer >= MNIST_NUM_LAYERS) {
+        return MNIST_ERR_ARGUMENT;
+    }
+    *rank = model->weightFormat[layer] == WEIGHTS_LOW_RANK ? model->lowRank[layer].rank : 0;
+    return MNIST_OK;
+}
+
+
+mnist_status mnist_model_get_weight_format(const mnist_model* model, int layer, mnist_weight_format* format) {
+    if (!model || !format || layer < 0 || layer >= MNIST_NUM_LAYERS) {
+        return MNIST_ERR_ARGUMENT;
+    }
+    *format = (mnist_weight_format)model->weightFormat[layer];
+    return MNIST_OK;
+}
+
+
+mnist_status mnist_model_get_density(const mnist_model* model, int layer, double* density) {
+    if (!model || !density || layer < 0 || layer >= MNIST_NUM_LAYERS) {
+        return MNIST_ERR_ARGUMENT;
+    }
+    *density = model->density[layer];
+    return MNIST_OK;
+}
+
+
+mnist_status mnist_context_create(const mnist_model* model, mnist_context** context) {
+    if (!model || !context) {
+        return MNIST_ERR_ARGUMENT;
+    }
+    *context = NULL;
+
+    void* memory = NULL;
+    size_t bytes = (sizeof(mnist_context) + cacheLineSize - 1) / cacheLineSize * cacheLineSize;
+    if (posix_memalign(&memory, cacheLineSize, bytes) != 0) {
+        return MNIST_ERR_NO_MEMORY;
+    }
+    mnist_context* c = new (memory) mnist_context();
+    c->model = model;
+    c->dataflow = WEIGHT_STATIONARY;
+    c->frame = 0;
+    for (int l = 0; l < MNIST_NUM_LAYERS; ++l) {
+        c->layerDataflow[l] = WEIGHT_STATIONARY;
+        c->layerTraffic[l] = DataflowTraffic();
+    }
+
+    // Exactly one image worth of activations, the shapes are checked here once
+    size_t scratchFloats = std::max(layerScratchFloats(model->hiddenSize, inputTileSize),
+                                    layerScratchFloats(MNIST_NUM_CLASSES, model->hiddenSize));
+    scratchFloats = std::max(scratchFloats, bitLayerScratchFloats(MNIST_IMAGE_SIZE));
+    scratchFloats = std::max(scratchFloats, gemmScratchFloats(model->hiddenSize, MNIST_IMAGE_SIZE));
+    scratchFloats = std::max(scratchFloats, gemmScratchFloats(MNIST_NUM_CLASSES, model->hiddenSize));
+    for (int l = 0; l < MNIST_NUM_LAYERS; ++l) {
+        scratchFloats = std::max(scratchFloats, lowRankScratchFloats(model->lowRank[l].rank));
+    }
+
+    try {
+        c->arena.reserve(ScratchArena::roundUp(MNIST_IMAGE_SIZE) + ScratchArena::roundUp(model->hiddenSize) +
+                         ScratchArena::roundUp(MNIST_NUM_CLASSES) + scratchFloats);
+        c->image = TensorView(c->arena.take(MNIST_IMAGE_SIZE), 1, MNIST_IMAGE_SIZE);
+        c->hidden = TensorView(c->arena.take(model->hiddenSize), 1, model->hiddenSize);
+        c->output = TensorView(c->arena.take(MNIST_NUM_CLASSES), 1, MNIST_NUM_CLASSES);
+    } catch (const std::bad_alloc&) {
+        mnist_context_free(c);
+        return MNIST_ERR_NO_MEMORY;
+    }
+
+    if (!layerShapesMatch(model, 0, c->image, c->hidden, inputTileSize) ||
+        !layerShapesMatch(model, 1, c->hidden, c->output, model->hiddenSize)) {
+        mnist_context_free(c);
+        return MNIST_ERR_SHAPE;
+    }
+
+    *context = c;
+    return MNIST_OK;
+}
+
+
+void mnist_context_free(mnist_context* context) {
+    if (context) {
+        context->~mnist_context();
+        free(context);
+    }
+}
+
+
+mnist_status mnist_context_set_dataflow(mnist_context* context, mnist_dataflow dataflow) {
+    if (!context || dataflow < MNIST_DATAFLOW_WEIGHT_STATIONARY || dataflow > MNIST_DATAFLOW_AUTO) {
+        return MNIST_ERR_ARGUMENT;
+    }
+    context->dataflow = (Dataflow)dataflow;
+    return MNIST_OK;
+}
+
+
+mnist_status mnist_infer_u8(mnist_context* context, const uint8_t* pixels,
+                            int* label, float* scores) {
+    if (!context || !pixels || !label) {
+        return MNIST_ERR_ARGUMENT;
+    }
+
+    long frame = context->frame++;
+
+    // Without scores only the label is needed, argmax of the logits gives it
+    HeadOutput out = { scores ? MNIST_HEAD_LOG_PROBABILITIES : MNIST_HEAD_LABEL, 0, label, scores, NULL };
+
+    try {
+        runModel(context, pixels, context->image, context->hidden, context->output, out, frame);
+    } catch (const std::bad_alloc&) {
+        metrics().failures++;
+        return MNIST_ERR_NO_MEMORY;
+    }
+
+    metrics().inferences++;
+    return MNIST_OK;
+}
+
+
+mnist_status mnist_infer_batch_u8(mnist_context* context, const uint8_t* pixels, int count,
+                                  int* labels, float* scores) {
+    if (!context || !pixels || !labels || count < 1) {
+        return MNIST_ERR_ARGUMENT;
+    }
+
+    long frame = context->frame;
+    context->frame += count;
+
+    HeadOutput out = { scores ? MNIST_HEAD_LOG_PROBABILITIES : MNIST_HEAD_LABEL, 0, labels, scores, NULL };
+
+    try {
+        runBatch(context, pixels, count, out, frame);
+    } catch (const std::bad_alloc&) {
+        metrics().failures++;
+        return MNIST_ERR_NO_MEMORY;
+    }
+
+    metrics().inferences += count;
+    return MNIST_OK;
+}
+
+
+mnist_status mnist_infer_head_u8(mnist_context* context, const uint8_t* pixels, int count,
+                                 mnist_head head, int k, mnist_result* results) {
+    if (!context || !pixels || !results || count < 1 || head < MNIST_HEAD_LABEL ||
+        head > MNIST_HEAD_LOG_PROBABILITIES || (head == MNIST_HEAD_TOP_K && (k < 1 || k > MNIST_NUM_CLASSES))) {
+        return MNIST_ERR_ARGUMENT;
+    }
+
+    long frame = context->frame;
+    context->frame += count;
+
+    HeadOutput out = { head, k, NULL, NULL, results };
+
+    try {
+        if (count == 1) {
+            runModel(context, pixels, context->image, context->hidden, context->output, out, frame);
+        } else {
+            runBatch(context, pixels, count, out, frame);
+        }
+    } catch (const std::bad_alloc&) {
+        metrics().failures++;
+        return MNIST_ERR_NO_MEMORY;
+    }
+
+    metrics().inferences += count;
+    return MNIST_OK;
+}
+
+
+mnist_status mnist_context_get_traffic(const mnist_context* context, int layer,
+                                       mnist_dataflow* dataflow, uint64_t* weight_bytes,
+                                       uint64_t* input_bytes, uint64_t* psum_bytes) {
+    if (!context || layer < 0 || layer >= MNIST_NUM_LAYERS) {
+        return MNIST_ERR_ARGUMENT;
+    }
+    const DataflowTraffic& traffic = context->layerTraffic[layer];
+    if (dataflow) *dataflow = (mnist_dataflow)context->layerDataflow[layer];
+    if (weight_bytes) *weight_bytes = traffic.weightBytes;
+    if (input_bytes) *input_bytes = traffic.inputBytes;
+    if (psum_bytes) *psum_bytes = traffic.psumBytes;
+    return MNIST_OK;
+}
+
+}
@@ -0,0 +1,189 @@
+#ifndef MNIST_INFER_H
+#define MNIST_INFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * C API of the MNIST inference library.
+ *
+ * A model is loaded (and optionally converted) once and is read-only afterwards. Every thread or stream
+ * creates its own context on the model, a context holds the scratch buffers of
+ * one inference at a time. Calls on different contexts may run concurrently
+ * and take no locks, all of them read the same cache aligned copy of the weights.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped when a call is added, existing calls keep their signature */
+#define MNIST_API_VERSION 8
+
+#define MNIST_IMAGE_WIDTH 28
+#define MNIST_IMAGE_HEIGHT 28
+#define MNIST_IMAGE_SIZE (MNIST_IMAGE_WIDTH * MNIST_IMAGE_HEIGHT)
+#define MNIST_NUM_CLASSES 10
+#define MNIST_NUM_LAYERS 2
+
+typedef struct mnist_model mnist_model;
+typedef struct mnist_context mnist_context;
+
+typedef enum {
+    MNIST_OK = 0,
+    MNIST_ERR_ARGUMENT,   /* NULL handle or out of range value */
+    MNIST_ERR_IO,         /* a model file could not be read */
+    MNIST_ERR_SHAPE,      /* the model files do not describe a 784 -> N -> 10 network */
+    MNIST_ERR_NO_MEMORY,
+    MNIST_ERR_UNSUPPORTED, /* not compiled into this build */
+    MNIST_ERR_NOT_FINITE   /* a weight or bias is NaN or infinite */
+} mnist_status;
+
+/* Loop order of the fully connected layers, see processTiles_CPU */
+typedef enum {
+    MNIST_DATAFLOW_WEIGHT_STATIONARY = 0,
+    MNIST_DATAFLOW_OUTPUT_STATIONARY,
+    MNIST_DATAFLOW_INPUT_STATIONARY,
+    MNIST_DATAFLOW_AUTO,
+    MNIST_DATAFLOW_SPARSE_CSR,   /* reported for pruned layers, cannot be requested */
+    MNIST_DATAFLOW_FOLDED_INPUT, /* reported for fc1 on raw pixels, cannot be requested */
+    MNIST_DATAFLOW_BLOCKED_GEMM  /* reported for dense layers run on a batch, cannot be requested */
+} mnist_dataflow;
+
+/*
+ * Element type of the stored weights, the 16-bit formats are widened to fp32 in the kernels.
+ * Binary and ternary layers (API version 7) keep one or two bits per weight and a scale per
+ * row, and binarize or ternarize their inputs to run on XNOR / AND and popcount.
+ * Low-rank layers (API version 8) keep two fp32 factors, see mnist_model_factorize_layer.
+ */
+typedef enum {
+    MNIST_WEIGHTS_FP32 = 0,
+    MNIST_WEIGHTS_FP16,
+    MNIST_WEIGHTS_BF16,
+    MNIST_WEIGHTS_BINARY,
+    MNIST_WEIGHTS_TERNARY,
+    MNIST_WEIGHTS_LOW_RANK  /* from mnist_model_factorize_layer or a .lr file, cannot be converted to */
+} mnist_weight_format;
+
+/* What the caller wants from the output layer, only that much is computed */
+typedef enum {
+    MNIST_HEAD_LABEL = 0,        /* argmax of the logits, no softmax at all */
+    MNIST_HEAD_TOP_K,            /* the k most likely classes, best first, with log-probabilities */
+    MNIST_HEAD_PROBABILITIES,    /* softmax over every class */
+    MNIST_HEAD_LOG_PROBABILITIES /* log_softmax over every class, what mnist_infer_u8 returns */
+} mnist_head;
+
+/* One image through a head. scores[i] belongs to classes[i], count is 0 for MNIST_HEAD_LABEL,
+ * k for MNIST_HEAD_TOP_K and MNIST_NUM_CLASSES (classes in order) otherwise. */
+typedef struct {
+    int label;
+    int count;
+    int classes[MNIST_NUM_CLASSES];
+    float scores[MNIST_NUM_CLASSES];
+} mnist_result;
+
+int mnist_api_version(void);
+const char* mnist_status_string(mnist_status status);
+
+/*
+ * Loads fc1 and fc2 from the raw float32 files written by TrainNN.ipynb.
+ * Weight files named *.f16 or *.bf16 (half_weights.py) hold 16-bit weights
+ * and stay 16-bit in memory, *.b1 and *.t2 (bitpack_weights.py) hold binary and
+ * ternary weights, *.lr (lowrank_weights.py) the two factors of a low-rank layer.
+ * The bias files are always float32.
+ */
+mnist_status mnist_model_load(const char* fc1_weights_path, const char* fc1_bias_path,
+                              const char* fc2_weights_path, const char* fc2_bias_path,
+                              mnist_model** model);
+
+/*
+ * Uses the weights compiled in from model_weights.h, no file is read.
+ * Returns MNIST_ERR_UNSUPPORTED unless the library was built with
+ * -DMNIST_EMBEDDED_MODEL (make EMBED_MODEL=1). Added in API version 3.
+ */
+mnist_status mnist_model_load_embedded(mnist_model** model);
+int mnist_model_embedded_available(void);
+
+void mnist_model_free(mnist_model* model);
+
+/*
+ * Fraction of non-zero weights in a layer (0 = fc1, 1 = fc2). Layers pruned to
+ * at most half their weights (prune_weights.py) run from a CSR copy made at
+ * load time whatever dataflow the context asks for. Added in API version 4.
+ */
+mnist_status mnist_model_get_density(const mnist_model* model, int layer, double* density);
+
+/*
+ * Re-stores every layer in the given format, the previous copy is freed. Call it
+ * before creating contexts on the model. fp16 and bf16 layers are not run from a
+ * CSR copy. Binary and ternary quantize fc1 only and store fc2 as fp32, see
+ * mnist_model_convert_layer. Added in API version 5.
+ */
+mnist_status mnist_model_convert_weights(mnist_model* model, mnist_weight_format format);
+
+/*
+ * mnist_model_convert_weights for one layer (0 = fc1, 1 = fc2), e.g. a ternary fc1 in
+ * front of an fp32 fc2. Binary and ternary conversion is lossy, converting back gives
+ * the quantized values. fc2 cannot be binary or ternary (MNIST_ERR_ARGUMENT): its
+ * inputs come out of a ReLU, packed to bits they are all +1. Added in API version 7.
+ */
+mnist_status mnist_model_convert_layer(mnist_model* model, int layer, mnist_weight_format format);
+mnist_status mnist_model_get_weight_format(const mnist_model* model, int layer, mnist_weight_format* format);
+
+/*
+ * Replaces a layer (0 = fc1, 1 = fc2) of rows x cols weights with its truncated SVD,
+ * a rank x cols and a rows x rank factor run one after the other. rank is clamped to
+ * min(rows, cols); multiply-adds and weight bytes go from rows cols to rank (rows + cols).
+ * Lossy below full rank, mnist_model_convert_layer to fp32 gives the product back.
+ * mnist_model_get_rank gives 0 for layers that are not factorized. Added in API version 8.
+ */
+mnist_status mnist_model_factorize_layer(mnist_model* model, int layer, int rank);
+mnist_status mnist_model_get_rank(const mnist_model* model, int layer, int* rank);
+
+/* The model must outlive every context created on it */
+mnist_status mnist_context_create(const mnist_model* model, mnist_context** context);
+void mnist_context_free(mnist_context* context);
+
+/*
+ * With MNIST_DATAFLOW_AUTO a dense fp32 fc1 runs on the raw pixels, with the input
+ * normalization folded into a copy of its weights when the model loads. The other
+ * schedules normalize the image into floats first.
+ */
+mnist_status mnist_context_set_dataflow(mnist_context* context, mnist_dataflow dataflow);
+
+/*
+ * Classifies one 28x28 grayscale image, rows top to bottom.
+ * scores receives MNIST_NUM_CLASSES log-probabilities and may be NULL,
+ * the softmax is skipped when it is.
+ */
+mnist_status mnist_infer_u8(mnist_context* context, const uint8_t* pixels,
+                            int* label, float* scores);
+
+/*
+ * Classifies count images stored back to back (count x MNIST_IMAGE_SIZE) in one pass,
+ * each weight tile is read once for the whole batch. labels receives count entries,
+ * scores count x MNIST_NUM_CLASSES log-probabilities and may be NULL.
+ * Added in API version 2.
+ */
+mnist_status mnist_infer_batch_u8(mnist_context* context, const uint8_t* pixels, int count,
+                                  int* labels, float* scores);
+
+/*
+ * Classifies count images (count x MNIST_IMAGE_SIZE) like mnist_infer_batch_u8 and
+ * runs the chosen head on each, results receives count entries. k is the number of
+ * classes for MNIST_HEAD_TOP_K (1 .. MNIST_NUM_CLASSES) and ignored otherwise.
+ * Added in API version 6.
+ */
+mnist_status mnist_infer_head_u8(mnist_context* context, const uint8_t* pixels, int count,
+                                 mnist_head head, int k, mnist_result* results);
+
+/* Bytes moved by the last inference of a layer (0 = fc1, 1 = fc2) and the schedule that ran */
+mnist_status mnist_context_get_traffic(const mnist_context* context, int layer,
+                                       mnist_dataflow* dataflow, uint64_t* weight_bytes,
+                                       uint64_t* input_bytes, uint64_t* psum_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef MODEL_RELOADER_H
+#define MODEL_RELOADER_H
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mnist_infer.h"
+#include "metrics.h"
+#include "trace.h"
+
+
+// Keeps the model of the long running modes current with the model files.
+//
+// The model in use is published through an atomically swapped shared_ptr. A reader
+// takes a snapshot with current() and keeps it for as long as it runs on those
+// weights. A swap never waits for readers and never touches a model they hold; the
+// old model is freed by whichever holder lets go of it last. In-flight inferences
+// therefore finish on the weights they started with, read-copy-update style with
+// reference counts standing in for grace periods.
+//
+// The watcher thread polls the size and modification time of the files. A change is
+// loaded once the files have looked the same for one more poll, so a file that is
+// still being written is not picked up half way. New weights must load, pass the
+// shape checks and give finite scores for a blank image before they are swapped in,
+// otherwise the current model stays and the failure is counted.
+
+typedef std::shared_ptr<mnist_model> ModelPtr;
+
+class ModelReloader {
+public:
+    typedef std::function<bool(mnist_model**)> Loader;
+
+    // initial stays owned by the caller, models loaded later are freed here
+    explicit ModelReloader(mnist_model* initial)
+        : current_(initial, [](mnist_model*) {}), intervalMs_(500), running_(false) {}
+
+    ~ModelReloader() { stop(); }
+
+    ModelPtr current() const { return std::atomic_load(&current_); }
+
+    // Starts the watcher thread on paths, loader builds a new model from them
+    bool watch(std::vector<std::string> paths, Loader loader, int intervalMs) {
+        paths_.swap(paths);
+        loader_ = loader;
+        intervalMs_ = intervalMs;
+        running_ = true;
+        watcher_ = std::thread(&ModelReloader::watchLoop, this);
+        return true;
+    }
+
+    void stop() {
+        if (!running_) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+        }
+        wake_.notify_all();
+        watcher_.join();
+    }
+
+    // Loads and validates the files once, swaps the result in when it passes
+    bool reload() {
+        TraceSpan span("model_reload", "io", (long)metrics().modelReloads.load());
+
+        mnist_model* loaded = NULL;
+        if (!loader_(&loaded) || !validate(loaded)) {
+            mnist_model_free(loaded);
+            metrics().modelReloadFailures++;
+            fprintf(stderr, "Model files changed but did not load, keeping the current weights\n");
+            return false;
+        }
+
+        std::atomic_store(&current_, ModelPtr(loaded, mnist_model_free));
+        metrics().modelReloads++;
+        HOT_PRINTF("model reloaded\n"); // also counted as modelReloads
+        return true;
+    }
+
+private:
+    struct FileStamp {
+        bool exists;
+        long long size;
+        long long mtimeNs;
+
+        bool operator==(const FileStamp& other) const {
+            return exists == other.exists && size == other.size && mtimeNs == other.mtimeNs;
+        }
+        bool operator!=(const FileStamp& other) const { return !(*this == other); }
+    };
+
+    std::vector<FileStamp> stamp() const {
+        std::vector<FileStamp> stamps(paths_.size());
+        for (size_t i = 0; i < paths_.size(); ++i) {
+            struct stat st;
+            stamps[i].exists = stat(paths_[i].c_str(), &st) == 0;
+            stamps[i].size = stamps[i].exists ? (long long)st.st_size : 0;
+            stamps[i].mtimeNs = stamps[i].exists ? (long long)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec : 0;
+        }
+        return stamps;
+    }
+
+    // A blank image must come out as finite log-probabilities, NaN or inf weights do not
+    static bool validate(const mnist_model* model) {
+        mnist_context* context = NULL;
+        if (mnist_context_create(model, &context) != MNIST_OK) {
+            return false;
+        }
+        uint8_t blank[MNIST_IMAGE_SIZE] = {0};
+        int label = -1;
+        float scores[MNIST_NUM_CLASSES];
+        bool ok = mnist_infer_u8(context, blank, &label, scores) == MNIST_OK;
+        for (int c = 0; ok && c < MNIST_NUM_CLASSES; ++c) {
+            ok = std::isfinite(scores[c]);
+        }
+        mnist_context_free(context);
+        return ok;
+    }
+
+    void watchLoop() {
+        std::vector<FileStamp> loaded = stamp(); // the files behind the current model
+        std::vector<FileStamp> previous = loaded;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (running_) {
+            wake_.wait_for(lock, std::chrono::milliseconds(intervalMs_));
+            if (!running_) {
+                break;
+            }
+
+            std::vector<FileStamp> now = stamp();
+            bool settled = now == previous;
+            previous = now;
+            if (now == loaded || !settled) {
+                continue;
+            }
+
+            // A failed version is not retried until the files change again
+            lock.unlock();
+            reload();
+            lock.lock();
+            loaded = now;
+        }
+    }
+
+    ModelPtr current_; // only accessed through std::atomic_load / std::atomic_store
+    std::vector<std::string> paths_;
+    Loader loader_;
+    int intervalMs_;
+
+    bool running_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::thread watcher_;
+};
+
+
+// A context that moves to the newest model between inferences. get() hands out a
+// context on the snapshot it holds and only replaces the snapshot on the next call,
+// after the caller's previous inference has finished with it.
+class ReloadingContext {
+public:
+    ReloadingContext(ModelReloader& reloader, mnist_dataflow dataflow)
+        : reloader_(reloader), dataflow_(dataflow), context_(NULL) {}
+
+    ~ReloadingContext() { mnist_context_free(context_); }
+
+    // NULL only when no context could be created on any model yet
+    mnist_context* get() {
+        ModelPtr latest = reloader_.current();
+        if (latest != model_) {
+            mnist_context* fresh = NULL;
+            if (mnist_context_create(latest.get(), &fresh) == MNIST_OK) {
+                mnist_context_set_dataflow(fresh, dataflow_);
+                mnist_context_free(context_);
+                context_ = fresh;
+                model_ = latest; // the old model is freed here when no other reader holds it
+            }
+        }
+        return context_;
+    }
+
+private:
+    ReloadingContext(const ReloadingContext&);
+    ReloadingContext& operator=(const ReloadingContext&);
+
+    ModelReloader& reloader_;
+    mnist_dataflow dataflow_;
+    ModelPtr model_;
+    mnist_context* context_;
+};
+
+#endif
@@ -0,0 +1,2401 @@
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <cmath>
+#include <float.h>
+#if defined(__AVX2__) || defined(__F16C__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "nn_layers.h"
+
+
+// Activations
+//
+// Every activation takes an input and an output pointer that may be the same, so it
+// runs in place or into a buffer of the caller, and none of them allocates. The loops
+// are written once against the FloatVec helpers below: 8 lanes with AVX2, 4 with
+// SSE2 or NEON. Targets without either keep scalar libm calls, one element at a time
+// the polynomial is no faster than a table driven expf.
+//
+// fastExp is a Cephes style exp: x = n ln2 + r with |r| <= ln2/2, exp(r) from a
+// degree 6 polynomial and 2^n built in the exponent bits. Over [-87, 88.7] it is
+// within 1 ulp of exp (relative error below 1.2e-7), inputs below -87 give 0 and
+// inputs above 88.72 saturate to about FLT_MAX. Denormal results are avoided, they
+// cost a microcode assist per lane on x86. fastLog reduces x
+// to m 2^e with m in [sqrt(0.5), sqrt(2)) and evaluates a degree 9 polynomial in
+// m - 1, within 1 ulp of log for normal positive x, other inputs go to std::log.
+// -activation_report measures both bounds and the speed-up over libm.
+
+static const float expUpper = 88.7228391f;       // log(FLT_MAX)
+static const float expLower = -87.0f;             // just above log(FLT_MIN), no lane goes denormal
+static const float log2e = 1.44269504088896341f;
+static const float ln2Hi = 0.693359375f;         // ln2 in two parts, n * ln2Hi is exact
+static const float ln2Lo = -2.12194440e-4f;
+static const float expP0 = 1.9875691500e-4f;
+static const float expP1 = 1.3981999507e-3f;
+static const float expP2 = 8.3334519073e-3f;
+static const float expP3 = 4.1665795894e-2f;
+static const float expP4 = 1.6666665459e-1f;
+static const float expP5 = 5.0000001201e-1f;
+
+static inline float pow2(int n) {
+    uint32_t bits = (uint32_t)(n + 127) << 23;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+float fastExp(float x) {
+    if (x < expLower) {
+        return 0.0f;
+    }
+    x = std::min(x, expUpper);
+    float n = std::floor(x * log2e + 0.5f);
+    float r = x - n * ln2Hi - n * ln2Lo;
+    float y = ((((expP0 * r + expP1) * r + expP2) * r + expP3) * r + expP4) * r + expP5;
+    y = y * r * r + r + 1.0f;
+    // 2^n in two factors, n reaches 128 at the top of the range
+    int half = (int)n / 2;
+    return y * pow2(half) * pow2((int)n - half);
+}
+
+float fastLog(float x) {
+    if (!(x >= FLT_MIN && x <= FLT_MAX)) {
+        return std::log(x);
+    }
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int e = (int)(bits >> 23) - 126;
+    bits = (bits & 0x807fffffu) | 0x3f000000u; // m in [0.5, 1)
+    float m;
+    memcpy(&m, &bits, sizeof(m));
+    if (m < 0.707106781186547524f) {
+        e -= 1;
+        m = m + m - 1.0f;
+    } else {
+        m = m - 1.0f;
+    }
+    float z = m * m;
+    float y = (((((((( 7.0376836292e-2f * m - 1.1514610310e-1f) * m + 1.1676998740e-1f) * m
+              - 1.2420140846e-1f) * m + 1.4249322787e-1f) * m - 1.6668057665e-1f) * m
+              + 2.0000714765e-1f) * m - 2.4999993993e-1f) * m + 3.3333331174e-1f) * m * z;
+    y += ln2Lo * e - 0.5f * z;
+    return m + y + ln2Hi * e;
+}
+
+
+#if defined(__AVX2__)
+typedef __m256 FloatVec;
+static const size_t floatVecWidth = 8;
+static inline FloatVec vecLoad(const float* p) { return _mm256_loadu_ps(p); }
+static inline void vecStore(float* p, FloatVec v) { _mm256_storeu_ps(p, v); }
+static inline FloatVec vecSet(float x) { return _mm256_set1_ps(x); }
+static inline FloatVec vecAdd(FloatVec a, FloatVec b) { return _mm256_add_ps(a, b); }
+static inline FloatVec vecSub(FloatVec a, FloatVec b) { return _mm256_sub_ps(a, b); }
+static inline FloatVec vecMul(FloatVec a, FloatVec b) { return _mm256_mul_ps(a, b); }
+static inline FloatVec vecDiv(FloatVec a, FloatVec b) { return _mm256_div_ps(a, b); }
+static inline FloatVec vecMin(FloatVec a, FloatVec b) { return _mm256_min_ps(a, b); }
+static inline FloatVec vecMax(FloatVec a, FloatVec b) { return _mm256_max_ps(a, b); } // b when a is NaN
+// a b + c, fused when the target has FMA
+#ifdef __FMA__
+static inline FloatVec vecMulAdd(FloatVec a, FloatVec b, FloatVec c) { return _mm256_fmadd_ps(a, b, c); }
+#else
+static inline FloatVec vecMulAdd(FloatVec a, FloatVec b, FloatVec c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+#endif
+static inline FloatVec vecFloor(FloatVec a) { return _mm256_floor_ps(a); }
+// x > 0 ? a : b, lane by lane
+static inline FloatVec vecSelectPositive(FloatVec x, FloatVec a, FloatVec b) {
+    return _mm256_blendv_ps(b, a, _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ));
+}
+// value, with the lanes where x < limit set to 0
+static inline FloatVec vecZeroBelow(FloatVec value, FloatVec x, FloatVec limit) {
+    return _mm256_andnot_ps(_mm256_cmp_ps(x, limit, _CMP_LT_OQ), value);
+}
+// Bit i set where lane i of x < limit
+static inline unsigned vecMaskBelow(FloatVec x, FloatVec limit) {
+    return (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(x, limit, _CMP_LT_OQ));
+}
+// 2^n for integral n in [-126, 128], in two factors like fastExp
+static inline FloatVec vecPow2(FloatVec n) {
+    __m256i whole = _mm256_cvtps_epi32(n);
+    __m256i half = _mm256_srai_epi32(whole, 1);
+    __m256i bias = _mm256_set1_epi32(127);
+    FloatVec a = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(half, bias), 23));
+    FloatVec b = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_sub_epi32(whole, half), bias), 23));
+    return _mm256_mul_ps(a, b);
+}
+static inline float vecSum(FloatVec v) {
+    __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+    return _mm_cvtss_f32(_mm_add_ss(sum4, _mm_shuffle_ps(sum4, sum4, 1)));
+}
+static inline float vecMaxElement(FloatVec v) {
+    __m128 max4 = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    max4 = _mm_max_ps(max4, _mm_movehl_ps(max4, max4));
+    return _mm_cvtss_f32(_mm_max_ss(max4, _mm_shuffle_ps(max4, max4, 1)));
+}
+#define FLOAT_VEC 1
+#elif defined(__SSE2__)
+// Every x86-64 build without -mavx2
+typedef __m128 FloatVec;
+static const size_t floatVecWidth = 4;
+static inline FloatVec vecLoad(const float* p) { return _mm_loadu_ps(p); }
+static inline void vecStore(float* p, FloatVec v) { _mm_storeu_ps(p, v); }
+static inline FloatVec vecSet(float x) { return _mm_set1_ps(x); }
+static inline FloatVec vecAdd(FloatVec a, FloatVec b) { return _mm_add_ps(a, b); }
+static inline FloatVec vecSub(FloatVec a, FloatVec b) { return _mm_sub_ps(a, b); }
+static inline FloatVec vecMul(FloatVec a, FloatVec b) { return _mm_mul_ps(a, b); }
+static inline FloatVec vecDiv(FloatVec a, FloatVec b) { return _mm_div_ps(a, b); }
+static inline FloatVec vecMin(FloatVec a, FloatVec b) { return _mm_min_ps(a, b); }
+static inline FloatVec vecMax(FloatVec a, FloatVec b) { return _mm_max_ps(a, b); }
+static inline FloatVec vecMulAdd(FloatVec a, FloatVec b, FloatVec c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+static inline FloatVec vecFloor(FloatVec a) {
+    FloatVec truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+    return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, a), _mm_set1_ps(1.0f)));
+}
+static inline FloatVec vecSelectPositive(FloatVec x, FloatVec a, FloatVec b) {
+    FloatVec positive = _mm_cmpgt_ps(x, _mm_setzero_ps());
+    return _mm_or_ps(_mm_and_ps(positive, a), _mm_andnot_ps(positive, b));
+}
+static inline FloatVec vecZeroBelow(FloatVec value, FloatVec x, FloatVec limit) {
+    return _mm_andnot_ps(_mm_cmplt_ps(x, limit), value);
+}
+static inline unsigned vecMaskBelow(FloatVec x, FloatVec limit) {
+    return (unsigned)_mm_movemask_ps(_mm_cmplt_ps(x, limit));
+}
+static inline FloatVec vecPow2(FloatVec n) {
+    __m128i whole = _mm_cvtps_epi32(n);
+    __m128i half = _mm_srai_epi32(whole, 1);
+    __m128i bias = _mm_set1_epi32(127);
+    FloatVec a = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(half, bias), 23));
+    FloatVec b = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_sub_epi32(whole, half), bias), 23));
+    return _mm_mul_ps(a, b);
+}
+static inline float vecSum(FloatVec v) {
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    return _mm_cvtss_f32(_mm_add_ss(v, _mm_shuffle_ps(v, v, 1)));
+}
+static inline float vecMaxElement(FloatVec v) {
+    v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+    return _mm_cvtss_f32(_mm_max_ss(v, _mm_shuffle_ps(v, v, 1)));
+}
+#define FLOAT_VEC 1
+#elif defined(__ARM_NEON)
+typedef float32x4_t FloatVec;
+static const size_t floatVecWidth = 4;
+static inline FloatVec vecLoad(const float* p) { return vld1q_f32(p); }
+static inline void vecStore(float* p, FloatVec v) { vst1q_f32(p, v); }
+static inline FloatVec vecSet(float x) { return vdupq_n_f32(x); }
+static inline FloatVec vecAdd(FloatVec a, FloatVec b) { return vaddq_f32(a, b); }
+static inline FloatVec vecSub(FloatVec a, FloatVec b) { return vsubq_f32(a, b); }
+static inline FloatVec vecMul(FloatVec a, FloatVec b) { return vmulq_f32(a, b); }
+// ARMv7 has no vector divide, the reciprocal estimate is refined by two Newton steps
+static inline FloatVec vecDiv(FloatVec a, FloatVec b) {
+    FloatVec inverse = vrecpeq_f32(b);
+    inverse = vmulq_f32(vrecpsq_f32(b, inverse), inverse);
+    inverse = vmulq_f32(vrecpsq_f32(b, inverse), inverse);
+    return vmulq_f32(a, inverse);
+}
+static inline FloatVec vecMin(FloatVec a, FloatVec b) { return vminq_f32(a, b); }
+// vmaxq_f32 passes NaN on, the select keeps max(NaN, b) == b like std::max(b, NaN)
+static inline FloatVec vecMax(FloatVec a, FloatVec b) { return vbslq_f32(vcgtq_f32(a, b), a, b); }
+#ifdef __aarch64__
+static inline FloatVec vecMulAdd(FloatVec a, FloatVec b, FloatVec c) { return vfmaq_f32(c, a, b); }
+#else
+static inline FloatVec vecMulAdd(FloatVec a, FloatVec b, FloatVec c) { return vmlaq_f32(c, a, b); }
+#endif
+static inline FloatVec vecFloor(FloatVec a) {
+    FloatVec truncated = vcvtq_f32_s32(vcvtq_s32_f32(a));
+    uint32x4_t above = vcgtq_f32(truncated, a);
+    return vsubq_f32(truncated, vreinterpretq_f32_u32(vandq_u32(above, vreinterpretq_u32_f32(vdupq_n_f32(1.0f)))));
+}
+static inline FloatVec vecSelectPositive(FloatVec x, FloatVec a, FloatVec b) {
+    return vbslq_f32(vcgtq_f32(x, vdupq_n_f32(0.0f)), a, b);
+}
+static inline FloatVec vecZeroBelow(FloatVec value, FloatVec x, FloatVec limit) {
+    return vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(value), vcltq_f32(x, limit)));
+}
+static inline unsigned vecMaskBelow(FloatVec x, FloatVec limit) {
+    static const int32_t shifts[4] = {0, 1, 2, 3};
+    uint32x4_t bits = vshlq_u32(vshrq_n_u32(vcltq_f32(x, limit), 31), vld1q_s32(shifts));
+    uint32x2_t sum2 = vadd_u32(vget_low_u32(bits), vget_high_u32(bits));
+    return vget_lane_u32(vpadd_u32(sum2, sum2), 0);
+}
+static inline FloatVec vecPow2(FloatVec n) {
+    int32x4_t whole = vcvtq_s32_f32(n);
+    int32x4_t half = vshrq_n_s32(whole, 1);
+    int32x4_t bias = vdupq_n_s32(127);
+    FloatVec a = vreinterpretq_f32_s32(vshlq_n_s32(vaddq_s32(half, bias), 23));
+    FloatVec b = vreinterpretq_f32_s32(vshlq_n_s32(vaddq_s32(vsubq_s32(whole, half), bias), 23));
+    return vmulq_f32(a, b);
+}
+static inline float vecSum(FloatVec v) {
+    float32x2_t sum2 = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+    return vget_lane_f32(vpadd_f32(sum2, sum2), 0);
+}
+static inline float vecMaxElement(FloatVec v) {
+    float32x2_t max2 = vmax_f32(vget_low_f32(v), vget_high_f32(v));
+    return vget_lane_f32(vpmax_f32(max2, max2), 0);
+}
+#define FLOAT_VEC 1
+#endif
+
+#ifdef FLOAT_VEC
+// The last 0 < count < floatVecWidth elements as one vector, the other lanes set to fill
+#if defined(__AVX2__)
+static inline __m256i laneMask(size_t count) {
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32((int)count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+static inline FloatVec vecLoadPartial(const float* p, size_t count, float fill) {
+    __m256i mask = laneMask(count);
+    return _mm256_blendv_ps(_mm256_set1_ps(fill), _mm256_maskload_ps(p, mask), _mm256_castsi256_ps(mask));
+}
+
+static inline void vecStorePartial(float* p, FloatVec v, size_t count) {
+    _mm256_maskstore_ps(p, laneMask(count), v);
+}
+#elif defined(__SSE2__)
+// Built in registers, a vector load of lanes just stored one by one stalls on store forwarding
+static inline FloatVec vecLoadPartial(const float* p, size_t count, float fill) {
+    return _mm_setr_ps(p[0], count > 1 ? p[1] : fill, count > 2 ? p[2] : fill, fill);
+}
+
+static inline void vecStorePartial(float* p, FloatVec v, size_t count) {
+    _mm_store_ss(p, v);
+    if (count > 1) {
+        _mm_store_ss(p + 1, _mm_shuffle_ps(v, v, 1));
+    }
+    if (count > 2) {
+        _mm_store_ss(p + 2, _mm_shuffle_ps(v, v, 2));
+    }
+}
+#else
+static inline FloatVec vecLoadPartial(const float* p, size_t count, float fill) {
+    FloatVec v = vdupq_n_f32(fill);
+    v = vsetq_lane_f32(p[0], v, 0);
+    if (count > 1) {
+        v = vsetq_lane_f32(p[1], v, 1);
+    }
+    if (count > 2) {
+        v = vsetq_lane_f32(p[2], v, 2);
+    }
+    return v;
+}
+
+static inline void vecStorePartial(float* p, FloatVec v, size_t count) {
+    vst1q_lane_f32(p, v, 0);
+    if (count > 1) {
+        vst1q_lane_f32(p + 1, v, 1);
+    }
+    if (count > 2) {
+        vst1q_lane_f32(p + 2, v, 2);
+    }
+}
+#endif
+
+// fastExp on every lane
+static inline FloatVec vecExp(FloatVec x) {
+    FloatVec lower = vecSet(expLower);
+    FloatVec clamped = vecMin(vecMax(x, lower), vecSet(expUpper));
+    FloatVec n = vecFloor(vecAdd(vecMul(clamped, vecSet(log2e)), vecSet(0.5f)));
+    FloatVec r = vecSub(vecSub(clamped, vecMul(n, vecSet(ln2Hi))), vecMul(n, vecSet(ln2Lo)));
+    FloatVec y = vecAdd(vecMul(vecSet(expP0), r), vecSet(expP1));
+    y = vecAdd(vecMul(y, r), vecSet(expP2));
+    y = vecAdd(vecMul(y, r), vecSet(expP3));
+    y = vecAdd(vecMul(y, r), vecSet(expP4));
+    y = vecAdd(vecMul(y, r), vecSet(expP5));
+    y = vecAdd(vecAdd(vecMul(vecMul(y, r), r), r), vecSet(1.0f));
+    return vecZeroBelow(vecMul(y, vecPow2(n)), x, lower);
+}
+#endif
+
+
+static float maxElement(const float* v, size_t n) {
+    size_t i = 0;
+    float result = v[0];
+#ifdef FLOAT_VEC
+    if (n >= floatVecWidth) {
+        FloatVec max = vecLoad(v);
+        for (i = floatVecWidth; i + floatVecWidth <= n; i += floatVecWidth) {
+            max = vecMax(vecLoad(v + i), max);
+        }
+        result = vecMaxElement(max);
+    }
+#endif
+    for (; i < n; ++i) {
+        result = std::max(result, v[i]);
+    }
+    return result;
+}
+
+// out[i] = exp(in[i] - shift) and the sum of them, nothing is stored when out is NULL.
+// A short tail runs as one padded vector, a row of 10 would otherwise spend most of
+// its time in two scalar exps.
+static float expShifted(const float* in, float* out, size_t n, float shift) {
+    size_t i = 0;
+    float sum = 0.0f;
+#ifdef FLOAT_VEC
+    FloatVec shiftVec = vecSet(shift);
+    FloatVec sumVec = vecSet(0.0f);
+    for (; i + floatVecWidth <= n; i += floatVecWidth) {
+        FloatVec e = vecExp(vecSub(vecLoad(in + i), shiftVec));
+        sumVec = vecAdd(sumVec, e);
+        if (out) {
+            vecStore(out + i, e);
+        }
+    }
+    if (i < n) {
+        // -FLT_MAX lanes come out as exp 0 and add nothing
+        FloatVec e = vecExp(vecSub(vecLoadPartial(in + i, n - i, -FLT_MAX), shiftVec));
+        sumVec = vecAdd(sumVec, e);
+        if (out) {
+            vecStorePartial(out + i, e, n - i);
+        }
+    }
+    sum = vecSum(sumVec);
+#else
+    for (; i < n; ++i) {
+        float e = std::exp(in[i] - shift);
+        sum += e;
+        if (out) {
+            out[i] = e;
+        }
+    }
+#endif
+    return sum;
+}
+
+// out[i] = (in[i] + add) * scale
+static void addScale(const float* in, float* out, size_t n, float add, float scale) {
+    size_t i = 0;
+#ifdef FLOAT_VEC
+    FloatVec addVec = vecSet(add);
+    FloatVec scaleVec = vecSet(scale);
+    for (; i + floatVecWidth <= n; i += floatVecWidth) {
+        vecStore(out + i, vecMul(vecAdd(vecLoad(in + i), addVec), scaleVec));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = (in[i] + add) * scale;
+    }
+}
+
+
+void relu(const float* in, float* out, size_t n) {
+    size_t i = 0;
+#ifdef FLOAT_VEC
+    FloatVec zero = vecSet(0.0f);
+    for (; i + floatVecWidth <= n; i += floatVecWidth) {
+        vecStore(out + i, vecMax(vecLoad(in + i), zero));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = std::max(0.0f, in[i]);
+    }
+}
+
+void leakyRelu(const float* in, float* out, size_t n, float slope) {
+    size_t i = 0;
+#ifdef FLOAT_VEC
+    FloatVec slopeVec = vecSet(slope);
+    for (; i + floatVecWidth <= n; i += floatVecWidth) {
+        FloatVec x = vecLoad(in + i);
+        vecStore(out + i, vecSelectPositive(x, x, vecMul(x, slopeVec)));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = in[i] > 0.0f ? in[i] : in[i] * slope;
+    }
+}
+
+void sigmoid(const float* in, float* out, size_t n) {
+    size_t i = 0;
+#ifdef FLOAT_VEC
+    FloatVec one = vecSet(1.0f);
+    FloatVec zero = vecSet(0.0f);
+    for (; i + floatVecWidth <= n; i += floatVecWidth) {
+        FloatVec e = vecExp(vecSub(zero, vecLoad(in + i)));
+        vecStore(out + i, vecDiv(one, vecAdd(one, e)));
+    }
+    if (i < n) {
+        FloatVec e = vecExp(vecSub(zero, vecLoadPartial(in + i, n - i, 0.0f)));
+        vecStorePartial(out + i, vecDiv(one, vecAdd(one, e)), n - i);
+    }
+#else
+    for (; i < n; ++i) {
+        out[i] = 1.0f / (1.0f + std::exp(-in[i]));
+    }
+#endif
+}
+
+void softmax(const float* in, float* out, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    float sum = expShifted(in, out, n, maxElement(in, n));
+    addScale(out, out, n, 0.0f, 1.0f / sum);
+}
+
+void log_softmax(const float* in, float* out, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    // log(exp(x - max) / sum) = x - max - log(sum), the exponentials are only summed
+    float maxValue = maxElement(in, n);
+    float logSum = fastLog(expShifted(in, NULL, n, maxValue));
+    addScale(in, out, n, -(maxValue + logSum), 1.0f);
+}
+
+float logSumExp(const float* v, size_t n) {
+    float maxValue = maxElement(v, n);
+    return maxValue + fastLog(expShifted(v, NULL, n, maxValue));
+}
+
+void relu(float* v, size_t n) {
+    relu(v, v, n);
+}
+
+void leakyRelu(float* v, size_t n, float slope) {
+    leakyRelu(v, v, n, slope);
+}
+
+void sigmoid(float* v, size_t n) {
+    sigmoid(v, v, n);
+}
+
+void softmax(float* v, size_t n) {
+    softmax(v, v, n);
+}
+
+void log_softmax(float* v, size_t n) {
+    log_softmax(v, v, n);
+}
+
+void log_softmax(FloatBuffer& v) {
+    log_softmax(v.data(), v.size());
+}
+
+
+void normalizeImage(const unsigned char* imageData, size_t imageSize, FloatBuffer& normalizedImage) {
+    normalizedImage.resize(imageSize);
+    normalizeImage(imageData, imageSize, normalizedImage.data());
+}
+
+void normalizeImage(const unsigned char* imageData, TensorView normalizedImage) {
+    for (int r = 0; r < normalizedImage.rows; ++r) {
+        normalizeImage(imageData + (size_t)r * normalizedImage.cols, normalizedImage.cols, normalizedImage.row(r));
+    }
+}
+
+void normalizeImage(const unsigned char* imageData, size_t imageSize, float* normalizedImage) {
+    for (size_t i = 0; i < imageSize; ++i) {
+        normalizedImage[i] = (imageData[i] / 255.0f - imageMean) / imageStd;
+    }
+}
+
+
+FloatBuffer loadFloatsFromFile(const std::string& filename) {
+    // Open the file in binary mode
+    std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
+    
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << filename << std::endl;
+        return {}; // Return an empty vector in case of failure
+    }
+
+    // Determine the file size
+    std::streamsize size = file.tellg();
+    file.seekg(0, std::ios::beg);
+
+    // Calculate the number of float elements
+    std::streamsize numElements = size / sizeof(float);
+
+    FloatBuffer buffer(numElements);
+
+    // Read the file content into the buffer
+    if (!file.read(reinterpret_cast<char*>(buffer.data()), size)) {
+        std::cerr << "Failed to read floats from file: " << filename << std::endl;
+        return {}; // Return an empty vector in case of failure
+    }
+
+    file.close(); // Close the file
+    return buffer; // Return the loaded floats
+}
+
+
+HalfBuffer loadHalfsFromFile(const std::string& filename) {
+    std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << filename << std::endl;
+        return HalfBuffer();
+    }
+
+    std::streamsize size = file.tellg();
+    file.seekg(0, std::ios::beg);
+
+    HalfBuffer buffer(size / sizeof(uint16_t));
+    if (!file.read(reinterpret_cast<char*>(buffer.data()), size)) {
+        std::cerr << "Failed to read 16-bit weights from file: " << filename << std::endl;
+        return HalfBuffer();
+    }
+    return buffer;
+}
+
+
+WeightFormat weightFormatFromPath(const std::string& path) {
+    size_t dot = path.rfind('.');
+    std::string extension = dot == std::string::npos ? std::string() : path.substr(dot);
+    if (extension == ".f16") {
+        return WEIGHTS_FP16;
+    }
+    if (extension == ".bf16") {
+        return WEIGHTS_BF16;
+    }
+    if (extension == ".b1") {
+        return WEIGHTS_BINARY;
+    }
+    if (extension == ".t2") {
+        return WEIGHTS_TERNARY;
+    }
+    if (extension == ".lr") {
+        return WEIGHTS_LOW_RANK;
+    }
+    return WEIGHTS_FP32;
+}
+
+
+const char* weightFormatName(WeightFormat format) {
+    switch (format) {
+    case WEIGHTS_FP16: return "fp16";
+    case WEIGHTS_BF16: return "bf16";
+    case WEIGHTS_BINARY: return "binary";
+    case WEIGHTS_TERNARY: return "ternary";
+    case WEIGHTS_LOW_RANK: return "low_rank";
+    default: return "fp32";
+    }
+}
+
+
+bool loadModelParameters(const std::string& weightsPath, const std::string& biasesPath, 
+                         FloatBuffer& weightsBuffer, FloatBuffer& biases) {
+
+
+    weightsBuffer = loadFloatsFromFile(weightsPath);
+
+
+    biases = loadFloatsFromFile(biasesPath);
+
+    if (weightsBuffer.empty() || biases.empty()) {
+        return false; // Return false if either weights or biases failed to load
+    }
+    return true; // Successfully loaded and transferred weights and biases
+}
+
+
+void matrixMulCPU(
+    const float* input_tile,  // Tile of the Input vector
+    const float* weights_tile, // Tile of the Weights matrix
+    int input_tile_size,                  // Size of the input tile
+    int output_neurons_tile_size,         // Size of the output tile (number of neurons in this tile)
+    float* output_tile                // Output vector tile
+){
+
+    int neuron_id = 0;
+    for(;neuron_id<output_neurons_tile_size;neuron_id++){
+    // Ensure we don't process more neurons than we have in this tile
+    if (neuron_id < output_neurons_tile_size) {
+        float temp_sum = 0.0;
+        
+        // Compute the dot product of the input tile and the corresponding weights
+        for (int i = 0; i < input_tile_size; ++i) {
+
+          int weight_index = neuron_id * input_tile_size + i;
+          //printf("weight index:%d\n",weight_index);
+          temp_sum += (float)input_tile[i] * (float)weights_tile[weight_index];
+     }
+
+        // Write the computed sum for this neuron to the output tile
+        output_tile[neuron_id] += temp_sum;
+    }
+    }
+
+}
+
+
+void denseToSparse(ConstTensorView dense, SparseMatrix& sparse) {
+    sparse.rows = dense.rows;
+    sparse.cols = dense.cols;
+    sparse.rowStart.assign(1, 0);
+    sparse.colIndex.clear();
+    sparse.values.clear();
+
+    for (int r = 0; r < dense.rows; ++r) {
+        const float* row = dense.row(r);
+        for (int c = 0; c < dense.cols; ++c) {
+            if (row[c] != 0.0f) {
+                sparse.colIndex.push_back(c);
+                sparse.values.push_back(row[c]);
+            }
+        }
+        sparse.rowStart.push_back((int)sparse.values.size());
+    }
+}
+
+
+void pruneByMagnitude(float* weights, size_t n, double sparsity) {
+    size_t prune = (size_t)(std::min(std::max(sparsity, 0.0), 1.0) * n + 0.5);
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [weights](size_t a, size_t b) {
+        return std::fabs(weights[a]) < std::fabs(weights[b]);
+    });
+    for (size_t i = 0; i < prune; ++i) {
+        weights[order[i]] = 0.0f;
+    }
+}
+
+
+void sparseMatrixMulCPU(
+    const SparseMatrix& weights, // CSR weights, rows x cols
+    const float* input,          // Input vector, cols entries
+    float* output                // Output vector, rows entries
+){
+    const int* rowStart = weights.rowStart.data();
+    const int* colIndex = weights.colIndex.data();
+    const float* values = weights.values.data();
+
+    for (int r = 0; r < weights.rows; ++r) {
+        // Only the kept weights are visited, the input is gathered at their columns
+        float temp_sum = 0.0f;
+        for (int k = rowStart[r]; k < rowStart[r + 1]; ++k) {
+            temp_sum += input[colIndex[k]] * values[k];
+        }
+        output[r] = temp_sum;
+    }
+}
+
+
+void sparseLayer_CPU(const SparseMatrix& weights, ConstTensorView biases,
+    ConstTensorView input, TensorView output, DataflowTraffic& traffic) {
+
+    traffic = DataflowTraffic();
+    for (int b = 0; b < input.rows; ++b) {
+        float* out = output.row(b);
+        sparseMatrixMulCPU(weights, input.row(b), out);
+        for (int r = 0; r < weights.rows; ++r) {
+            out[r] += biases.data[r];
+        }
+    }
+
+    // Values and column indices once per image, row pointers and biases once per row
+    size_t nonZeros = weights.nonZeros();
+    traffic.weightBytes = input.rows * (nonZeros * (sizeof(float) + sizeof(int)) +
+                                        weights.rows * (sizeof(int) + sizeof(float)) + sizeof(int));
+    traffic.inputBytes = input.rows * nonZeros * sizeof(float);
+    traffic.psumBytes = input.rows * weights.rows * sizeof(float);
+}
+
+
+float packBitRow(const float* values, int n, bool ternary, uint64_t* signs, uint64_t* nonZero) {
+    int words = (n + 63) / 64;
+    int i = 0;
+    float sumAbs = 0.0f;
+#ifdef FLOAT_VEC
+    const int width = (int)floatVecWidth;
+    const FloatVec zero = vecSet(0.0f);
+    FloatVec sumVec = zero;
+    for (; i + width <= n; i += width) {
+        FloatVec x = vecLoad(values + i);
+        sumVec = vecAdd(sumVec, vecMax(x, vecSub(zero, x)));
+    }
+    sumAbs = vecSum(sumVec);
+#endif
+    for (; i < n; ++i) {
+        sumAbs += std::fabs(values[i]);
+    }
+    float meanAbs = n ? sumAbs / n : 0.0f;
+    float threshold = 0.7f * meanAbs;
+
+    // Word by word without branches, the pixels of an image land on both sides at random.
+    // A weight is kept by the ternary code when |x| >= threshold.
+    float keptAbs = 0.0f;
+    int kept = 0;
+#ifdef FLOAT_VEC
+    const FloatVec limit = vecSet(threshold);
+    FloatVec keptVec = zero;
+#endif
+    for (int w = 0; w < words; ++w) {
+        int end = std::min(n - w * 64, 64);
+        const float* v = values + w * 64;
+        uint64_t negative = 0, small = 0;
+        int j = 0;
+#ifdef FLOAT_VEC
+        for (; j + width <= end; j += width) {
+            FloatVec x = vecLoad(v + j);
+            negative |= (uint64_t)vecMaskBelow(x, zero) << j;
+            if (ternary) {
+                FloatVec magnitude = vecMax(x, vecSub(zero, x));
+                small |= (uint64_t)vecMaskBelow(magnitude, limit) << j;
+                keptVec = vecAdd(keptVec, vecZeroBelow(magnitude, magnitude, limit));
+            }
+        }
+#endif
+        for (; j < end; ++j) {
+            float magnitude = std::fabs(v[j]);
+            uint64_t isSmall = magnitude < threshold;
+            negative |= (uint64_t)(v[j] < 0.0f) << j;
+            small |= isSmall << j;
+            keptAbs += isSmall ? 0.0f : magnitude;
+        }
+        uint64_t valid = end == 64 ? ~(uint64_t)0 : ((uint64_t)1 << end) - 1;
+        uint64_t large = ~small & valid;
+        signs[w] = ternary ? negative & large : negative;
+        if (ternary) {
+            nonZero[w] = large;
+            kept += __builtin_popcountll(large);
+        }
+    }
+    if (!ternary) {
+        return meanAbs;
+    }
+#ifdef FLOAT_VEC
+    keptAbs += vecSum(keptVec);
+#endif
+    return kept ? keptAbs / kept : 0.0f;
+}
+
+
+void quantizeToBits(ConstTensorView weights, bool ternary, BitMatrix& packed) {
+    packed.rows = weights.rows;
+    packed.cols = weights.cols;
+    packed.words = (weights.cols + 63) / 64;
+    packed.ternary = ternary;
+    packed.signs.assign((size_t)packed.rows * packed.words, 0);
+    packed.nonZero.assign(ternary ? packed.signs.size() : 0, 0);
+    packed.scales.resize(packed.rows);
+    for (int r = 0; r < weights.rows; ++r) {
+        size_t offset = (size_t)r * packed.words;
+        packed.scales[r] = packBitRow(weights.row(r), weights.cols, ternary, &packed.signs[offset],
+                                      ternary ? &packed.nonZero[offset] : NULL);
+    }
+}
+
+
+void unpackBits(const BitMatrix& packed, float* weights) {
+    for (int r = 0; r < packed.rows; ++r) {
+        for (int c = 0; c < packed.cols; ++c) {
+            size_t word = (size_t)r * packed.words + c / 64;
+            uint64_t bit = (uint64_t)1 << (c % 64);
+            bool zero = packed.ternary && !(packed.nonZero[word] & bit);
+            float sign = (packed.signs[word] & bit) ? -1.0f : 1.0f;
+            weights[(size_t)r * packed.cols + c] = zero ? 0.0f : sign * packed.scales[r];
+        }
+    }
+}
+
+
+// "MNBT", then int32 ternary, rows, cols, float32 scales[rows], uint64 signs[rows * words]
+// and for ternary uint64 nonZero[rows * words], all little-endian
+static const uint32_t bitFileMagic = 0x54424e4d;
+
+bool loadBitMatrixFromFile(const std::string& filename, BitMatrix& packed) {
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << filename << std::endl;
+        return false;
+    }
+
+    uint32_t magic = 0;
+    int32_t header[3] = {0, 0, 0};
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!file || magic != bitFileMagic || header[1] <= 0 || header[2] <= 0) {
+        std::cerr << "Not a bit-packed weight file: " << filename << std::endl;
+        return false;
+    }
+
+    packed.ternary = header[0] != 0;
+    packed.rows = header[1];
+    packed.cols = header[2];
+    packed.words = (packed.cols + 63) / 64;
+    packed.scales.resize(packed.rows);
+    packed.signs.resize((size_t)packed.rows * packed.words);
+    packed.nonZero.resize(packed.ternary ? packed.signs.size() : 0);
+    file.read(reinterpret_cast<char*>(packed.scales.data()), packed.scales.size() * sizeof(float));
+    file.read(reinterpret_cast<char*>(packed.signs.data()), packed.signs.size() * sizeof(uint64_t));
+    file.read(reinterpret_cast<char*>(packed.nonZero.data()), packed.nonZero.size() * sizeof(uint64_t));
+    if (!file || file.peek() != std::ifstream::traits_type::eof()) {
+        std::cerr << "Failed to read bit-packed weights from file: " << filename << std::endl;
+        packed = BitMatrix();
+        return false;
+    }
+    return true;
+}
+
+
+size_t bitLayerScratchFloats(int cols) {
+    // Two planes of packed activations, a uint64_t is two floats
+    return ScratchArena::roundUp(2 * 2 * ((cols + 63) / 64));
+}
+
+
+void bitLayer_CPU(const BitMatrix& weights, ConstTensorView biases,
+    ConstTensorView input, TensorView output, DataflowTraffic& traffic, ScratchArena& scratch) {
+
+    ArenaScope scope(scratch);
+    const int words = weights.words;
+    uint64_t* inputSigns = reinterpret_cast<uint64_t*>(scratch.take(2 * 2 * words));
+    uint64_t* inputNonZero = inputSigns + words;
+
+    for (int b = 0; b < input.rows; ++b) {
+        float inputScale = packBitRow(input.row(b), input.cols, weights.ternary, inputSigns, inputNonZero);
+        float* out = output.row(b);
+
+        for (int r = 0; r < weights.rows; ++r) {
+            const uint64_t* signs = &weights.signs[(size_t)r * words];
+            int dot;
+            if (weights.ternary) {
+                const uint64_t* nonZero = &weights.nonZero[(size_t)r * words];
+                int both = 0, disagree = 0;
+                for (int w = 0; w < words; ++w) {
+                    uint64_t mask = nonZero[w] & inputNonZero[w];
+                    both += __builtin_popcountll(mask);
+                    disagree += __builtin_popcountll(mask & (signs[w] ^ inputSigns[w]));
+                }
+                dot = both - 2 * disagree;
+            } else {
+                int disagree = 0;
+                for (int w = 0; w < words; ++w) {
+                    disagree += __builtin_popcountll(signs[w] ^ inputSigns[w]);
+                }
+                dot = weights.cols - 2 * disagree;
+            }
+            out[r] = weights.scales[r] * inputScale * dot + biases.data[r];
+        }
+    }
+
+    // The bit planes and scales once per image, every input read once to pack it
+    traffic = DataflowTraffic();
+    traffic.weightBytes = input.rows * (weights.bytes() + weights.rows * sizeof(float));
+    traffic.inputBytes = input.rows * input.cols * sizeof(float);
+    traffic.psumBytes = input.rows * weights.rows * sizeof(float);
+}
+
+
+// Eigen decomposition of a symmetric n x n matrix, cyclic Jacobi rotations until the
+// off-diagonal is negligible. a is left with the eigenvalues on its diagonal, the
+// columns of vectors are the eigenvectors.
+static void jacobiEigen(std::vector<double>& a, int n, std::vector<double>& vectors) {
+    vectors.assign((size_t)n * n, 0.0);
+    for (int i = 0; i < n; ++i) {
+        vectors[(size_t)i * n + i] = 1.0;
+    }
+
+    double total = 0.0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        total += a[i] * a[i];
+    }
+    for (int sweep = 0; sweep < 64; ++sweep) {
+        double off = 0.0;
+        for (int p = 0; p < n; ++p) {
+            for (int q = p + 1; q < n; ++q) {
+                off += a[(size_t)p * n + q] * a[(size_t)p * n + q];
+            }
+        }
+        if (off <= 1e-30 * total) {
+            break;
+        }
+
+        for (int p = 0; p < n; ++p) {
+            for (int q = p + 1; q < n; ++q) {
+                double apq = a[(size_t)p * n + q];
+                if (apq == 0.0) {
+                    continue;
+                }
+                // The rotation that zeroes a[p][q], the smaller of the two angles
+                double theta = (a[(size_t)q * n + q] - a[(size_t)p * n + p]) / (2.0 * apq);
+                double t = (theta >= 0.0 ? 1.0 : -1.0) / (std::fabs(theta) + std::sqrt(theta * theta + 1.0));
+                double c = 1.0 / std::sqrt(t * t + 1.0);
+                double s = t * c;
+                for (int k = 0; k < n; ++k) {
+                    double akp = a[(size_t)k * n + p], akq = a[(size_t)k * n + q];
+                    a[(size_t)k * n + p] = c * akp - s * akq;
+                    a[(size_t)k * n + q] = s * akp + c * akq;
+                }
+                for (int k = 0; k < n; ++k) {
+                    double apk = a[(size_t)p * n + k], aqk = a[(size_t)q * n + k];
+                    a[(size_t)p * n + k] = c * apk - s * aqk;
+                    a[(size_t)q * n + k] = s * apk + c * aqk;
+                }
+                for (int k = 0; k < n; ++k) {
+                    double vkp = vectors[(size_t)k * n + p], vkq = vectors[(size_t)k * n + q];
+                    vectors[(size_t)k * n + p] = c * vkp - s * vkq;
+                    vectors[(size_t)k * n + q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+}
+
+
+void factorizeLowRank(ConstTensorView weights, int rank, LowRankLayer& factors) {
+    const int rows = weights.rows, cols = weights.cols;
+    const bool gramOfRows = rows <= cols;
+    const int n = gramOfRows ? rows : cols;
+    rank = std::min(std::max(rank, 1), n);
+
+    std::vector<double> gram((size_t)n * n);
+    for (int i = 0; i < n; ++i) {
+        for (int j = i; j < n; ++j) {
+            double sum = 0.0;
+            if (gramOfRows) {
+                for (int c = 0; c < cols; ++c) {
+                    sum += (double)weights.row(i)[c] * weights.row(j)[c];
+                }
+            } else {
+                for (int r = 0; r < rows; ++r) {
+                    sum += (double)weights.row(r)[i] * weights.row(r)[j];
+                }
+            }
+            gram[(size_t)i * n + j] = gram[(size_t)j * n + i] = sum;
+        }
+    }
+    std::vector<double> vectors;
+    jacobiEigen(gram, n, vectors);
+
+    // Eigenvalues are the squared singular values, largest first
+    std::vector<int> order(n);
+    for (int i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int x, int y) {
+        return gram[(size_t)x * n + x] > gram[(size_t)y * n + y];
+    });
+
+    factors.rows = rows;
+    factors.cols = cols;
+    factors.rank = rank;
+    factors.right.assign((size_t)rank * cols, 0.0f);
+    factors.left.assign((size_t)rows * rank, 0.0f);
+    for (int k = 0; k < rank; ++k) {
+        const int e = order[k];
+        if (gramOfRows) {
+            // left = U, right = U^T W
+            for (int r = 0; r < rows; ++r) {
+                factors.left[(size_t)r * rank + k] = (float)vectors[(size_t)r * n + e];
+            }
+            for (int c = 0; c < cols; ++c) {
+                double sum = 0.0;
+                for (int r = 0; r < rows; ++r) {
+                    sum += vectors[(size_t)r * n + e] * weights.row(r)[c];
+                }
+                factors.right[(size_t)k * cols + c] = (float)sum;
+            }
+        } else {
+            // right = V^T, left = W V
+            for (int c = 0; c < cols; ++c) {
+                factors.right[(size_t)k * cols + c] = (float)vectors[(size_t)c * n + e];
+            }
+            for (int r = 0; r < rows; ++r) {
+                double sum = 0.0;
+                for (int c = 0; c < cols; ++c) {
+                    sum += (double)weights.row(r)[c] * vectors[(size_t)c * n + e];
+                }
+                factors.left[(size_t)r * rank + k] = (float)sum;
+            }
+        }
+    }
+}
+
+
+void expandLowRank(const LowRankLayer& factors, float* weights) {
+    for (int r = 0; r < factors.rows; ++r) {
+        for (int c = 0; c < factors.cols; ++c) {
+            double sum = 0.0;
+            for (int k = 0; k < factors.rank; ++k) {
+                sum += (double)factors.left[(size_t)r * factors.rank + k] * factors.right[(size_t)k * factors.cols + c];
+            }
+            weights[(size_t)r * factors.cols + c] = (float)sum;
+        }
+    }
+}
+
+
+// "MNLR" in the first four bytes of a little-endian file
+static const uint32_t lowRankFileMagic = 0x524c4e4d;
+
+bool loadLowRankFromFile(const std::string& filename, LowRankLayer& factors) {
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << filename << std::endl;
+        return false;
+    }
+
+    uint32_t magic = 0;
+    int32_t header[3] = {0, 0, 0}; // rows, cols, rank
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!file || magic != lowRankFileMagic || header[0] <= 0 || header[1] <= 0 || header[2] <= 0) {
+        std::cerr << "Not a low-rank weight file: " << filename << std::endl;
+        return false;
+    }
+
+    factors.rows = header[0];
+    factors.cols = header[1];
+    factors.rank = header[2];
+    factors.right.resize((size_t)factors.rank * factors.cols);
+    factors.left.resize((size_t)factors.rows * factors.rank);
+    file.read(reinterpret_cast<char*>(factors.right.data()), factors.right.size() * sizeof(float));
+    file.read(reinterpret_cast<char*>(factors.left.data()), factors.left.size() * sizeof(float));
+    if (!file || file.peek() != std::ifstream::traits_type::eof()) {
+        std::cerr << "Failed to read low-rank weights from file: " << filename << std::endl;
+        factors = LowRankLayer();
+        return false;
+    }
+    return true;
+}
+
+
+// Dot product of two float rows, two vector accumulators to hide the add latency
+static float floatDot(const float* a, const float* b, int n) {
+    int i = 0;
+    float sum = 0.0f;
+#ifdef FLOAT_VEC
+    const int width = (int)floatVecWidth;
+    FloatVec sum0 = vecSet(0.0f), sum1 = vecSet(0.0f);
+    for (; i + 2 * width <= n; i += 2 * width) {
+        sum0 = vecAdd(sum0, vecMul(vecLoad(a + i), vecLoad(b + i)));
+        sum1 = vecAdd(sum1, vecMul(vecLoad(a + i + width), vecLoad(b + i + width)));
+    }
+    for (; i + width <= n; i += width) {
+        sum0 = vecAdd(sum0, vecMul(vecLoad(a + i), vecLoad(b + i)));
+    }
+    sum = vecSum(vecAdd(sum0, sum1));
+#endif
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+
+void lowRankLayer_CPU(const LowRankLayer& factors, ConstTensorView biases,
+    ConstTensorView input, TensorView output, DataflowTraffic& traffic, ScratchArena& scratch) {
+
+    ArenaScope scope(scratch);
+    float* projected = scratch.take(factors.rank);
+
+    for (int b = 0; b < input.rows; ++b) {
+        const float* x = input.row(b);
+        for (int k = 0; k < factors.rank; ++k) {
+            projected[k] = floatDot(&factors.right[(size_t)k * factors.cols], x, factors.cols);
+        }
+        float* out = output.row(b);
+        for (int r = 0; r < factors.rows; ++r) {
+            out[r] = floatDot(&factors.left[(size_t)r * factors.rank], projected, factors.rank) + biases.data[r];
+        }
+    }
+
+    // Both factors once per image, the projections are written and read back once
+    traffic = DataflowTraffic();
+    traffic.weightBytes = input.rows * (factors.bytes() + factors.rows * sizeof(float));
+    traffic.inputBytes = input.rows * factors.cols * sizeof(float);
+    traffic.psumBytes = input.rows * (2 * factors.rank + factors.rows) * sizeof(float);
+}
+
+
+size_t lowRankScratchFloats(int rank) {
+    return ScratchArena::roundUp(rank);
+}
+
+
+void foldInputNormalization(ConstTensorView weights, ConstTensorView biases, PixelLayer& folded) {
+    const double scale = 1.0 / (255.0 * imageStd);
+    const double shift = -(double)imageMean / imageStd;
+
+    folded.rows = weights.rows;
+    folded.cols = weights.cols;
+    folded.weights.resize(weights.size());
+    folded.biases.resize(weights.rows);
+    for (int r = 0; r < weights.rows; ++r) {
+        const float* row = weights.row(r);
+        double rowSum = 0.0;
+        for (int c = 0; c < weights.cols; ++c) {
+            folded.weights[(size_t)c * weights.rows + r] = (float)(row[c] * scale);
+            rowSum += row[c];
+        }
+        folded.biases[r] = (float)(biases.data[r] + shift * rowSum);
+    }
+}
+
+
+// out[i] += a * column[i], the multiply-accumulate of one pixel
+static void scaleAdd(float* out, const float* column, float a, int n) {
+    int i = 0;
+#ifdef FLOAT_VEC
+    FloatVec aVec = vecSet(a);
+    for (; i + (int)floatVecWidth <= n; i += floatVecWidth) {
+        vecStore(out + i, vecAdd(vecLoad(out + i), vecMul(aVec, vecLoad(column + i))));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] += a * column[i];
+    }
+}
+
+
+void pixelLayer_CPU(const PixelLayer& layer, const unsigned char* pixels, TensorView output,
+    DataflowTraffic& traffic) {
+
+    size_t litPixels = 0;
+    for (int b = 0; b < output.rows; ++b) {
+        const unsigned char* image = pixels + (size_t)b * layer.cols;
+        float* out = output.row(b);
+        std::copy(layer.biases.begin(), layer.biases.end(), out);
+        for (int c = 0; c < layer.cols; ++c) {
+            if (image[c] != 0) {
+                scaleAdd(out, layer.weights.data() + (size_t)c * layer.rows, (float)image[c], layer.rows);
+                litPixels++;
+            }
+        }
+    }
+
+    // Only the weight columns of lit pixels are read, the pixels are read as bytes,
+    // and the partial sums are read and written once per lit pixel
+    traffic = DataflowTraffic();
+    traffic.weightBytes = (litPixels + output.rows) * layer.rows * sizeof(float);
+    traffic.inputBytes = (size_t)output.rows * layer.cols * sizeof(unsigned char);
+    traffic.psumBytes = 2 * litPixels * layer.rows * sizeof(float);
+}
+
+
+void convertWeights(const float* weights, size_t n, WeightFormat format, uint16_t* converted) {
+    for (size_t i = 0; i < n; ++i) {
+        converted[i] = format == WEIGHTS_BF16 ? floatToBFloat16(weights[i]) : floatToHalf(weights[i]);
+    }
+}
+
+
+// Dot product of n 16-bit weights with fp32 inputs. The vector paths widen a group
+// of weights per instruction, the rest are widened one at a time.
+static float halfDot(WeightFormat format, const uint16_t* weights, const float* input, int n) {
+    int i = 0;
+    float temp_sum = 0.0f;
+
+#if defined(__F16C__)
+    // F16C comes with AVX, bf16 is widened with the SSE2 unpacks so AVX2 is not needed
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + i));
+        __m256 w = format == WEIGHTS_BF16
+            ? _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), raw))),
+                                   _mm_castsi128_ps(_mm_unpackhi_epi16(_mm_setzero_si128(), raw)), 1)
+            : _mm256_cvtph_ps(raw);
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(w, _mm256_loadu_ps(input + i)));
+    }
+    __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+    sum4 = _mm_add_ss(sum4, _mm_shuffle_ps(sum4, sum4, 1));
+    temp_sum = _mm_cvtss_f32(sum4);
+#elif defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        uint16x4_t raw = vld1_u16(weights + i);
+        float32x4_t w;
+        if (format == WEIGHTS_BF16) {
+            w = vreinterpretq_f32_u32(vshll_n_u16(raw, 16));
+        } else {
+#if defined(__ARM_FP16_FORMAT_IEEE) && (__ARM_FP & 2)
+            w = vcvt_f32_f16(vreinterpret_f16_u16(raw));
+#else
+            float widened[4] = { halfToFloat(weights[i]), halfToFloat(weights[i + 1]),
+                                 halfToFloat(weights[i + 2]), halfToFloat(weights[i + 3]) };
+            w = vld1q_f32(widened);
+#endif
+        }
+        acc = vmlaq_f32(acc, w, vld1q_f32(input + i));
+    }
+    float32x2_t sum2 = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    temp_sum = vget_lane_f32(vpadd_f32(sum2, sum2), 0);
+#endif
+
+    if (format == WEIGHTS_BF16) {
+        for (; i < n; ++i) {
+            temp_sum += bfloat16ToFloat(weights[i]) * input[i];
+        }
+    } else {
+        for (; i < n; ++i) {
+            temp_sum += halfToFloat(weights[i]) * input[i];
+        }
+    }
+    return temp_sum;
+}
+
+
+bool halfConvertsInHardware(WeightFormat format) {
+#if defined(__F16C__)
+    (void)format;
+    return true;
+#elif defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE) && (__ARM_FP & 2)
+    (void)format;
+    return true;
+#elif defined(__ARM_NEON)
+    return format == WEIGHTS_BF16;
+#else
+    (void)format;
+    return false;
+#endif
+}
+
+
+void halfMatrixMulCPU(
+    WeightFormat format,   // WEIGHTS_FP16 or WEIGHTS_BF16
+    ConstHalfView weights, // Weights, rows x cols
+    const float* input,    // Input vector, cols entries
+    float* output          // Output vector, rows entries
+){
+    for (int r = 0; r < weights.rows; ++r) {
+        output[r] = halfDot(format, weights.row(r), input, weights.cols);
+    }
+}
+
+
+void halfLayer_CPU(WeightFormat format, ConstHalfView weights, ConstTensorView biases,
+    ConstTensorView input, TensorView output, DataflowTraffic& traffic) {
+
+    traffic = DataflowTraffic();
+    for (int b = 0; b < input.rows; ++b) {
+        float* out = output.row(b);
+        halfMatrixMulCPU(format, weights, input.row(b), out);
+        for (int r = 0; r < weights.rows; ++r) {
+            out[r] += biases.data[r];
+        }
+    }
+
+    // Half the weight bytes of the fp32 output stationary schedule
+    traffic.weightBytes = input.rows * (weights.size() * sizeof(uint16_t) + weights.rows * sizeof(float));
+    traffic.inputBytes = input.rows * weights.cols * sizeof(float);
+    traffic.psumBytes = input.rows * weights.rows * sizeof(float);
+}
+
+
+void loadWeights(int weightsStartIndex,int numNeurons,int inputTileSize,int inputSize,
+    const float* weights,float* temp_wts){
+
+    int index = 0;
+    for(int i=0;i<numNeurons;i++){
+        for(int j=0;j<inputTileSize;j++){
+            temp_wts[index] = weights[(i)*inputSize + j+weightsStartIndex];
+            //printf("index:%d\n",index);
+            index++;
+        }
+    }
+}
+
+
+void processTiles_weightStatinary_CPU(
+    int numNeurons,
+    int inputSize, // Size of the input array
+    int inputTileSize,  // Tile size of the Input vector          
+    const float* weights, // Weights array
+    const float* biases,  // biases array
+    const float* inputs,  // inputs array 
+    float* outputs,  // outputs array
+    DataflowTraffic& traffic,  // bytes moved, accumulated
+    ScratchArena& scratch  // tile buffers
+    ) {
+
+
+    int numTiles = inputSize / inputTileSize; // Ensure this division is an integer
+    int weightsPerTile = numNeurons*inputTileSize; // Assuming an even distribution of neurons per tile
+
+    ArenaScope scope(scratch);
+    float* temp_wts = scratch.take(weightsPerTile);
+
+    for (int tileIndex = 0; tileIndex < numTiles; ++tileIndex) {
+        
+        int weightsStartIndex = tileIndex * inputTileSize; 
+        loadWeights(weightsStartIndex,numNeurons,inputTileSize,inputSize,weights,temp_wts);
+
+        matrixMulCPU(
+            inputs + weightsStartIndex,  // Tile of the Input vector
+            temp_wts, // Tile of the Weights matrix
+            inputTileSize,                  // Size of the input tile
+            numNeurons,         // Size of the output tile (number of neurons in this tile)
+            outputs
+        );
+
+        // Partial sums are read and written back for every tile
+        traffic.weightBytes += weightsPerTile * sizeof(float);
+        traffic.inputBytes += inputTileSize * sizeof(float);
+        traffic.psumBytes += 2 * numNeurons * sizeof(float);
+    }
+
+    for(int i=0;i<numNeurons;i++){
+        outputs[i] += biases[i];
+    } 
+    traffic.weightBytes += numNeurons * sizeof(float);
+    traffic.psumBytes += 2 * numNeurons * sizeof(float);
+
+}
+
+
+void processTiles_outputStationary_CPU(
+    int numNeurons,
+    int inputSize, // Size of the input array
+    int inputTileSize,  // Tile size of the Input vector
+    const float* weights, // Weights array
+    const float* biases,  // biases array
+    const float* inputs,  // inputs array
+    float* outputs,  // outputs array
+    DataflowTraffic& traffic,  // bytes moved, accumulated
+    ScratchArena& scratch  // tile buffers
+    ) {
+
+    int numTiles = inputSize / inputTileSize; // Ensure this division is an integer
+
+    ArenaScope scope(scratch);
+    float* temp_wts = scratch.take(outputNeuronsTileSize * inputTileSize);
+    float* accumulators = scratch.take(outputNeuronsTileSize);
+
+    for (int neuronStart = 0; neuronStart < numNeurons; neuronStart += outputNeuronsTileSize) {
+
+        int tileNeurons = std::min(outputNeuronsTileSize, numNeurons - neuronStart);
+
+        // Accumulators of this neuron tile stay local until every input tile is consumed
+        std::fill(accumulators, accumulators + tileNeurons, 0.0f);
+
+        for (int tileIndex = 0; tileIndex < numTiles; ++tileIndex) {
+
+            int weightsStartIndex = neuronStart * inputSize + tileIndex * inputTileSize;
+            loadWeights(weightsStartIndex,tileNeurons,inputTileSize,inputSize,weights,temp_wts);
+
+            matrixMulCPU(inputs + tileIndex * inputTileSize, temp_wts, inputTileSize, tileNeurons, accumulators);
+
+            traffic.weightBytes += tileNeurons * inputTileSize * sizeof(float);
+            traffic.inputBytes += inputTileSize * sizeof(float);
+        }
+
+        // Each output is written exactly once, with its bias
+        for (int i = 0; i < tileNeurons; ++i) {
+            outputs[neuronStart + i] = accumulators[i] + biases[neuronStart + i];
+        }
+        traffic.weightBytes += tileNeurons * sizeof(float);
+        traffic.psumBytes += tileNeurons * sizeof(float);
+    }
+}
+
+
+void processTiles_inputStationary_CPU(
+    int numNeurons,
+    int inputSize, // Size of the input array
+    int inputTileSize,  // Tile size of the Input vector
+    const float* weights, // Weights array
+    const float* biases,  // biases array
+    const float* inputs,  // inputs array
+    float* outputs,  // outputs array
+    DataflowTraffic& traffic,  // bytes moved, accumulated
+    ScratchArena& scratch  // tile buffers
+    ) {
+
+    int numTiles = inputSize / inputTileSize; // Ensure this division is an integer
+
+    ArenaScope scope(scratch);
+    float* temp_wts = scratch.take(outputNeuronsTileSize * inputTileSize);
+
+    for (int tileIndex = 0; tileIndex < numTiles; ++tileIndex) {
+
+        // The input tile is fetched once and held while every neuron tile visits it
+        const float* inputSlice = inputs + tileIndex * inputTileSize;
+        traffic.inputBytes += inputTileSize * sizeof(float);
+
+        for (int neuronStart = 0; neuronStart < numNeurons; neuronStart += outputNeuronsTileSize) {
+
+            int tileNeurons = std::min(outputNeuronsTileSize, numNeurons - neuronStart);
+
+            int weightsStartIndex = neuronStart * inputSize + tileIndex * inputTileSize;
+            loadWeights(weightsStartIndex,tileNeurons,inputTileSize,inputSize,weights,temp_wts);
+
+            // The partial sums of the neuron tile are read and written back in place
+            matrixMulCPU(inputSlice, temp_wts, inputTileSize, tileNeurons, outputs + neuronStart);
+
+            traffic.weightBytes += tileNeurons * inputTileSize * sizeof(float);
+            traffic.psumBytes += 2 * tileNeurons * sizeof(float);
+        }
+    }
+
+    for(int i=0;i<numNeurons;i++){
+        outputs[i] += biases[i];
+    }
+    traffic.weightBytes += numNeurons * sizeof(float);
+    traffic.psumBytes += 2 * numNeurons * sizeof(float);
+}
+
+
+void processTiles_batch_CPU(
+    int numNeurons,
+    int inputSize, // Size of the input array
+    int inputTileSize,  // Tile size of the Input vector
+    int batch,  // Number of images in the batch
+    const float* weights, // Weights array
+    const float* biases,  // biases array
+    const float* inputs,  // inputs array (batch x inputSize)
+    float* outputs,  // outputs array (batch x numNeurons)
+    DataflowTraffic& traffic,  // bytes moved, accumulated
+    ScratchArena& scratch  // tile buffers
+    ) {
+
+    int numTiles = inputSize / inputTileSize; // Ensure this division is an integer
+
+    ArenaScope scope(scratch);
+    float* temp_wts = scratch.take(numNeurons * inputTileSize);
+
+    for (int b = 0; b < batch; ++b) {
+        for (int i = 0; i < numNeurons; ++i) {
+            outputs[b * numNeurons + i] = biases[i];
+        }
+    }
+
+    for (int tileIndex = 0; tileIndex < numTiles; ++tileIndex) {
+
+        int weightsStartIndex = tileIndex * inputTileSize;
+        loadWeights(weightsStartIndex,numNeurons,inputTileSize,inputSize,weights,temp_wts);
+
+        for (int b = 0; b < batch; ++b) {
+            const float* input_tile = &inputs[b * inputSize + weightsStartIndex];
+            float* output_row = &outputs[b * numNeurons];
+            for (int neuron_id = 0; neuron_id < numNeurons; ++neuron_id) {
+                float temp_sum = 0.0f;
+                for (int i = 0; i < inputTileSize; ++i) {
+                    temp_sum += input_tile[i] * temp_wts[neuron_id * inputTileSize + i];
+                }
+                output_row[neuron_id] += temp_sum;
+            }
+        }
+
+        // A weight tile is read once for the whole batch, the partial sums of every image are updated
+        traffic.weightBytes += numNeurons * inputTileSize * sizeof(float);
+        traffic.inputBytes += (size_t)batch * inputTileSize * sizeof(float);
+        traffic.psumBytes += 2 * (size_t)batch * numNeurons * sizeof(float);
+    }
+    traffic.weightBytes += numNeurons * sizeof(float);
+    traffic.psumBytes += (size_t)batch * numNeurons * sizeof(float);
+}
+
+
+// Register tile of the GEMM micro-kernel, images x neurons. The vector kernels hold two
+// vectors of neurons per image, mr is as many images as the registers allow: 12 of the
+// 16 AVX2 or 32 AArch64 registers for the accumulators. The 16 q registers of ARMv7
+// NEON (Cortex-A9) get 8: 6 images would need 15 of them with the two vectors of b and
+// the broadcast input, too tight not to spill. SSE2 gets 8 of 16 too, it also needs
+// temporaries without FMA.
+#if defined(FLOAT_VEC) && (defined(__AVX2__) || defined(__aarch64__))
+static const int gemmMR = 6;
+#else
+static const int gemmMR = 4;
+#endif
+#ifdef FLOAT_VEC
+static const int gemmNR = 2 * (int)floatVecWidth;
+#else
+static const int gemmNR = 4;
+#endif
+
+// Cache blocks: an mc x kc panel of inputs stays in L1 (48 x 256 floats, 48 KB), a
+// kc x nc panel of weights in L2 (256 x 256 floats, 256 KB). Multiples of mr and nr.
+static const int gemmMC = 48;
+static const int gemmKC = 256;
+static const int gemmNC = 256;
+
+GemmBlocking gemmBlocking() {
+    GemmBlocking blocking = { gemmMR, gemmNR, gemmMC, gemmKC, gemmNC };
+    return blocking;
+}
+
+
+// kc inputs of nc neurons starting at (n0, k0), in panels of nr neurons. Within a
+// panel the nr weights of one input are contiguous, zeros past the last neuron.
+static void packWeightPanels(const float* weights, int inputSize, int numNeurons,
+    int n0, int nc, int k0, int kc, float* packed) {
+
+    for (int j = 0; j < nc; j += gemmNR) {
+        float* panel = packed + (size_t)j * kc;
+        for (int jj = 0; jj < gemmNR; ++jj) {
+            int neuron = n0 + j + jj;
+            if (neuron < numNeurons) {
+                const float* row = weights + (size_t)neuron * inputSize + k0;
+                for (int k = 0; k < kc; ++k) {
+                    panel[k * gemmNR + jj] = row[k];
+                }
+            } else {
+                for (int k = 0; k < kc; ++k) {
+                    panel[k * gemmNR + jj] = 0.0f;
+                }
+            }
+        }
+    }
+}
+
+
+// kc inputs of mc images starting at (m0, k0), in panels of mr images, zeros past the last
+static void packInputPanels(const float* inputs, int inputSize, int batch,
+    int m0, int mc, int k0, int kc, float* packed) {
+
+    for (int i = 0; i < mc; i += gemmMR) {
+        float* panel = packed + (size_t)i * kc;
+        for (int ii = 0; ii < gemmMR; ++ii) {
+            int image = m0 + i + ii;
+            if (image < batch) {
+                const float* row = inputs + (size_t)image * inputSize + k0;
+                for (int k = 0; k < kc; ++k) {
+                    panel[k * gemmMR + ii] = row[k];
+                }
+            } else {
+                for (int k = 0; k < kc; ++k) {
+                    panel[k * gemmMR + ii] = 0.0f;
+                }
+            }
+        }
+    }
+}
+
+
+// c (mr x nr, rows ldc apart) += a b over kc inputs. b is a packed panel, image i of
+// input k is a[i * lda + k * aStep]: lda 1 and aStep mr for a packed panel, the row
+// length and 1 in place. The tile of c lives in registers for the whole loop, each
+// step is one broadcast per image and one multiply-add per accumulator.
+static void gemmMicroKernel(int kc, const float* a, int lda, int aStep, const float* b, float* c, int ldc) {
+#ifdef FLOAT_VEC
+    const int width = (int)floatVecWidth;
+    FloatVec c0[gemmMR], c1[gemmMR];
+    for (int i = 0; i < gemmMR; ++i) {
+        c0[i] = vecLoad(c + i * ldc);
+        c1[i] = vecLoad(c + i * ldc + width);
+    }
+    for (int k = 0; k < kc; ++k) {
+        FloatVec b0 = vecLoad(b);
+        FloatVec b1 = vecLoad(b + width);
+#pragma GCC unroll 8
+        for (int i = 0; i < gemmMR; ++i) {
+            FloatVec ai = vecSet(a[i * lda]);
+            c0[i] = vecMulAdd(ai, b0, c0[i]);
+            c1[i] = vecMulAdd(ai, b1, c1[i]);
+        }
+        a += aStep;
+        b += gemmNR;
+    }
+    for (int i = 0; i < gemmMR; ++i) {
+        vecStore(c + i * ldc, c0[i]);
+        vecStore(c + i * ldc + width, c1[i]);
+    }
+#else
+    float acc[gemmMR][gemmNR];
+    for (int i = 0; i < gemmMR; ++i) {
+        for (int j = 0; j < gemmNR; ++j) {
+            acc[i][j] = c[i * ldc + j];
+        }
+    }
+    for (int k = 0; k < kc; ++k) {
+        for (int i = 0; i < gemmMR; ++i) {
+            for (int j = 0; j < gemmNR; ++j) {
+                acc[i][j] += a[i * lda] * b[j];
+            }
+        }
+        a += aStep;
+        b += gemmNR;
+    }
+    for (int i = 0; i < gemmMR; ++i) {
+        for (int j = 0; j < gemmNR; ++j) {
+            c[i * ldc + j] = acc[i][j];
+        }
+    }
+#endif
+}
+
+
+void gemmLayer_CPU(int numNeurons, int inputSize, int batch,
+    const float* weights, const float* biases, const float* inputs, float* outputs,
+    DataflowTraffic& traffic, ScratchArena& scratch) {
+
+    ArenaScope scope(scratch);
+    const int kcMax = std::min(gemmKC, inputSize);
+    const int ncMax = std::min(gemmNC, (numNeurons + gemmNR - 1) / gemmNR * gemmNR);
+    float* packedWeights = scratch.take((size_t)kcMax * ncMax);
+    float* packedInputs = scratch.take((size_t)gemmMC * kcMax);
+    float* edge = scratch.take(gemmMR * gemmNR); // tiles that hang over the outputs
+
+    for (int b = 0; b < batch; ++b) {
+        std::copy(biases, biases + numNeurons, outputs + (size_t)b * numNeurons);
+    }
+
+    for (int n0 = 0; n0 < numNeurons; n0 += gemmNC) {
+        int nc = std::min(gemmNC, numNeurons - n0);
+        int ncPadded = (nc + gemmNR - 1) / gemmNR * gemmNR;
+        for (int k0 = 0; k0 < inputSize; k0 += gemmKC) {
+            int kc = std::min(gemmKC, inputSize - k0);
+            packWeightPanels(weights, inputSize, numNeurons, n0, ncPadded, k0, kc, packedWeights);
+
+            for (int m0 = 0; m0 < batch; m0 += gemmMC) {
+                int mc = std::min(gemmMC, batch - m0);
+                int mcPadded = (mc + gemmMR - 1) / gemmMR * gemmMR;
+
+                // With a single panel of neurons every input is used once, whole panels of
+                // images are then read in place and only a short last one is packed
+                int packFrom = ncPadded > gemmNR ? 0 : mc / gemmMR * gemmMR;
+                packInputPanels(inputs, inputSize, batch, m0 + packFrom, mcPadded - packFrom, k0, kc,
+                                packedInputs + (size_t)packFrom * kc);
+
+                for (int j = 0; j < nc; j += gemmNR) {
+                    const float* b = packedWeights + (size_t)j * kc;
+                    for (int i = 0; i < mc; i += gemmMR) {
+                        bool inPlace = i < packFrom;
+                        const float* a = inPlace ? inputs + (size_t)(m0 + i) * inputSize + k0 : packedInputs + (size_t)i * kc;
+                        int lda = inPlace ? inputSize : 1;
+                        int aStep = inPlace ? 1 : gemmMR;
+                        float* c = outputs + (size_t)(m0 + i) * numNeurons + n0 + j;
+                        int mr = std::min(gemmMR, mc - i);
+                        int nr = std::min(gemmNR, nc - j);
+                        if (mr == gemmMR && nr == gemmNR) {
+                            gemmMicroKernel(kc, a, lda, aStep, b, c, numNeurons);
+                            continue;
+                        }
+                        // Through a full tile, the padding rows and columns are thrown away
+                        std::fill(edge, edge + gemmMR * gemmNR, 0.0f);
+                        for (int ii = 0; ii < mr; ++ii) {
+                            std::copy(c + ii * numNeurons, c + ii * numNeurons + nr, edge + ii * gemmNR);
+                        }
+                        gemmMicroKernel(kc, a, lda, aStep, b, edge, gemmNR);
+                        for (int ii = 0; ii < mr; ++ii) {
+                            std::copy(edge + ii * gemmNR, edge + ii * gemmNR + nr, c + ii * numNeurons);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Weights packed once for the whole batch, inputs once per block of nc neurons,
+    // every partial sum read and written once per block of kc inputs
+    int neuronBlocks = (numNeurons + gemmNC - 1) / gemmNC;
+    int inputBlocks = (inputSize + gemmKC - 1) / gemmKC;
+    traffic.weightBytes += ((size_t)numNeurons * inputSize + numNeurons) * sizeof(float);
+    traffic.inputBytes += (size_t)neuronBlocks * batch * inputSize * sizeof(float);
+    traffic.psumBytes += (2 * (size_t)inputBlocks + 1) * batch * numNeurons * sizeof(float);
+}
+
+
+double peakFlopLoop(long iterations) {
+    static volatile float sink;
+    (void)sink;
+#ifdef FLOAT_VEC
+    // Converges to 0.1, never denormal
+    const FloatVec scale = vecSet(0.999f), add = vecSet(1e-4f);
+    FloatVec acc[2 * gemmMR];
+    for (int i = 0; i < 2 * gemmMR; ++i) {
+        acc[i] = vecSet(0.01f * i);
+    }
+    for (long n = 0; n < iterations; ++n) {
+#pragma GCC unroll 16
+        for (int i = 0; i < 2 * gemmMR; ++i) {
+            acc[i] = vecMulAdd(acc[i], scale, add);
+        }
+    }
+    FloatVec total = acc[0];
+    for (int i = 1; i < 2 * gemmMR; ++i) {
+        total = vecAdd(total, acc[i]);
+    }
+    sink = vecSum(total);
+    return 2.0 * floatVecWidth * 2 * gemmMR * iterations;
+#else
+    float acc[gemmMR * gemmNR];
+    for (int i = 0; i < gemmMR * gemmNR; ++i) {
+        acc[i] = 0.01f * i;
+    }
+    for (long n = 0; n < iterations; ++n) {
+        for (int i = 0; i < gemmMR * gemmNR; ++i) {
+            acc[i] = acc[i] * 0.999f + 1e-4f;
+        }
+    }
+    float total = 0.0f;
+    for (int i = 0; i < gemmMR * gemmNR; ++i) {
+        total += acc[i];
+    }
+    sink = total;
+    return 2.0 * gemmMR * gemmNR * iterations;
+#endif
+}
+
+
+double bandwidthLoop(const float* data, size_t n, int passes) {
+    static volatile float sink;
+    (void)sink;
+    float total = 0.0f;
+    for (int pass = 0; pass < passes; ++pass) {
+        size_t i = 0;
+#ifdef FLOAT_VEC
+        const size_t width = floatVecWidth;
+        FloatVec sum0 = vecSet(0.0f), sum1 = sum0, sum2 = sum0, sum3 = sum0;
+        for (; i + 4 * width <= n; i += 4 * width) {
+            sum0 = vecAdd(sum0, vecLoad(data + i));
+            sum1 = vecAdd(sum1, vecLoad(data + i + width));
+            sum2 = vecAdd(sum2, vecLoad(data + i + 2 * width));
+            sum3 = vecAdd(sum3, vecLoad(data + i + 3 * width));
+        }
+        total += vecSum(vecAdd(vecAdd(sum0, sum1), vecAdd(sum2, sum3)));
+#endif
+        float sums[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        for (; i + 4 <= n; i += 4) {
+            sums[0] += data[i];
+            sums[1] += data[i + 1];
+            sums[2] += data[i + 2];
+            sums[3] += data[i + 3];
+        }
+        for (; i < n; ++i) {
+            sums[0] += data[i];
+        }
+        total += sums[0] + sums[1] + sums[2] + sums[3];
+    }
+    sink = total;
+    return (double)passes * n * sizeof(float);
+}
+
+
+size_t gemmScratchFloats(int numNeurons, int inputSize) {
+    size_t kc = std::min(gemmKC, inputSize);
+    size_t nc = std::min(gemmNC, (numNeurons + gemmNR - 1) / gemmNR * gemmNR);
+    return ScratchArena::roundUp(kc * nc) + ScratchArena::roundUp(gemmMC * kc) +
+           ScratchArena::roundUp(gemmMR * gemmNR);
+}
+
+
+// Output positions im2col copies per gemmLayer_CPU call, a multiple of every mr. Keeps
+// the patches of a block in L2 whatever the image size.
+static const int convPositionBlock = 192;
+
+// Direct convolution tile: output channels that share one load of an input row, and
+// output rows accumulated before the next tile. 8 x 4 rows of 28 are 3.5 KB.
+static const int convChannelTile = 8;
+static const int convRowTile = 4;
+
+
+const char* convAlgorithmName(ConvAlgorithm algorithm) {
+    return algorithm == CONV_DIRECT ? "direct" : "im2col";
+}
+
+
+// im2col of the count output positions from first, in raster order
+static void im2colRows(const ConvShape& shape, const float* image, int first, int count, float* patches) {
+    const int k = shape.kernel;
+    const int outWidth = shape.outWidth();
+    for (int p = 0; p < count; ++p) {
+        int oy = (first + p) / outWidth;
+        int ox = (first + p) % outWidth;
+        float* patch = patches + (size_t)p * shape.patchSize();
+        for (int ic = 0; ic < shape.inChannels; ++ic) {
+            for (int ky = 0; ky < k; ++ky) {
+                float* dst = patch + (ic * k + ky) * k;
+                int iy = oy * shape.stride + ky - shape.padding;
+                if (iy < 0 || iy >= shape.height) {
+                    std::fill(dst, dst + k, 0.0f);
+                    continue;
+                }
+                const float* row = image + ((size_t)ic * shape.height + iy) * shape.width;
+                for (int kx = 0; kx < k; ++kx) {
+                    int ix = ox * shape.stride + kx - shape.padding;
+                    dst[kx] = ix >= 0 && ix < shape.width ? row[ix] : 0.0f;
+                }
+            }
+        }
+    }
+}
+
+
+void im2col(const ConvShape& shape, const float* image, float* patches) {
+    im2colRows(shape, image, 0, shape.outHeight() * shape.outWidth(), patches);
+}
+
+
+bool convShapesMatch(const ConvShape& shape, ConstTensorView weights, ConstTensorView biases,
+                     ConstTensorView input, ConstTensorView output) {
+    return shape.inChannels > 0 && shape.outChannels > 0 && shape.kernel > 0 && shape.stride > 0 &&
+           shape.padding >= 0 && shape.padding < shape.kernel && shape.outHeight() > 0 && shape.outWidth() > 0 &&
+           weights.data && biases.data && input.data && output.data &&
+           weights.contiguous() && input.contiguous() && output.contiguous() &&
+           weights.rows == shape.outChannels && weights.cols == shape.patchSize() &&
+           biases.rows == 1 && biases.cols == shape.outChannels &&
+           input.cols == shape.inputSize() && output.cols == shape.outputSize() && output.rows == input.rows;
+}
+
+
+bool poolShapesMatch(const PoolShape& shape, ConstTensorView input, ConstTensorView output) {
+    return shape.channels > 0 && shape.size > 0 && shape.stride > 0 && shape.outHeight() > 0 && shape.outWidth() > 0 &&
+           input.data && output.data && input.contiguous() && output.contiguous() &&
+           input.cols == shape.inputSize() && output.cols == shape.outputSize() && output.rows == input.rows;
+}
+
+
+// out[c * outStep + ox] += w[c * wStep] * in[ox + offset] for the channels of a tile
+// and ox in [begin, end). One load of the input row serves every channel.
+static void convRowUpdate(int channels, const float* w, int wStep, const float* in, int offset,
+    float* out, size_t outStep, int begin, int end) {
+
+    int ox = begin;
+#ifdef FLOAT_VEC
+    const int width = (int)floatVecWidth;
+    for (; ox + width <= end; ox += width) {
+        FloatVec x = vecLoad(in + ox + offset);
+        for (int c = 0; c < channels; ++c) {
+            float* o = out + c * outStep + ox;
+            vecStore(o, vecMulAdd(vecSet(w[c * wStep]), x, vecLoad(o)));
+        }
+    }
+#endif
+    for (; ox < end; ++ox) {
+        float x = in[ox + offset];
+        for (int c = 0; c < channels; ++c) {
+            out[c * outStep + ox] += w[c * wStep] * x;
+        }
+    }
+}
+
+
+static void deinterleaveRow(const float* row, int width, int stride, int phaseLength, float* phases) {
+    for (int r = 0; r < stride; ++r) {
+        float* phase = phases + (size_t)r * phaseLength;
+        for (int x = r, j = 0; x < width; x += stride, ++j) {
+            phase[j] = row[x];
+        }
+    }
+}
+
+
+static void conv2dDirect(const ConvShape& shape, const float* weights, const float* biases,
+    const float* image, float* output, DataflowTraffic& traffic, ScratchArena& scratch) {
+
+    const int k = shape.kernel;
+    const int outHeight = shape.outHeight();
+    const int outWidth = shape.outWidth();
+    const size_t plane = (size_t)outHeight * outWidth;
+    const size_t inPlane = (size_t)shape.height * shape.width;
+    const int phaseLength = (shape.width + shape.stride - 1) / shape.stride;
+
+    ArenaScope scope(scratch);
+    float* phases = shape.stride > 1 ? scratch.take((size_t)shape.stride * phaseLength) : NULL;
+
+    for (int oc0 = 0; oc0 < shape.outChannels; oc0 += convChannelTile) {
+        int channels = std::min(convChannelTile, shape.outChannels - oc0);
+        for (int oy0 = 0; oy0 < outHeight; oy0 += convRowTile) {
+            int rows = std::min(convRowTile, outHeight - oy0);
+            float* tile = output + oc0 * plane + (size_t)oy0 * outWidth;
+            for (int c = 0; c < channels; ++c) {
+                std::fill(tile + c * plane, tile + c * plane + (size_t)rows * outWidth, biases[oc0 + c]);
+            }
+
+            for (int ic = 0; ic < shape.inChannels; ++ic) {
+                const float* channel = image + ic * inPlane;
+                for (int ky = 0; ky < k; ++ky) {
+                    for (int oy = oy0; oy < oy0 + rows; ++oy) {
+                        int iy = oy * shape.stride + ky - shape.padding;
+                        if (iy < 0 || iy >= shape.height) {
+                            continue;
+                        }
+                        const float* row = channel + (size_t)iy * shape.width;
+                        if (phases) {
+                            deinterleaveRow(row, shape.width, shape.stride, phaseLength, phases);
+                        }
+                        for (int kx = 0; kx < k; ++kx) {
+                            // Output columns whose input column is inside the image
+                            int offset = kx - shape.padding;
+                            int begin = offset < 0 ? (-offset + shape.stride - 1) / shape.stride : 0;
+                            int last = shape.width - 1 - offset;
+                            int end = last < 0 ? 0 : std::min(outWidth, last / shape.stride + 1);
+                            const float* w = weights + ((size_t)oc0 * shape.inChannels + ic) * k * k + ky * k + kx;
+                            float* out = output + oc0 * plane + (size_t)oy * outWidth;
+                            if (phases) {
+                                // Column ox stride + offset is column ox + q of phase r
+                                int r = (offset % shape.stride + shape.stride) % shape.stride;
+                                int q = (offset - r) / shape.stride;
+                                convRowUpdate(channels, w, shape.patchSize(), phases + (size_t)r * phaseLength,
+                                    q, out, plane, begin, end);
+                            } else {
+                                convRowUpdate(channels, w, shape.patchSize(), row, offset, out, plane, begin, end);
+                            }
+                        }
+                    }
+                }
+            }
+
+            // Every weight of the channel tile and the input rows under the tile per tile,
+            // the tile itself written once with the biases and once with the sums
+            int inputRows = std::min(shape.height, (rows - 1) * shape.stride + k);
+            traffic.weightBytes += ((size_t)channels * shape.patchSize() + channels) * sizeof(float);
+            traffic.inputBytes += (size_t)shape.inChannels * inputRows * shape.width * sizeof(float);
+            traffic.psumBytes += 2 * (size_t)channels * rows * outWidth * sizeof(float);
+        }
+    }
+}
+
+
+static void conv2dIm2col(const ConvShape& shape, const float* weights, const float* biases,
+    const float* image, float* output, DataflowTraffic& traffic, ScratchArena& scratch) {
+
+    ArenaScope scope(scratch);
+    const int positions = shape.outHeight() * shape.outWidth();
+    const int block = std::min(convPositionBlock, positions);
+    float* patches = scratch.take((size_t)block * shape.patchSize());
+    float* products = scratch.take((size_t)block * shape.outChannels);
+
+    for (int p0 = 0; p0 < positions; p0 += block) {
+        int count = std::min(block, positions - p0);
+        im2colRows(shape, image, p0, count, patches);
+        gemmLayer_CPU(shape.outChannels, shape.patchSize(), count, weights, biases, patches, products, traffic, scratch);
+
+        // Positions x channels out of the product, channels x positions into the image
+        for (int c = 0; c < shape.outChannels; ++c) {
+            float* dst = output + (size_t)c * positions + p0;
+            for (int p = 0; p < count; ++p) {
+                dst[p] = products[(size_t)p * shape.outChannels + c];
+            }
+        }
+    }
+
+    // The patches are written once on top of what the products read
+    traffic.inputBytes += (size_t)positions * shape.patchSize() * sizeof(float);
+    traffic.psumBytes += 2 * (size_t)positions * shape.outChannels * sizeof(float);
+}
+
+
+void conv2d_CPU(ConvAlgorithm algorithm, const ConvShape& shape, ConstTensorView weights,
+    ConstTensorView biases, ConstTensorView input, TensorView output,
+    DataflowTraffic& traffic, ScratchArena& scratch) {
+
+    traffic = DataflowTraffic();
+    for (int image = 0; image < input.rows; ++image) {
+        if (algorithm == CONV_DIRECT) {
+            conv2dDirect(shape, weights.data, biases.data, input.row(image), output.row(image), traffic, scratch);
+        } else {
+            conv2dIm2col(shape, weights.data, biases.data, input.row(image), output.row(image), traffic, scratch);
+        }
+    }
+}
+
+
+size_t conv2dScratchFloats(ConvAlgorithm algorithm, const ConvShape& shape) {
+    if (algorithm == CONV_DIRECT) {
+        int phaseLength = (shape.width + shape.stride - 1) / shape.stride;
+        return shape.stride > 1 ? ScratchArena::roundUp((size_t)shape.stride * phaseLength) : 0;
+    }
+    size_t block = std::min(convPositionBlock, shape.outHeight() * shape.outWidth());
+    return ScratchArena::roundUp(block * shape.patchSize()) + ScratchArena::roundUp(block * shape.outChannels) +
+           gemmScratchFloats(shape.outChannels, shape.patchSize());
+}
+
+
+static void pool2dDirect(PoolType type, const PoolShape& shape, const float* image, float* output) {
+    const int outHeight = shape.outHeight();
+    const int outWidth = shape.outWidth();
+    const float scale = 1.0f / (shape.size * shape.size);
+    for (int c = 0; c < shape.channels; ++c) {
+        const float* channel = image + (size_t)c * shape.height * shape.width;
+        for (int oy = 0; oy < outHeight; ++oy) {
+            for (int ox = 0; ox < outWidth; ++ox) {
+                const float* window = channel + (size_t)oy * shape.stride * shape.width + ox * shape.stride;
+                float result = type == POOL_MAX ? window[0] : 0.0f;
+                for (int ky = 0; ky < shape.size; ++ky) {
+                    for (int kx = 0; kx < shape.size; ++kx) {
+                        float x = window[ky * shape.width + kx];
+                        result = type == POOL_MAX ? std::max(result, x) : result + x;
+                    }
+                }
+                *output++ = type == POOL_MAX ? result : result * scale;
+            }
+        }
+    }
+}
+
+
+// Per channel, plane ky * size + kx holds the input at offset (ky, kx) of every window.
+// The outputs are then an elementwise max or sum over the planes, whole vectors at a time.
+static void pool2dIm2col(PoolType type, const PoolShape& shape, const float* image, float* output,
+    ScratchArena& scratch) {
+
+    ArenaScope scope(scratch);
+    const int outHeight = shape.outHeight();
+    const int outWidth = shape.outWidth();
+    const int positions = outHeight * outWidth;
+    const int offsets = shape.size * shape.size;
+    const float scale = 1.0f / offsets;
+    float* planes = scratch.take((size_t)offsets * positions);
+
+    for (int c = 0; c < shape.channels; ++c) {
+        const float* channel = image + (size_t)c * shape.height * shape.width;
+        for (int ky = 0; ky < shape.size; ++ky) {
+            for (int kx = 0; kx < shape.size; ++kx) {
+                float* plane = planes + (size_t)(ky * shape.size + kx) * positions;
+                for (int oy = 0; oy < outHeight; ++oy) {
+                    const float* row = channel + (size_t)(oy * shape.stride + ky) * shape.width + kx;
+                    for (int ox = 0; ox < outWidth; ++ox) {
+                        *plane++ = row[ox * shape.stride];
+                    }
+                }
+            }
+        }
+
+        float* out = output + (size_t)c * positions;
+        int p = 0;
+#ifdef FLOAT_VEC
+        const int width = (int)floatVecWidth;
+        for (; p + width <= positions; p += width) {
+            FloatVec result = vecLoad(planes + p);
+            for (int o = 1; o < offsets; ++o) {
+                FloatVec x = vecLoad(planes + (size_t)o * positions + p);
+                result = type == POOL_MAX ? vecMax(result, x) : vecAdd(result, x);
+            }
+            vecStore(out + p, type == POOL_MAX ? result : vecMul(result, vecSet(scale)));
+        }
+#endif
+        for (; p < positions; ++p) {
+            float result = planes[p];
+            for (int o = 1; o < offsets; ++o) {
+                float x = planes[(size_t)o * positions + p];
+                result = type == POOL_MAX ? std::max(result, x) : result + x;
+            }
+            out[p] = type == POOL_MAX ? result : result * scale;
+        }
+    }
+}
+
+
+void pool2d_CPU(ConvAlgorithm algorithm, PoolType type, const PoolShape& shape,
+    ConstTensorView input, TensorView output, ScratchArena& scratch) {
+
+    for (int image = 0; image < input.rows; ++image) {
+        if (algorithm == CONV_DIRECT) {
+            pool2dDirect(type, shape, input.row(image), output.row(image));
+        } else {
+            pool2dIm2col(type, shape, input.row(image), output.row(image), scratch);
+        }
+    }
+}
+
+
+size_t pool2dScratchFloats(ConvAlgorithm algorithm, const PoolShape& shape) {
+    if (algorithm == CONV_DIRECT) {
+        return 0;
+    }
+    return ScratchArena::roundUp((size_t)shape.size * shape.size * shape.outHeight() * shape.outWidth());
+}
+
+
+template <int InputSize, int TileSize, int Neurons>
+static void processTiles_weightStationaryFixed_CPU(const float* weights, const float* biases,
+    const float* inputs, float* outputs, DataflowTraffic& traffic) {
+
+    static_assert(InputSize % TileSize == 0, "the tile size must divide the input size");
+    const int numTiles = InputSize / TileSize;
+
+    float accumulators[Neurons];
+    for (int n = 0; n < Neurons; ++n) {
+        accumulators[n] = outputs[n];
+    }
+
+    for (int tileIndex = 0; tileIndex < numTiles; ++tileIndex) {
+        const float* input_tile = inputs + tileIndex * TileSize;
+        const float* weights_tile = weights + tileIndex * TileSize;
+
+        // Every neuron sums its tile in input order like matrixMulCPU,
+        // the Neurons independent sums are interleaved instead of run one after another
+        float temp_sum[Neurons];
+        for (int n = 0; n < Neurons; ++n) {
+            temp_sum[n] = 0.0f;
+        }
+        for (int i = 0; i < TileSize; ++i) {
+            for (int n = 0; n < Neurons; ++n) {
+                temp_sum[n] += input_tile[i] * weights_tile[n * InputSize + i];
+            }
+        }
+        for (int n = 0; n < Neurons; ++n) {
+            accumulators[n] += temp_sum[n];
+        }
+    }
+
+    for (int n = 0; n < Neurons; ++n) {
+        outputs[n] = accumulators[n] + biases[n];
+    }
+
+    // Same counts as the generic weight stationary schedule
+    traffic.weightBytes += ((size_t)Neurons * InputSize + Neurons) * sizeof(float);
+    traffic.inputBytes += (size_t)InputSize * sizeof(float);
+    traffic.psumBytes += 2 * (size_t)Neurons * (numTiles + 1) * sizeof(float);
+}
+
+
+struct FixedLayerEntry {
+    int inputSize;
+    int inputTileSize;
+    int numNeurons;
+    FixedLayerKernel kernel;
+};
+
+// The deployed shapes: fc1 (784 -> 10) at every tile size dividing 784 that is worth
+// trying for inputTileSize, and fc2 (10 -> 10) which runs as a single tile
+static const FixedLayerEntry fixedLayerKernels[] = {
+    {784, 14, 10, &processTiles_weightStationaryFixed_CPU<784, 14, 10> },
+    {784, 28, 10, &processTiles_weightStationaryFixed_CPU<784, 28, 10> },
+    {784, 49, 10, &processTiles_weightStationaryFixed_CPU<784, 49, 10> },
+    {784, 56, 10, &processTiles_weightStationaryFixed_CPU<784, 56, 10> },
+    {784, 112, 10, &processTiles_weightStationaryFixed_CPU<784, 112, 10> },
+    {784, 196, 10, &processTiles_weightStationaryFixed_CPU<784, 196, 10> },
+    {784, 392, 10, &processTiles_weightStationaryFixed_CPU<784, 392, 10> },
+    {784, 784, 10, &processTiles_weightStationaryFixed_CPU<784, 784, 10> },
+    {10, 10, 10, &processTiles_weightStationaryFixed_CPU<10, 10, 10> },
+};
+
+
+FixedLayerKernel findFixedLayerKernel(int numNeurons, int inputSize, int inputTileSize) {
+    for (const FixedLayerEntry& entry : fixedLayerKernels) {
+        if (entry.inputSize == inputSize && entry.inputTileSize == inputTileSize && entry.numNeurons == numNeurons) {
+            return entry.kernel;
+        }
+    }
+    return NULL;
+}
+
+
+// Largest set of blocks one kernel takes, with the padding take() adds to each
+size_t layerScratchFloats(int numNeurons, int inputTileSize) {
+    size_t weightStationary = ScratchArena::roundUp((size_t)numNeurons * inputTileSize);
+    size_t neuronTiled = ScratchArena::roundUp((size_t)outputNeuronsTileSize * inputTileSize) +
+                         ScratchArena::roundUp(outputNeuronsTileSize);
+    return std::max(weightStationary, neuronTiled);
+}
+
+
+template <typename W>
+static bool shapesMatch(Tensor2D<const W> weights, ConstTensorView biases,
+                        ConstTensorView input, ConstTensorView output, int inputTileSize) {
+    return weights.data && biases.data && input.data && output.data &&
+           weights.contiguous() && input.contiguous() && output.contiguous() && biases.rows == 1 && biases.cols == weights.rows &&
+           input.cols == weights.cols && output.cols == weights.rows && output.rows == input.rows &&
+           inputTileSize > 0 && weights.cols % inputTileSize == 0;
+}
+
+bool layerShapesMatch(ConstTensorView weights, ConstTensorView biases,
+                      ConstTensorView input, ConstTensorView output, int inputTileSize) {
+    return shapesMatch(weights, biases, input, output, inputTileSize);
+}
+
+bool layerShapesMatch(ConstHalfView weights, ConstTensorView biases,
+                      ConstTensorView input, ConstTensorView output, int inputTileSize) {
+    return shapesMatch(weights, biases, input, output, inputTileSize);
+}
+
+
+// Images from which gemmLayer_CPU beats the compiled kernel run once per image
+static const int gemmFixedKernelMinBatch = 4;
+
+int gemmMinBatch(Dataflow dataflow, int numNeurons, int inputSize, int inputTileSize) {
+    if (dataflow == DATAFLOW_AUTO) {
+        dataflow = selectDataflow(numNeurons, inputSize, inputTileSize);
+    }
+    bool fixedKernel = dataflow == WEIGHT_STATIONARY && findFixedLayerKernel(numNeurons, inputSize, inputTileSize);
+    return fixedKernel ? gemmFixedKernelMinBatch : 2;
+}
+
+
+Dataflow denseLayer_CPU(Dataflow dataflow, ConstTensorView weights, ConstTensorView biases,
+    ConstTensorView input, TensorView output, int inputTileSize,
+    DataflowTraffic& traffic, ScratchArena& scratch) {
+
+    if (input.rows < gemmMinBatch(dataflow, weights.rows, weights.cols, inputTileSize)) {
+        DataflowTraffic total = DataflowTraffic();
+        Dataflow ran = dataflow;
+        for (int r = 0; r < input.rows; ++r) {
+            // The schedules accumulate into the output row
+            std::fill(output.row(r), output.row(r) + output.cols, 0.0f);
+            ran = processTiles_CPU(dataflow, weights.rows, weights.cols, inputTileSize,
+                weights.data, biases.data, input.row(r), output.row(r), traffic, scratch);
+            total.weightBytes += traffic.weightBytes;
+            total.inputBytes += traffic.inputBytes;
+            total.psumBytes += traffic.psumBytes;
+        }
+        traffic = total;
+        return ran;
+    }
+
+    traffic = DataflowTraffic();
+    gemmLayer_CPU(weights.rows, weights.cols, input.rows,
+        weights.data, biases.data, input.data, output.data, traffic, scratch);
+    return BLOCKED_GEMM;
+}
+
+
+// Bytes each schedule moves for one input vector, matches the counters above
+DataflowTraffic predictTraffic(Dataflow dataflow, int numNeurons, int inputSize, int inputTileSize) {
+    size_t numTiles = inputSize / inputTileSize;
+    size_t neuronTiles = (numNeurons + outputNeuronsTileSize - 1) / outputNeuronsTileSize;
+
+    DataflowTraffic traffic;
+    traffic.weightBytes = ((size_t)numNeurons * inputSize + numNeurons) * sizeof(float);
+
+    switch (dataflow) {
+    case OUTPUT_STATIONARY:
+        traffic.inputBytes = neuronTiles * inputSize * sizeof(float);
+        traffic.psumBytes = numNeurons * sizeof(float);
+        break;
+    case WEIGHT_STATIONARY:
+    case INPUT_STATIONARY:
+    default:
+        // The weight stationary tile spans every neuron, so both read each input once
+        // and spill the partial sums once per input tile
+        traffic.inputBytes = inputSize * sizeof(float);
+        traffic.psumBytes = 2 * numNeurons * (numTiles + 1) * sizeof(float);
+        break;
+    }
+    return traffic;
+}
+
+
+Dataflow selectDataflow(int numNeurons, int inputSize, int inputTileSize) {
+    Dataflow best = WEIGHT_STATIONARY;
+    size_t bestBytes = (size_t)-1;
+
+    const Dataflow candidates[] = {WEIGHT_STATIONARY, OUTPUT_STATIONARY, INPUT_STATIONARY};
+    for (Dataflow dataflow : candidates) {
+        DataflowTraffic traffic = predictTraffic(dataflow, numNeurons, inputSize, inputTileSize);
+        size_t bytes = traffic.weightBytes + traffic.inputBytes + traffic.psumBytes;
+        if (bytes < bestBytes) {
+            best = dataflow;
+            bestBytes = bytes;
+        }
+    }
+    return best;
+}
+
+
+const char* dataflowName(Dataflow dataflow) {
+    switch (dataflow) {
+    case OUTPUT_STATIONARY: return "output stationary";
+    case INPUT_STATIONARY: return "input stationary";
+    case DATAFLOW_AUTO: return "auto";
+    case SPARSE_CSR: return "sparse csr";
+    case FOLDED_INPUT: return "folded input";
+    case BLOCKED_GEMM: return "blocked gemm";
+    default: return "weight stationary";
+    }
+}
+
+
+Dataflow processTiles_CPU(Dataflow dataflow, int numNeurons,
+    int inputSize, int inputTileSize,
+    const float* weights, const float* biases,
+    const float* inputs, float* outputs,
+    DataflowTraffic& traffic, ScratchArena& scratch) {
+
+    if (dataflow == DATAFLOW_AUTO) {
+        dataflow = selectDataflow(numNeurons, inputSize, inputTileSize);
+    }
+
+    traffic = DataflowTraffic();
+
+    switch (dataflow) {
+    case OUTPUT_STATIONARY:
+        processTiles_outputStationary_CPU(numNeurons, inputSize, inputTileSize, weights, biases, inputs, outputs, traffic, scratch);
+        break;
+    case INPUT_STATIONARY:
+        processTiles_inputStationary_CPU(numNeurons, inputSize, inputTileSize, weights, biases, inputs, outputs, traffic, scratch);
+        break;
+    default:
+        // Shapes without a specialization run the generic kernel
+        if (FixedLayerKernel kernel = findFixedLayerKernel(numNeurons, inputSize, inputTileSize)) {
+            kernel(weights, biases, inputs, outputs, traffic);
+        } else {
+            processTiles_weightStatinary_CPU(numNeurons, inputSize, inputTileSize, weights, biases, inputs, outputs, traffic, scratch);
+        }
+        break;
+    }
+    return dataflow;
+}
+
+int getMaxIn(const float* v, size_t n){
+    int maxIndex = std::distance(v, std::max_element(v, v + n));
+    return maxIndex;
+}
+
+int getMaxIn(FloatBuffer& v){
+    return getMaxIn(v.data(), v.size());
+}
+
+void topK(const float* v, size_t n, int k, int* indices) {
+    if (k <= 0) {
+        return;
+    }
+    int found = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (found == k && v[i] <= v[indices[k - 1]]) {
+            continue;
+        }
+        // Insertion into the candidates, the smallest drops off the end when full
+        int slot = found < k ? found++ : k - 1;
+        while (slot > 0 && v[indices[slot - 1]] < v[i]) {
+            indices[slot] = indices[slot - 1];
+            slot--;
+        }
+        indices[slot] = (int)i;
+    }
+}
+
+void relu(FloatBuffer& v) {
+    relu(v.data(), v.size());
+}
+
+// Row by row, in and out may be the same view
+void relu(ConstTensorView in, TensorView out) {
+    for (int r = 0; r < in.rows; ++r) {
+        relu(in.row(r), out.row(r), in.cols);
+    }
+}
+
+void leakyRelu(ConstTensorView in, TensorView out, float slope) {
+    for (int r = 0; r < in.rows; ++r) {
+        leakyRelu(in.row(r), out.row(r), in.cols, slope);
+    }
+}
+
+void sigmoid(ConstTensorView in, TensorView out) {
+    for (int r = 0; r < in.rows; ++r) {
+        sigmoid(in.row(r), out.row(r), in.cols);
+    }
+}
+
+void softmax(ConstTensorView in, TensorView out) {
+    for (int r = 0; r < in.rows; ++r) {
+        softmax(in.row(r), out.row(r), in.cols);
+    }
+}
+
+void log_softmax(ConstTensorView in, TensorView out) {
+    for (int r = 0; r < in.rows; ++r) {
+        log_softmax(in.row(r), out.row(r), in.cols);
+    }
+}
+
+void relu(TensorView t) {
+    relu(t, t);
+}
+
+void log_softmax(TensorView t) {
+    log_softmax(t, t);
+}
+
+int getMaxIn(ConstTensorView t, int row) {
+    return getMaxIn(t.row(row), t.cols);
+}
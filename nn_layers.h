@@ -0,0 +1,735 @@
+#ifndef NN_LAYERS_H
+#define NN_LAYERS_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+
+
+// Layer kernels shared by the inference library and the FPGA host.
+// Nothing in here keeps state between calls, everything is passed in.
+
+
+// Image size in 1D array = 28 x 28
+const int inputSize = 784; // 28x28 input image
+
+// Number of neurons in the hidden layer
+// This code assumes a single hidden layer
+// If you use more layers modify accordingly
+const int numNeurons = 10;
+
+// Tile size to perform matrix multiplication
+// Experiment with this size and report those values
+const int inputTileSize = 28;
+
+// Number of output neurons in one weight tile
+const int outputNeuronsTileSize = 10;
+
+
+// Weights and activations start on their own cache line, so contexts running
+// on different cores never share a line and SIMD loads of a row stay aligned
+const size_t cacheLineSize = 64;
+
+
+// Test hook: heap allocations made for layer buffers and arenas, plus every
+// operator new when the host replaces it (main.cpp -check_allocs does).
+// Inference must leave it unchanged once a context has warmed up.
+inline std::atomic<unsigned long long>& heapAllocations() {
+    static std::atomic<unsigned long long> count(0);
+    return count;
+}
+
+template <typename T>
+struct CacheAlignedAllocator {
+    typedef T value_type;
+
+    CacheAlignedAllocator() {}
+    template <typename U> CacheAlignedAllocator(const CacheAlignedAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        void* p = NULL;
+        size_t bytes = (n * sizeof(T) + cacheLineSize - 1) / cacheLineSize * cacheLineSize;
+        if (posix_memalign(&p, cacheLineSize, bytes) != 0) {
+            throw std::bad_alloc();
+        }
+        heapAllocations().fetch_add(1, std::memory_order_relaxed);
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t) { free(p); }
+
+    template <typename U> struct rebind { typedef CacheAlignedAllocator<U> other; };
+};
+
+template <typename T, typename U>
+bool operator==(const CacheAlignedAllocator<T>&, const CacheAlignedAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const CacheAlignedAllocator<T>&, const CacheAlignedAllocator<U>&) { return false; }
+
+typedef std::vector<float, CacheAlignedAllocator<float> > FloatBuffer;
+
+// Raw fp16 or bf16 bit patterns, see WeightFormat
+typedef std::vector<uint16_t, CacheAlignedAllocator<uint16_t> > HalfBuffer;
+
+
+// Bump allocator over one cache aligned block that is allocated once, take() never
+// touches the heap. Everything taken after a mark is returned by rewinding to it.
+// Running out throws std::bad_alloc, the block was sized too small.
+class ScratchArena {
+public:
+    ScratchArena() : base_(NULL), capacity_(0), used_(0) {}
+    ~ScratchArena() { free(base_); }
+
+    // Replaces the block, callers size it from the model shape before the first inference
+    void reserve(size_t floats) {
+        void* p = NULL;
+        if (posix_memalign(&p, cacheLineSize, roundUp(floats) * sizeof(float)) != 0) {
+            throw std::bad_alloc();
+        }
+        heapAllocations().fetch_add(1, std::memory_order_relaxed);
+        free(base_);
+        base_ = static_cast<float*>(p);
+        capacity_ = roundUp(floats);
+        used_ = 0;
+    }
+
+    // Every block starts on a cache line
+    float* take(size_t floats) {
+        size_t n = roundUp(floats);
+        if (used_ + n > capacity_) {
+            throw std::bad_alloc();
+        }
+        float* p = base_ + used_;
+        used_ += n;
+        return p;
+    }
+
+    size_t mark() const { return used_; }
+    void rewind(size_t mark) { used_ = mark; }
+
+    // Floats reserved for a set of blocks, including the padding take() adds
+    static size_t roundUp(size_t floats) {
+        const size_t perLine = cacheLineSize / sizeof(float);
+        return (floats + perLine - 1) / perLine * perLine;
+    }
+
+private:
+    ScratchArena(const ScratchArena&);
+    ScratchArena& operator=(const ScratchArena&);
+
+    float* base_;
+    size_t capacity_;
+    size_t used_;
+};
+
+// Returns the scratch a kernel took when it goes out of scope
+class ArenaScope {
+public:
+    explicit ArenaScope(ScratchArena& arena) : arena_(arena), mark_(arena.mark()) {}
+    ~ArenaScope() { arena_.rewind(mark_); }
+private:
+    ArenaScope(const ArenaScope&);
+    ArenaScope& operator=(const ArenaScope&);
+
+    ScratchArena& arena_;
+    size_t mark_;
+};
+
+
+// Non-owning row-major view of rows x cols floats, consecutive rows are stride
+// floats apart. A vector is a single row, a batch has one row per image. Views
+// carry the shape from the model files to the last layer, so every stage works
+// on exactly rows x cols elements whatever the size of the buffer behind it.
+template <typename T>
+struct Tensor2D {
+    T* data;
+    int rows;
+    int cols;
+    int stride;
+
+    Tensor2D() : data(NULL), rows(0), cols(0), stride(0) {}
+    Tensor2D(T* data_, int rows_, int cols_) : data(data_), rows(rows_), cols(cols_), stride(cols_) {}
+    Tensor2D(T* data_, int rows_, int cols_, int stride_) : data(data_), rows(rows_), cols(cols_), stride(stride_) {}
+
+    // A view of float converts to a view of const float
+    template <typename U>
+    Tensor2D(const Tensor2D<U>& other) : data(other.data), rows(other.rows), cols(other.cols), stride(other.stride) {}
+
+    T* row(int r) const { return data + (size_t)r * stride; }
+    size_t size() const { return (size_t)rows * cols; }
+    bool contiguous() const { return stride == cols || rows <= 1; }
+
+    // Rows first to last, for callers that need a subset of a batch
+    Tensor2D rowRange(int first, int count) const { return Tensor2D(row(first), count, cols, stride); }
+};
+
+typedef Tensor2D<float> TensorView;
+typedef Tensor2D<const float> ConstTensorView;
+
+// Views the first rows x cols floats of a buffer, empty when the buffer is too small
+inline TensorView viewOf(FloatBuffer& buffer, int rows, int cols) {
+    return buffer.size() >= (size_t)rows * cols ? TensorView(buffer.data(), rows, cols) : TensorView();
+}
+inline ConstTensorView viewOf(const FloatBuffer& buffer, int rows, int cols) {
+    return buffer.size() >= (size_t)rows * cols ? ConstTensorView(buffer.data(), rows, cols) : ConstTensorView();
+}
+
+
+// Loop orders available for the CPU layers
+// WEIGHT_STATIONARY keeps a weight tile and accumulates partial sums through memory
+// OUTPUT_STATIONARY keeps the partial sums of a neuron tile until all inputs are consumed
+// INPUT_STATIONARY keeps an input tile and visits every neuron tile with it
+// DATAFLOW_AUTO picks the schedule with the least predicted traffic for each layer
+// SPARSE_CSR is not requested, it is reported for layers run from a pruned CSR copy
+// FOLDED_INPUT is reported for fc1 run on raw pixels through a PixelLayer
+// BLOCKED_GEMM is reported for layers run on more than one image by gemmLayer_CPU
+enum Dataflow {
+    WEIGHT_STATIONARY,
+    OUTPUT_STATIONARY,
+    INPUT_STATIONARY,
+    DATAFLOW_AUTO,
+    SPARSE_CSR,
+    FOLDED_INPUT,
+    BLOCKED_GEMM
+};
+
+// Bytes moved between the layer arrays and the tiles held by a schedule
+struct DataflowTraffic {
+    size_t weightBytes;
+    size_t inputBytes;
+    size_t psumBytes;
+};
+
+// Compressed sparse row copy of a pruned weight matrix, only non-zero weights are kept.
+// Row r holds values[rowStart[r] .. rowStart[r + 1]) at columns colIndex[...].
+struct SparseMatrix {
+    int rows;
+    int cols;
+    std::vector<int> rowStart; // rows + 1 entries
+    std::vector<int> colIndex;
+    FloatBuffer values;
+
+    SparseMatrix() : rows(0), cols(0) {}
+    size_t nonZeros() const { return values.size(); }
+    double density() const { return rows && cols ? (double)values.size() / ((double)rows * cols) : 0.0; }
+};
+
+// Layers with at most this fraction of non-zero weights run from their CSR copy
+const double sparseDensityThreshold = 0.5;
+
+
+// Element type of stored weights. The 16-bit formats halve the bytes a layer streams,
+// the kernels widen them to fp32 in registers and accumulate in fp32.
+// WEIGHTS_FP16 is IEEE binary16, WEIGHTS_BF16 is the top half of an fp32.
+// WEIGHTS_BINARY (+1 / -1) and WEIGHTS_TERNARY (-1 / 0 / +1) are bit-packed with a
+// scale per row, see BitMatrix.
+enum WeightFormat {
+    WEIGHTS_FP32,
+    WEIGHTS_FP16,
+    WEIGHTS_BF16,
+    WEIGHTS_BINARY,
+    WEIGHTS_TERNARY,
+    WEIGHTS_LOW_RANK  // fp32, as two factors, see LowRankLayer
+};
+
+inline bool isHalfFormat(WeightFormat format) {
+    return format == WEIGHTS_FP16 || format == WEIGHTS_BF16;
+}
+
+inline bool isBitFormat(WeightFormat format) {
+    return format == WEIGHTS_BINARY || format == WEIGHTS_TERNARY;
+}
+
+// Picked from the file name: .f16 is fp16, .bf16 is bf16, .b1 binary, .t2 ternary,
+// .lr low rank, anything else fp32
+WeightFormat weightFormatFromPath(const std::string& path);
+const char* weightFormatName(WeightFormat format);
+
+inline float bfloat16ToFloat(uint16_t h) {
+    uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Rounds to nearest even, NaN stays NaN
+inline uint16_t floatToBFloat16(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    if ((bits & 0x7fffffffu) > 0x7f800000u) {
+        return (uint16_t)((bits >> 16) | 0x40);
+    }
+    return (uint16_t)((bits + 0x7fffu + ((bits >> 16) & 1)) >> 16);
+}
+
+inline float halfToFloat(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000u | (mantissa << 13); // inf or NaN
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        // Subnormal, shift the mantissa up to an implicit leading one
+        exponent = 113;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Rounds to nearest even, overflows to inf
+inline uint16_t floatToHalf(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    uint32_t magnitude = bits & 0x7fffffffu;
+
+    if (magnitude >= 0x7f800000u) {
+        return sign | 0x7c00 | (magnitude > 0x7f800000u ? 0x200 : 0);
+    }
+    if (magnitude >= 0x477ff000u) {
+        return sign | 0x7c00; // rounds past 65504
+    }
+    if (magnitude < 0x38800000u) {
+        // Subnormal or zero in fp16, align the mantissa to 2^-24 steps
+        if (magnitude < 0x33000000u) {
+            return sign;
+        }
+        uint32_t exponent = magnitude >> 23;
+        uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+        uint32_t shift = 126 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if (rest > midpoint || (rest == midpoint && (half & 1))) {
+            half++;
+        }
+        return sign | (uint16_t)half;
+    }
+    uint32_t rounded = magnitude + 0xfffu + ((magnitude >> 13) & 1);
+    return sign | (uint16_t)((rounded - 0x38000000u) >> 13);
+}
+
+
+// normalizeImage maps a pixel to (pixel / 255 - imageMean) / imageStd, the statistics
+// of the MNIST training set
+const float imageMean = 0.1307f;
+const float imageStd = 0.3081f;
+
+void normalizeImage(const unsigned char* imageData, size_t imageSize, float* normalizedImage);
+void normalizeImage(const unsigned char* imageData, TensorView normalizedImage); // rows x cols pixels
+void normalizeImage(const unsigned char* imageData, size_t imageSize, FloatBuffer& normalizedImage);
+
+FloatBuffer loadFloatsFromFile(const std::string& filename);
+bool loadModelParameters(const std::string& weightsPath, const std::string& biasesPath,
+                         FloatBuffer& weightsBuffer, FloatBuffer& biases);
+
+void matrixMulCPU(
+    const float* input_tile,  // Tile of the Input vector
+    const float* weights_tile, // Tile of the Weights matrix
+    int input_tile_size,                  // Size of the input tile
+    int output_neurons_tile_size,         // Size of the output tile (number of neurons in this tile)
+    float* output_tile                // Output vector tile
+);
+
+// Builds the CSR copy of a dense rows x cols matrix, exact zeros are dropped
+void denseToSparse(ConstTensorView dense, SparseMatrix& sparse);
+
+// Zeroes the round(sparsity * n) weights of smallest magnitude, ties in index
+// order, the same choice prune_weights.py makes
+void pruneByMagnitude(float* weights, size_t n, double sparsity);
+
+// Sparse counterpart of matrixMulCPU over whole rows, output = weights * input
+void sparseMatrixMulCPU(
+    const SparseMatrix& weights, // CSR weights, rows x cols
+    const float* input,          // Input vector, cols entries
+    float* output                // Output vector, rows entries
+);
+
+// denseLayer_CPU for a CSR layer, every row of input, biases added
+void sparseLayer_CPU(const SparseMatrix& weights, ConstTensorView biases,
+    ConstTensorView input, TensorView output, DataflowTraffic& traffic);
+
+// Weights held as 16-bit patterns, rows x cols
+typedef Tensor2D<const uint16_t> ConstHalfView;
+
+void convertWeights(const float* weights, size_t n, WeightFormat format, uint16_t* converted);
+HalfBuffer loadHalfsFromFile(const std::string& filename);
+
+// Whether this build widens a vector of 16-bit weights per instruction: F16C (-mf16c)
+// on x86, NEON on ARM, where fp16 also needs FP16=1. Widened one at a time in software,
+// fp16 and bf16 layers only halve the weight memory and run slower than fp32.
+bool halfConvertsInHardware(WeightFormat format);
+
+// 16-bit counterpart of matrixMulCPU over whole rows, output = weights * input.
+// Uses F16C or NEON conversions when the build enables them.
+void halfMatrixMulCPU(
+    WeightFormat format,   // WEIGHTS_FP16 or WEIGHTS_BF16
+    ConstHalfView weights, // Weights, rows x cols
+    const float* input,    // Input vector, cols entries
+    float* output          // Output vector, rows entries
+);
+
+// denseLayer_CPU for a 16-bit layer, every row of input, biases added.
+// Each neuron keeps its sum in a register until the row is done, so it runs and
+// is counted as the output stationary schedule.
+void halfLayer_CPU(WeightFormat format, ConstHalfView weights, ConstTensorView biases,
+    ConstTensorView input, TensorView output, DataflowTraffic& traffic);
+
+// A binary or ternary matrix, 64 entries to a word, rows x words words per plane.
+// Bit c % 64 of word c / 64 in signs is set for -1. Ternary matrices also keep
+// nonZero, set for every entry that is not 0; a binary entry is never 0. Bits past
+// cols are 0 in both planes. Entry (r, c) stands for scales[r] * (-1, 0 or +1).
+struct BitMatrix {
+    int rows;
+    int cols;
+    int words; // per row, (cols + 63) / 64
+    bool ternary;
+    std::vector<uint64_t> signs;
+    std::vector<uint64_t> nonZero;
+    FloatBuffer scales;
+
+    BitMatrix() : rows(0), cols(0), words(0), ternary(false) {}
+    size_t bytes() const { return (signs.size() + nonZero.size()) * sizeof(uint64_t) + scales.size() * sizeof(float); }
+};
+
+// Packs one row of n values, padding bits cleared, and returns its scale.
+// Binary keeps the sign, x < 0 is -1, and scales by mean(|x|) (XNOR-Net).
+// Ternary zeroes |x| <= 0.7 mean(|x|) and scales by the mean |x| of the rest
+// (ternary weight networks). nonZero is only written for ternary rows.
+float packBitRow(const float* values, int n, bool ternary, uint64_t* signs, uint64_t* nonZero);
+
+// Quantizes a dense rows x cols matrix row by row with packBitRow
+void quantizeToBits(ConstTensorView weights, bool ternary, BitMatrix& packed);
+
+// The dense matrix a BitMatrix stands for, rows x cols floats
+void unpackBits(const BitMatrix& packed, float* weights);
+
+// Reads the file bitpack_weights.py writes, false when it is not one
+bool loadBitMatrixFromFile(const std::string& filename, BitMatrix& packed);
+
+// denseLayer_CPU for a BitMatrix, every row of input, biases added. Each input row is
+// packed like the weights (binary activations for a binary layer, ternary for a
+// ternary one) and every output is an integer dot product of bit planes scaled back:
+// binary  popcount(xnor(w, x)) - popcount(xor(w, x)) = cols - 2 popcount(w ^ x)
+// ternary popcount(both) - 2 popcount(both & (w ^ x)), both = wNonZero & xNonZero
+void bitLayer_CPU(const BitMatrix& weights, ConstTensorView biases,
+    ConstTensorView input, TensorView output, DataflowTraffic& traffic, ScratchArena& scratch);
+
+// Floats of scratch bitLayer_CPU takes for inputs of cols entries
+size_t bitLayerScratchFloats(int cols);
+
+// A rows x cols layer stored as two factors, weights ~= left right. right (rank x cols)
+// runs first and projects the input onto rank values, left (rows x rank) maps those to
+// the outputs. Weights and multiply-adds drop from rows cols to rank (rows + cols).
+struct LowRankLayer {
+    int rows;
+    int cols;
+    int rank;
+    FloatBuffer right; // rank x cols
+    FloatBuffer left;  // rows x rank
+
+    LowRankLayer() : rows(0), cols(0), rank(0) {}
+    size_t bytes() const { return (right.size() + left.size()) * sizeof(float); }
+};
+
+// Truncated SVD of a dense matrix, keeping the rank largest singular values (clamped
+// to 1 .. min(rows, cols)). The smaller Gram matrix, W W^T or W^T W, is diagonalized
+// by cyclic Jacobi in double; the other factor is one product with W. The orthonormal
+// singular vectors are the factor on the Gram side, the singular values stay in the other.
+void factorizeLowRank(ConstTensorView weights, int rank, LowRankLayer& factors);
+
+// The dense rows x cols matrix left right
+void expandLowRank(const LowRankLayer& factors, float* weights);
+
+// Reads the file lowrank_weights.py writes, false when it is not one
+bool loadLowRankFromFile(const std::string& filename, LowRankLayer& factors);
+
+// denseLayer_CPU for a LowRankLayer, every row of input, biases added: the rank
+// projections first, then the outputs from them. Both are dot products over
+// contiguous rows, counted like the output stationary schedule.
+void lowRankLayer_CPU(const LowRankLayer& factors, ConstTensorView biases,
+    ConstTensorView input, TensorView output, DataflowTraffic& traffic, ScratchArena& scratch);
+
+// Floats of scratch lowRankLayer_CPU takes
+size_t lowRankScratchFloats(int rank);
+
+// A layer on raw pixels with normalizeImage folded into it. The normalization is
+// affine, so W ((p / 255 - mean) / std) + b = (W / (255 std)) p + (b - (mean / std) sum(W)).
+// The weights are stored transposed, the outputs of one pixel are contiguous.
+struct PixelLayer {
+    int rows;            // outputs
+    int cols;            // pixels
+    FloatBuffer weights; // cols x rows
+    FloatBuffer biases;  // rows
+
+    PixelLayer() : rows(0), cols(0) {}
+};
+
+// Folds normalizeImage into a dense rows x cols layer, the row sums are taken in double
+void foldInputNormalization(ConstTensorView weights, ConstTensorView biases, PixelLayer& folded);
+
+// denseLayer_CPU for a PixelLayer on output.rows images of layer.cols pixels each,
+// biases added. Input stationary: every pixel is widened to float once and multiplied
+// into its column of weights. Black pixels add nothing and are skipped, on an MNIST
+// digit that is about four fifths of them.
+void pixelLayer_CPU(const PixelLayer& layer, const unsigned char* pixels, TensorView output,
+    DataflowTraffic& traffic);
+
+// Copies a numNeurons x inputTileSize tile starting at column weightsStartIndex
+void loadWeights(int weightsStartIndex,int numNeurons,int inputTileSize,int inputSize,
+    const float* weights,float* temp_wts);
+
+// The layer kernels accumulate into outputs, the caller zeroes it first.
+// Tile copies are taken from scratch and returned before the kernel exits.
+void processTiles_weightStatinary_CPU(int numNeurons,
+    int inputSize, // Size of the input array
+    int inputTileSize,  // Tile size of the Input vector
+    const float* weights, // Weights array
+    const float* biases,  // biases array
+    const float* inputs,  // inputs array
+    float* outputs,  // outputs array
+    DataflowTraffic& traffic,  // bytes moved, accumulated
+    ScratchArena& scratch  // tile buffers
+    );
+void processTiles_outputStationary_CPU(int numNeurons,
+    int inputSize, // Size of the input array
+    int inputTileSize,  // Tile size of the Input vector
+    const float* weights, // Weights array
+    const float* biases,  // biases array
+    const float* inputs,  // inputs array
+    float* outputs,  // outputs array
+    DataflowTraffic& traffic,  // bytes moved, accumulated
+    ScratchArena& scratch  // tile buffers
+    );
+void processTiles_inputStationary_CPU(int numNeurons,
+    int inputSize, // Size of the input array
+    int inputTileSize,  // Tile size of the Input vector
+    const float* weights, // Weights array
+    const float* biases,  // biases array
+    const float* inputs,  // inputs array
+    float* outputs,  // outputs array
+    DataflowTraffic& traffic,  // bytes moved, accumulated
+    ScratchArena& scratch  // tile buffers
+    );
+
+// Weight stationary over a batch, every weight tile is loaded once and applied
+// to all images before the next one, like the FPGA kernel
+void processTiles_batch_CPU(int numNeurons,
+    int inputSize, // Size of the input array
+    int inputTileSize,  // Tile size of the Input vector
+    int batch,  // Number of images in the batch
+    const float* weights, // Weights array
+    const float* biases,  // biases array
+    const float* inputs,  // inputs array (batch x inputSize)
+    float* outputs,  // outputs array (batch x numNeurons)
+    DataflowTraffic& traffic,  // bytes moved, accumulated
+    ScratchArena& scratch  // tile buffers
+    );
+
+// Floats of scratch any of the kernels above takes for one layer shape
+size_t layerScratchFloats(int numNeurons, int inputTileSize);
+
+// Register and cache blocking of gemmLayer_CPU for the build target. The micro-kernel
+// keeps an mr x nr tile of outputs in registers (mr images by nr neurons) while it
+// runs through kc inputs. Weights are packed kc x nc at a time into panels nr neurons
+// wide, sized to stay in L2, and inputs mc x kc into panels mr images tall, sized for
+// L1. Packing pads the edges with zeros so every tile runs the same loop.
+struct GemmBlocking {
+    int mr, nr; // 6 x 16 with AVX2 (FMA when the target has it), 4 x 8 with SSE2, 6 x 8 on AArch64, 4 x 8 on ARMv7 NEON, 4 x 4 scalar
+    int mc, kc, nc;
+};
+GemmBlocking gemmBlocking();
+
+// A fully connected layer on a batch as one matrix product,
+// outputs (batch x numNeurons) = inputs (batch x inputSize) weights^T + biases,
+// blocked as described by GemmBlocking. Each weight is read once for the whole batch
+// and then reused from the packed panel, nr neurons by mr images per register tile.
+void gemmLayer_CPU(int numNeurons, int inputSize, int batch,
+    const float* weights, const float* biases, const float* inputs, float* outputs,
+    DataflowTraffic& traffic, ScratchArena& scratch);
+
+// Floats of scratch gemmLayer_CPU takes for a layer shape, any batch
+size_t gemmScratchFloats(int numNeurons, int inputSize);
+
+// Smallest batch denseLayer_CPU runs as one gemmLayer_CPU call, fewer images run the
+// schedule image by image. Against the compiled kernels of fc1 and fc2 packing only pays
+// off from 4 images (-gemm_report crossover of 3 to 4 with SSE2 and AVX2), every other
+// shape and schedule is slower than the GEMM from 2 images on.
+int gemmMinBatch(Dataflow dataflow, int numNeurons, int inputSize, int inputTileSize);
+
+// Independent multiply-adds on registers only, as many accumulators as the micro-kernel,
+// so timing it gives the peak one core reaches with this build. Returns the flops done.
+double peakFlopLoop(long iterations);
+
+// Streams passes times through n floats with independent vector accumulators, so
+// timing it over a buffer larger than the caches gives the read bandwidth a layer
+// kernel can reach, over a small one the bandwidth of that cache. Returns the bytes read.
+double bandwidthLoop(const float* data, size_t n, int passes);
+
+// Convolution and pooling layers keep an image channel by channel, channels x height x
+// width floats in one row of a view, one row per image. That is the order torch
+// flattens a CNN in, so the flatten in front of a fully connected layer is the same
+// row read as a vector. Conv weights are outChannels x (inChannels x kernel x kernel),
+// row-major like conv.weight, and the biases one per output channel.
+struct ConvShape {
+    int inChannels, height, width; // of the input
+    int outChannels;
+    int kernel, stride, padding; // square kernel, padding rows and columns of zeros on every side
+
+    int outHeight() const { return (height + 2 * padding - kernel) / stride + 1; }
+    int outWidth() const { return (width + 2 * padding - kernel) / stride + 1; }
+    int patchSize() const { return inChannels * kernel * kernel; }
+    int inputSize() const { return inChannels * height * width; }
+    int outputSize() const { return outChannels * outHeight() * outWidth(); }
+};
+
+// size x size windows stride apart over every channel, no padding
+struct PoolShape {
+    int channels, height, width;
+    int size, stride;
+
+    int outHeight() const { return (height - size) / stride + 1; }
+    int outWidth() const { return (width - size) / stride + 1; }
+    int inputSize() const { return channels * height * width; }
+    int outputSize() const { return channels * outHeight() * outWidth(); }
+};
+
+enum PoolType {
+    POOL_MAX,
+    POOL_AVERAGE // over the size x size inputs of the window
+};
+
+// How a conv or pooling layer runs, picked per layer.
+// CONV_IM2COL copies the patch under every output position into a row (im2col) and
+// multiplies the rows with gemmLayer_CPU, output positions standing in for images.
+// Pooling gathers one plane per window offset instead and reduces the planes with
+// vector max / add. Costs the copies, runs on the fastest kernel we have.
+// CONV_DIRECT reads the image in place. A tile of output rows and channels stays in
+// L1 while every input channel and kernel offset is added into it, row by row. With a
+// stride above 1 each input row is split into stride phases first, so the row updates
+// still run on contiguous vectors.
+enum ConvAlgorithm {
+    CONV_IM2COL,
+    CONV_DIRECT
+};
+const char* convAlgorithmName(ConvAlgorithm algorithm);
+
+// The patch of every output position of one image, outHeight x outWidth rows of
+// patchSize floats in conv.weight order, zeros where the patch covers the padding
+void im2col(const ConvShape& shape, const float* image, float* patches);
+
+// weights outChannels x patchSize, biases 1 x outChannels, input images x inputSize,
+// output images x outputSize, all contiguous. Checked once when the layers are set up.
+bool convShapesMatch(const ConvShape& shape, ConstTensorView weights, ConstTensorView biases,
+                     ConstTensorView input, ConstTensorView output);
+bool poolShapesMatch(const PoolShape& shape, ConstTensorView input, ConstTensorView output);
+
+// Runs the layer on every row of input with the shapes already checked, biases added.
+// traffic is reset to the bytes moved.
+void conv2d_CPU(ConvAlgorithm algorithm, const ConvShape& shape, ConstTensorView weights,
+    ConstTensorView biases, ConstTensorView input, TensorView output,
+    DataflowTraffic& traffic, ScratchArena& scratch);
+void pool2d_CPU(ConvAlgorithm algorithm, PoolType type, const PoolShape& shape,
+    ConstTensorView input, TensorView output, ScratchArena& scratch);
+
+// Floats of scratch the kernels take for a layer shape
+size_t conv2dScratchFloats(ConvAlgorithm algorithm, const ConvShape& shape);
+size_t pool2dScratchFloats(ConvAlgorithm algorithm, const PoolShape& shape);
+
+// The activations of a conv or pooling layer as the vectors of a fully connected
+// layer, the same rows with channels x height x width columns. Empty when they differ.
+inline ConstTensorView flatten(ConstTensorView activations, int channels, int height, int width) {
+    return activations.cols == channels * height * width ? activations : ConstTensorView();
+}
+
+// Weight stationary layer with every size fixed at compile time, same loop order and
+// traffic as processTiles_weightStatinary_CPU but with the neuron accumulators in registers
+typedef void (*FixedLayerKernel)(const float* weights, const float* biases,
+                                 const float* inputs, float* outputs, DataflowTraffic& traffic);
+
+// The specialization for a shape, NULL when it was not instantiated
+FixedLayerKernel findFixedLayerKernel(int numNeurons, int inputSize, int inputTileSize);
+
+// Runs one layer with the requested schedule, traffic is reset to the bytes it moved
+// Returns the schedule that ran, DATAFLOW_AUTO is resolved per layer shape
+Dataflow processTiles_CPU(Dataflow dataflow, int numNeurons,
+    int inputSize, int inputTileSize,
+    const float* weights, const float* biases,
+    const float* inputs, float* outputs,
+    DataflowTraffic& traffic, ScratchArena& scratch);
+
+// A fully connected layer: weights is outputs x inputs, biases is 1 x outputs,
+// input is images x inputs and output is images x outputs. The tile size must
+// divide the inputs. Checked once when the views are set up, not per inference.
+bool layerShapesMatch(ConstTensorView weights, ConstTensorView biases,
+                      ConstTensorView input, ConstTensorView output, int inputTileSize);
+bool layerShapesMatch(ConstHalfView weights, ConstTensorView biases,
+                      ConstTensorView input, ConstTensorView output, int inputTileSize);
+
+// Runs the layer on every row of input with layerShapesMatch already checked.
+// Batches of at least gemmMinBatch rows run gemmLayer_CPU, smaller ones the requested
+// schedule row by row.
+Dataflow denseLayer_CPU(Dataflow dataflow, ConstTensorView weights, ConstTensorView biases,
+    ConstTensorView input, TensorView output, int inputTileSize,
+    DataflowTraffic& traffic, ScratchArena& scratch);
+
+DataflowTraffic predictTraffic(Dataflow dataflow, int numNeurons, int inputSize, int inputTileSize);
+Dataflow selectDataflow(int numNeurons, int inputSize, int inputTileSize);
+const char* dataflowName(Dataflow dataflow);
+
+// Activations, vectorized with AVX2 or NEON when the build targets them.
+// in and out may be the same buffer, nothing is allocated.
+void relu(const float* in, float* out, size_t n);
+void leakyRelu(const float* in, float* out, size_t n, float slope); // x > 0 ? x : slope * x
+void sigmoid(const float* in, float* out, size_t n);
+void softmax(const float* in, float* out, size_t n);                // probabilities
+void log_softmax(const float* in, float* out, size_t n);
+float logSumExp(const float* v, size_t n); // log(sum(exp(v))), v - logSumExp(v) are the log-probabilities
+
+// In place
+void relu(float* v, size_t n);
+void leakyRelu(float* v, size_t n, float slope);
+void sigmoid(float* v, size_t n);
+void softmax(float* v, size_t n);
+void log_softmax(float* v, size_t n);
+
+// exp and log approximations behind the activations, bounds in nn_layers.cpp
+float fastExp(float x); // within 1 ulp on [-87, 88.7], 0 below
+float fastLog(float x); // within 1 ulp for normal x > 0
+
+int getMaxIn(const float* v, size_t n);
+
+// Indices of the k largest values, largest first, ties to the lower index.
+// Keeps a sorted list of k candidates, the rest of v is never ordered.
+void topK(const float* v, size_t n, int k, int* indices);
+
+// Row by row, only rows x cols elements are touched. out has the shape of in and may be in.
+void relu(ConstTensorView in, TensorView out);
+void leakyRelu(ConstTensorView in, TensorView out, float slope);
+void sigmoid(ConstTensorView in, TensorView out);
+void softmax(ConstTensorView in, TensorView out);
+void log_softmax(ConstTensorView in, TensorView out);
+void relu(TensorView t);
+void log_softmax(TensorView t);
+int getMaxIn(ConstTensorView t, int row);
+
+void relu(FloatBuffer& v);
+void log_softmax(FloatBuffer& v);
+int getMaxIn(FloatBuffer& v);
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "metrics.h"
+
+
+// Hardware counters read around each pipeline stage, opt-in because
+// perf_event_open needs perf_event_paranoid <= 2 or CAP_PERFMON.
+//
+// perf_event_open counts one thread, so every thread that runs a stage (the main
+// thread, -threads workers, the server's batcher) opens its own group the first time
+// it does once -perf enabled them. A thread adds its totals to the process totals when
+// it exits, the report adds those of the reporting thread; threads still running at
+// the report are left out.
+enum PerfEvent {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    NUM_PERF_EVENTS
+};
+
+inline const char* perfEventName(int event) {
+    static const char* names[NUM_PERF_EVENTS] = {"cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"};
+    return names[event];
+}
+
+
+// Totals of the threads that have finished counting, and the events any of them had
+struct PerfTotals {
+    std::mutex mutex;
+    uint64_t totals[NUM_STAGES][NUM_PERF_EVENTS];
+    uint64_t samples[NUM_STAGES];
+    bool counted[NUM_PERF_EVENTS];
+    std::atomic<bool> requested; // -perf, threads open their counters on first use
+    std::atomic<bool> warned;
+
+    PerfTotals() : requested(false), warned(false) {
+        memset(totals, 0, sizeof(totals));
+        memset(samples, 0, sizeof(samples));
+        memset(counted, 0, sizeof(counted));
+    }
+};
+
+inline PerfTotals& perfTotals() {
+    static PerfTotals totals;
+    return totals;
+}
+
+
+class PerfCounters {
+public:
+    PerfCounters() : enabled_(false), tried_(false), leaderFd_(-1), numOpen_(0) {
+        for (int e = 0; e < NUM_PERF_EVENTS; ++e) {
+            fds_[e] = -1;
+            slot_[e] = -1;
+        }
+        memset(totals_, 0, sizeof(totals_));
+        memset(samples_, 0, sizeof(samples_));
+    }
+
+    ~PerfCounters() {
+        flush();
+        close();
+    }
+
+    // Opens the counters for the calling thread, events the host does not support are skipped
+    bool open() {
+        tried_ = true;
+        uint32_t types[NUM_PERF_EVENTS] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+        };
+        uint64_t configs[NUM_PERF_EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+
+        for (int e = 0; e < NUM_PERF_EVENTS; ++e) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[e];
+            attr.config = configs[e];
+            attr.disabled = (leaderFd_ == -1) ? 1 : 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+
+            int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, leaderFd_, 0);
+            if (fd == -1) {
+                continue;
+            }
+            if (leaderFd_ == -1) {
+                leaderFd_ = fd;
+            }
+            fds_[e] = fd;
+            slot_[e] = numOpen_++;
+        }
+
+        enabled_ = leaderFd_ != -1;
+        if (!enabled_ && !perfTotals().warned.exchange(true)) {
+            fprintf(stderr, "perf_event_open failed, hardware counters are disabled\n");
+        }
+        return enabled_;
+    }
+
+    // Opens the counters of this thread the first time a stage runs on it after -perf
+    bool ready() {
+        if (!tried_ && perfTotals().requested.load(std::memory_order_relaxed)) {
+            open();
+        }
+        return enabled_;
+    }
+
+    void close() {
+        for (int e = 0; e < NUM_PERF_EVENTS; ++e) {
+            if (fds_[e] != -1) {
+                ::close(fds_[e]);
+                fds_[e] = -1;
+            }
+        }
+        leaderFd_ = -1;
+        enabled_ = false;
+    }
+
+    bool enabled() const { return enabled_; }
+
+    void start() {
+        ioctl(leaderFd_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leaderFd_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    // Adds the counts since start() to the totals of a stage
+    void stop(Stage stage, int images) {
+        ioctl(leaderFd_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+        uint64_t values[1 + NUM_PERF_EVENTS];
+        if (read(leaderFd_, values, sizeof(values)) < (ssize_t)sizeof(uint64_t)) {
+            return;
+        }
+        for (int e = 0; e < NUM_PERF_EVENTS; ++e) {
+            if (slot_[e] != -1 && (uint64_t)slot_[e] < values[0]) {
+                totals_[stage][e] += values[1 + slot_[e]];
+            }
+        }
+        samples_[stage] += images;
+    }
+
+    // Adds the totals of this thread to the process totals and clears them
+    void flush() {
+        if (!enabled_) {
+            return;
+        }
+        PerfTotals& process = perfTotals();
+        std::lock_guard<std::mutex> lock(process.mutex);
+        for (int s = 0; s < NUM_STAGES; ++s) {
+            for (int e = 0; e < NUM_PERF_EVENTS; ++e) {
+                process.totals[s][e] += totals_[s][e];
+            }
+            process.samples[s] += samples_[s];
+        }
+        for (int e = 0; e < NUM_PERF_EVENTS; ++e) {
+            process.counted[e] = process.counted[e] || slot_[e] != -1;
+        }
+        memset(totals_, 0, sizeof(totals_));
+        memset(samples_, 0, sizeof(samples_));
+    }
+
+private:
+    bool enabled_;
+    bool tried_;
+    int leaderFd_;
+    int numOpen_;
+    int fds_[NUM_PERF_EVENTS];
+    int slot_[NUM_PERF_EVENTS]; // Position of the event in the group read, -1 if not open
+    uint64_t totals_[NUM_STAGES][NUM_PERF_EVENTS];
+    uint64_t samples_[NUM_STAGES];
+};
+
+// Counters are per thread, see ready()
+inline PerfCounters& perfCounters() {
+    static thread_local PerfCounters counters;
+    return counters;
+}
+
+// -perf: the calling thread opens its counters now, every other one on first use
+inline bool perfCountersEnable() {
+    perfTotals().requested = true;
+    return perfCounters().open();
+}
+
+// IPC and per-image misses of every stage that ran at least once, summed over the
+// threads that have exited and the calling one. Nothing is printed when no thread counted.
+inline void perfCountersReport(FILE* out) {
+    perfCounters().flush();
+    PerfTotals& process = perfTotals();
+    std::lock_guard<std::mutex> lock(process.mutex);
+    bool any = false;
+    for (int e = 0; e < NUM_PERF_EVENTS; ++e) {
+        any = any || process.counted[e];
+    }
+    if (!any) {
+        return;
+    }
+
+    fprintf(out, "stage,images,ipc,l1d_misses_per_image,llc_misses_per_image,branch_misses_per_image\n");
+    for (int s = 0; s < NUM_STAGES; ++s) {
+        if (process.samples[s] == 0) {
+            continue;
+        }
+        fprintf(out, "%s,%llu", stageName(s), (unsigned long long)process.samples[s]);
+        if (process.counted[PERF_CYCLES] && process.counted[PERF_INSTRUCTIONS] && process.totals[s][PERF_CYCLES] != 0) {
+            fprintf(out, ",%.3f", (double)process.totals[s][PERF_INSTRUCTIONS] / process.totals[s][PERF_CYCLES]);
+        } else {
+            fprintf(out, ",n/a");
+        }
+        const int perImage[] = {PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_BRANCH_MISSES};
+        for (int event : perImage) {
+            if (process.counted[event]) {
+                fprintf(out, ",%.1f", (double)process.totals[s][event] / process.samples[s]);
+            } else {
+                fprintf(out, ",n/a");
+            }
+        }
+        fprintf(out, "\n");
+    }
+}
+
+
+// Counts the scope into a stage when the counters were opened, otherwise does nothing
+class ScopedPerfCounters {
+public:
+    explicit ScopedPerfCounters(Stage stage, int images = 1) : stage_(stage), images_(images) {
+        if (perfCounters().ready()) {
+            perfCounters().start();
+        }
+    }
+    ~ScopedPerfCounters() {
+        if (perfCounters().enabled()) {
+            perfCounters().stop(stage_, images_);
+        }
+    }
+private:
+    Stage stage_;
+    int images_;
+};
+
+#endif
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""Prunes a raw float32 weight file written by TrainNN.ipynb to a target sparsity.
+
+The weights of smallest magnitude are set to zero, ties in index order, the same
+choice pruneByMagnitude makes in nn_layers.cpp. The output keeps the dense layout,
+so every loader still reads it; the host keeps a CSR copy of any layer that ends
+up at most half non-zero and runs it with the sparse kernel.
+
+    python3 prune_weights.py fc1_weight.bin --sparsity 0.9 -o fc1_weight_s90.bin
+    ./host -fc1_weights=fc1_weight_s90.bin
+
+With the MNIST test set the accuracy of the pruned network is reported for a list
+of sparsities instead, fc1_bias.bin and the fc2 files are read from --model-dir:
+
+    python3 prune_weights.py fc1_weight.bin --report 0,0.5,0.8,0.9,0.95 \\
+        --images t10k-images-idx3-ubyte --labels t10k-labels-idx1-ubyte
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+from weight_tools import load_test_set, read_floats, to_rows
+
+
+def write_floats(path, values):
+    tmp_path = path + ".tmp"
+    with open(tmp_path, "wb") as f:
+        f.write(struct.pack(f"<{len(values)}f", *values))
+    os.replace(tmp_path, path)
+
+
+def prune(weights, sparsity):
+    count = int(min(max(sparsity, 0.0), 1.0) * len(weights) + 0.5)
+    order = sorted(range(len(weights)), key=lambda i: abs(weights[i]))
+    pruned = list(weights)
+    for i in order[:count]:
+        pruned[i] = 0.0
+    return pruned
+
+
+def sparse_rows(rows):
+    # (column, weight) pairs of the kept weights, the CSR layout the host uses
+    return [[(c, w) for c, w in enumerate(row) if w != 0.0] for row in rows]
+
+
+def accuracy(fc1, fc1_bias, fc2, fc2_bias, samples):
+    correct = 0
+    for x, label in samples:
+        hidden = [max(0.0, sum(x[c] * w for c, w in row) + b) for row, b in zip(fc1, fc1_bias)]
+        logits = [sum(h * w for h, w in zip(hidden, row)) + b for row, b in zip(fc2, fc2_bias)]
+        correct += logits.index(max(logits)) == label
+    return correct / len(samples)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("weights", help="raw float32 weights, one row of inputs per output neuron")
+    parser.add_argument("--sparsity", type=float, help="fraction of weights set to zero")
+    parser.add_argument("-o", "--output", help="pruned weight file")
+    parser.add_argument("--report", help="comma separated sparsities to report accuracy for")
+    parser.add_argument("--images", help="MNIST test images (t10k-images-idx3-ubyte)")
+    parser.add_argument("--labels", help="MNIST test labels (t10k-labels-idx1-ubyte)")
+    parser.add_argument("--limit", type=int, default=0, help="only use the first LIMIT test images")
+    parser.add_argument("--model-dir", default=".", help="directory of fc1_bias.bin and the fc2 files")
+    args = parser.parse_args()
+
+    weights = read_floats(args.weights)
+
+    if args.report is None:
+        if args.sparsity is None or args.output is None:
+            sys.exit("give --sparsity and -o, or --report with --images and --labels")
+        pruned = prune(weights, args.sparsity)
+        write_floats(args.output, pruned)
+        kept = sum(w != 0.0 for w in pruned)
+        print(f"{args.output}: {kept} of {len(pruned)} weights kept, density {kept / len(pruned):.4f}")
+        return
+
+    if not args.images or not args.labels:
+        sys.exit("--report needs --images and --labels")
+    fc1_bias = read_floats(os.path.join(args.model_dir, "fc1_bias.bin"))
+    fc2_weight = read_floats(os.path.join(args.model_dir, "fc2_weight.bin"))
+    fc2_bias = read_floats(os.path.join(args.model_dir, "fc2_bias.bin"))
+    if len(weights) % len(fc1_bias) != 0 or len(fc2_weight) != len(fc2_bias) * len(fc1_bias):
+        sys.exit("the weight files do not describe a 784 -> N -> 10 network")
+    fc2 = to_rows(fc2_weight, len(fc2_bias))
+    samples = load_test_set(args.images, args.labels, args.limit)
+
+    print("sparsity,density,nonzeros,accuracy")
+    for sparsity in (float(s) for s in args.report.split(",")):
+        pruned = prune(weights, sparsity)
+        kept = sum(w != 0.0 for w in pruned)
+        fc1 = sparse_rows(to_rows(pruned, len(fc1_bias)))
+        acc = accuracy(fc1, fc1_bias, fc2, fc2_bias, samples)
+        print(f"{sparsity:.2f},{kept / len(pruned):.4f},{kept},{acc:.4f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,172 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+
+// Chrome / Perfetto trace-event recorder shared by capture_image.c and the inference host.
+// Spans are complete ("ph":"X") events tagged with the thread id and the frame id.
+// Both processes stamp CLOCK_MONOTONIC so their files line up when loaded together.
+
+struct TraceEvent {
+    const char* name; // must be a string literal
+    const char* category;
+    uint64_t startNs;
+    uint64_t durationNs;
+    int tid;
+    long frame;
+};
+
+// Events beyond this are dropped and counted
+const int traceCapacity = 1 << 16;
+
+struct Tracer {
+    std::atomic<bool> enabled;
+    std::atomic<int> next;          // slots handed out, never beyond traceCapacity
+    std::atomic<uint64_t> dropped;
+    std::atomic<int> writers;       // threads inside traceRecord, traceFinish waits for them
+    std::string path;
+    TraceEvent* events;
+
+    Tracer() : enabled(false), next(0), dropped(0), writers(0), events(NULL) {}
+};
+
+inline Tracer& tracer() {
+    static Tracer t;
+    return t;
+}
+
+inline bool traceEnabled() {
+    return tracer().enabled.load(std::memory_order_relaxed);
+}
+
+inline uint64_t traceNowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+inline int traceThreadId() {
+    static __thread int tid = 0;
+    if (tid == 0) {
+        tid = (int)syscall(SYS_gettid);
+    }
+    return tid;
+}
+
+// Starts recording, the trace is written to path by traceFinish
+inline void traceStart(const std::string& path) {
+    Tracer& t = tracer();
+    t.path = path;
+    t.events = new TraceEvent[traceCapacity];
+    t.enabled.store(true, std::memory_order_release);
+}
+
+// Enables tracing when MNIST_TRACE names an output file, for programs without options
+inline void traceStartFromEnv() {
+    const char* path = getenv("MNIST_TRACE");
+    if (path && path[0] != '\0') {
+        traceStart(path);
+    }
+}
+
+// A span that ends after traceFinish is ignored. next stops at traceCapacity, so a long
+// running process drops its late spans instead of wrapping the counter.
+inline void traceRecord(const char* name, const char* category, uint64_t startNs, uint64_t endNs, long frame) {
+    Tracer& t = tracer();
+    if (!t.enabled.load()) {
+        return;
+    }
+    t.writers.fetch_add(1);
+    if (!t.enabled.load() || t.events == NULL) {
+        t.writers.fetch_sub(1);
+        return;
+    }
+    int slot = t.next.load(std::memory_order_relaxed);
+    do {
+        if ((unsigned)slot >= (unsigned)traceCapacity) {
+            t.dropped.fetch_add(1, std::memory_order_relaxed);
+            t.writers.fetch_sub(1);
+            return;
+        }
+    } while (!t.next.compare_exchange_weak(slot, slot + 1, std::memory_order_relaxed));
+
+    TraceEvent& e = t.events[slot];
+    e.name = name;
+    e.category = category;
+    e.startNs = startNs;
+    e.durationNs = endNs - startNs;
+    e.tid = traceThreadId();
+    e.frame = frame;
+    t.writers.fetch_sub(1, std::memory_order_release);
+}
+
+// Stops recording and writes the JSON. Spans still open are dropped, the ones being
+// recorded right now are waited for.
+inline bool traceFinish() {
+    Tracer& t = tracer();
+    if (!t.enabled.exchange(false)) {
+        return false;
+    }
+    while (t.writers.load(std::memory_order_acquire) != 0) {
+        sched_yield();
+    }
+
+    FILE* f = fopen(t.path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "Could not open trace file %s\n", t.path.c_str());
+        delete[] t.events;
+        t.events = NULL;
+        return false;
+    }
+
+    int count = std::min(t.next.load(), traceCapacity);
+    int pid = (int)getpid();
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i = 0; i < count; ++i) {
+        const TraceEvent& e = t.events[i];
+        fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"frame\":%ld}}%s\n",
+            e.name, e.category, e.startNs / 1000.0, e.durationNs / 1000.0, pid, e.tid, e.frame,
+            i < count - 1 ? "," : "");
+    }
+    fprintf(f, "],\"otherData\":{\"dropped_events\":%llu}}\n", (unsigned long long)t.dropped.load());
+    fclose(f);
+
+    delete[] t.events;
+    t.events = NULL;
+    return true;
+}
+
+
+// Records the lifetime of the scope, a single relaxed load when tracing is off
+class TraceSpan {
+public:
+    TraceSpan(const char* name, const char* category, long frame)
+        : name_(name), category_(category), frame_(frame), startNs_(0) {
+        if (traceEnabled()) {
+            startNs_ = traceNowNs();
+        }
+    }
+    ~TraceSpan() {
+        if (startNs_ != 0) {
+            traceRecord(name_, category_, startNs_, traceNowNs(), frame_);
+        }
+    }
+private:
+    const char* name_;
+    const char* category_;
+    long frame_;
+    uint64_t startNs_;
+};
+
+#endif
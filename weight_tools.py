@@ -0,0 +1,44 @@
+"""Helpers shared by the weight conversion scripts.
+
+Weight files are the raw little-endian float32 files written by TrainNN.ipynb, the
+test set is the MNIST idx files, normalized the same way as normalizeImage.
+"""
+
+import struct
+import sys
+
+
+def read_floats(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) == 0 or len(data) % 4 != 0:
+        sys.exit(f"{path}: expected a non-empty file of float32 values")
+    return list(struct.unpack(f"<{len(data) // 4}f", data))
+
+
+def read_idx(path, expected_magic):
+    with open(path, "rb") as f:
+        data = f.read()
+    magic, count = struct.unpack(">II", data[:8])
+    if magic != expected_magic:
+        sys.exit(f"{path}: not an MNIST idx file")
+    return data, count
+
+
+def load_test_set(images_path, labels_path, limit):
+    images, count = read_idx(images_path, 0x803)
+    labels, label_count = read_idx(labels_path, 0x801)
+    count = min(count, label_count, limit or count)
+    size = 28 * 28
+    # Same normalization as normalizeImage
+    mean, std = 0.1307, 0.3081
+    samples = []
+    for n in range(count):
+        pixels = images[16 + n * size:16 + (n + 1) * size]
+        samples.append(([(p / 255.0 - mean) / std for p in pixels], labels[8 + n]))
+    return samples
+
+
+def to_rows(weights, rows):
+    cols = len(weights) // rows
+    return [weights[r * cols:(r + 1) * cols] for r in range(rows)]